@@ -0,0 +1,57 @@
+#!/bin/bash
+
+#
+# Compare the quality per bitrate with and without --roi
+#
+# A lossless reference is recorded by a second wf-recorder-x process
+# running at the same time as the tested one. The quality of each
+# recording is then measured against that reference with the FFMpeg
+# 'psnr' and 'ssim' filters.
+#
+# Usage: roi.sh [BITRATE...]
+#
+# Something should be moving on screen during the test (e.g. run-mpv.sh
+# or simply typing in a terminal). Remark: The two recordings are not
+# synchronized on the same compositor frames so the measured quality is
+# only meaningful when comparing the runs between themselves.
+#
+
+APP=../build/wf-recorder-x
+
+DURATION=10s
+
+BITRATES=( "${@:-500k 1M 2M}" )
+BITRATES=( ${BITRATES[*]} )
+
+ENC="-e libx264 -p preset=veryfast -y"
+
+# Record a test file and its lossless reference at the same time
+record () {
+    id="$1"
+    shift
+    rm -f "roi-$id.mkv" "roi-$id-ref.mkv"
+    timeout --signal=SIGINT $DURATION $APP -e ffv1 -f "roi-$id-ref.mkv" > "roi-$id-ref.log" 2>&1 &
+    timeout --signal=SIGINT $DURATION $APP "$@" -f "roi-$id.mkv" > "roi-$id.log" 2>&1
+    wait
+}
+
+# Print the bitrate, PSNR and SSIM of a test file
+measure () {
+    id="$1"
+    bitrate=$(ffprobe -v error -show_entries format=bit_rate -of default=nw=1:nk=1 "roi-$id.mkv")
+    quality=$(ffmpeg -hide_banner -nostats -i "roi-$id.mkv" -i "roi-$id-ref.mkv" \
+                     -lavfi "[0:v][1:v]psnr;[0:v][1:v]ssim" -f null - 2>&1 \
+                  | grep -E -o '(average|All):[0-9.inf]+' | tr '\n' ' ')
+    printf "%-20s %10s bit/s  %s\n" "$id" "$bitrate" "$quality"
+}
+
+for b in "${BITRATES[@]}" ; do
+    record "$b-noroi" $ENC -p b=$b
+    record "$b-roi"   $ENC -p b=$b --roi
+done
+
+echo
+for b in "${BITRATES[@]}" ; do
+    measure "$b-noroi"
+    measure "$b-roi"
+done
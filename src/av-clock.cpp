@@ -0,0 +1,107 @@
+#include "av-clock.hpp"
+#include <time.h>
+#include <cmath>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+// Weight of the new sample in the moving average of the skew. The
+// capture times are jittery (scheduling, PulseAudio latency updates)
+// so the average is slow.
+static const double SMOOTHING = 0.02;
+
+// The drift is only estimated after that delay, before that the
+// jitter of the capture times dominates.
+static const int64_t DRIFT_WARMUP_USEC = 10000000;
+
+// The skew is compensated over that duration.
+static const double CORRECTION_SEC = 10.0;
+
+// Maximum ratio of samples added or dropped. Above 0.5% the change
+// of pitch becomes noticeable.
+static const double MAX_COMPENSATION = 0.005;
+
+// Above that skew, the audio pts are restarted from the capture time
+// (e.g. after a suspend or a long PulseAudio underrun).
+static const int64_t RESYNC_USEC = 200000;
+
+int64_t AVClock::now_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000ll;
+}
+
+void AVClock::add_audio_chunk(int64_t capture_usec, int64_t input_usec,
+    int64_t pts_usec)
+{
+    double skew = pts_usec - to_pts(capture_usec);
+    last_skew = skew;
+    chunks++;
+
+    if (first_usec < 0)
+    {
+        first_usec = capture_usec;
+        first_input_usec = input_usec;
+        avg_skew = skew;
+        avg_offset = 0;
+        return;
+    }
+
+    avg_skew += SMOOTHING * (skew - avg_skew);
+
+    // The drift is the difference of speed between the sound card
+    // clock (counted samples) and the monotonic clock.
+    int64_t elapsed = capture_usec - first_usec;
+    double offset = (input_usec - first_input_usec) - elapsed;
+    avg_offset += SMOOTHING * (offset - avg_offset);
+    if (elapsed >= DRIFT_WARMUP_USEC)
+        drift = avg_offset / elapsed;
+
+    if (!needs_resync())
+        max_skew = std::max(max_skew, std::fabs(skew));
+    sum_abs_skew += std::fabs(avg_skew);
+}
+
+int AVClock::compensation(int distance) const
+{
+    // Cancel the drift and absorb the residual skew progressively. A
+    // positive skew means that too many samples were produced.
+    double delta = -drift * distance
+        - avg_skew * 1e-6 * distance / CORRECTION_SEC;
+
+    double limit = MAX_COMPENSATION * distance;
+    delta = std::max(-limit, std::min(limit, delta));
+    return lrint(delta);
+}
+
+bool AVClock::needs_resync() const
+{
+    return std::fabs(last_skew) > RESYNC_USEC;
+}
+
+void AVClock::resync()
+{
+    // The first chunk is always 'resynced' since the audio starts
+    // after the first video frame.
+    if (chunks > 1)
+        resyncs++;
+
+    // Samples may have been lost so the drift reference restarts at
+    // the next chunk. The last estimate is kept meanwhile.
+    first_usec = -1;
+    avg_skew = 0;
+    last_skew = 0;
+}
+
+std::string AVClock::stats() const
+{
+    std::stringstream s;
+    s << std::fixed << std::setprecision(2)
+      << "A/V skew: " << avg_skew / 1000 << "ms"
+      << " (avg " << (chunks ? sum_abs_skew / chunks / 1000 : 0) << "ms"
+      << ", max " << max_skew / 1000 << "ms)"
+      << ", audio drift: " << drift_ppm() << "ppm"
+      << ", resyncs: " << resyncs;
+    return s.str();
+}
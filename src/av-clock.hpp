@@ -0,0 +1,64 @@
+#ifndef AV_CLOCK_HPP
+#define AV_CLOCK_HPP
+
+#include <stdint.h>
+#include <string>
+
+// The clock shared by the audio and video streams. All timestamps are
+// CLOCK_MONOTONIC in microseconds, which is also the clock used by the
+// compositor for the screencopy presentation times. The origin is the
+// capture time of the first video frame (pts 0).
+//
+// The audio pts are computed by counting samples, so they follow the
+// clock of the sound card. AVClock compares them to the capture time of
+// each audio chunk, estimates the skew and the drift between the two
+// clocks, and tells how many samples must be added or removed to
+// follow the monotonic clock.
+class AVClock
+{
+    int64_t origin_usec = -1;
+
+    int64_t first_usec = -1;        // capture time of the reference chunk
+    int64_t first_input_usec = 0;   // its position in the audio input
+    double last_skew = 0;           // audio pts - capture time (usec)
+    double avg_skew = 0;            // smoothed skew
+    double avg_offset = 0;          // smoothed input time - elapsed time
+    double drift = 0;               // estimated drift (usec per usec)
+
+    // Statistics
+    int64_t chunks = 0;
+    double max_skew = 0;
+    double sum_abs_skew = 0;
+    int resyncs = 0;
+
+    public:
+    static int64_t now_usec();
+
+    void set_origin(int64_t usec) { origin_usec = usec; }
+    bool has_origin() const { return origin_usec >= 0; }
+
+    /* The pts (relative to the origin) of something captured at 'usec' */
+    int64_t to_pts(int64_t usec) const { return usec - origin_usec; }
+
+    /* Record an audio chunk captured at 'capture_usec' (monotonic).
+     * 'input_usec' is the duration of the audio read before that chunk
+     * and 'pts_usec' the pts it will get without any correction */
+    void add_audio_chunk(int64_t capture_usec, int64_t input_usec, int64_t pts_usec);
+
+    /* Return the number of samples to insert (positive) or to drop
+     * (negative) during the next 'distance' samples */
+    int compensation(int distance) const;
+
+    /* Return true if the skew is too large to be compensated smoothly.
+     * The caller should then restart the audio pts from the capture
+     * time and call resync() */
+    bool needs_resync() const;
+    void resync();
+
+    double skew_usec() const { return avg_skew; }
+    double drift_ppm() const { return drift * 1e6; }
+
+    std::string stats() const;
+};
+
+#endif /* end of include guard: AV_CLOCK_HPP */
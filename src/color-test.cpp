@@ -0,0 +1,433 @@
+#include "color-test.hpp"
+#include "encoder-cache.hpp"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Enough for the encoders that delay the first frames.
+#define COLOR_TEST_FRAMES 10
+#define COLOR_TEST_MAX_BANDS 32
+#define COLOR_TEST_DEFAULT_TOLERANCE 4.0
+
+bool parse_color_matrix(const std::string &spec, ColorMatrix &matrix)
+{
+    std::vector<std::string> *axes[] =
+        { &matrix.encoders, &matrix.pix_fmts, &matrix.ranges, &matrix.spaces };
+
+    std::stringstream in(spec);
+    std::string axis;
+    size_t n = 0;
+    while (std::getline(in, axis, ':'))
+    {
+        if (n == 4)
+            return false;
+        std::stringstream values(axis);
+        std::string value;
+        while (std::getline(values, value, ','))
+        {
+            if (!value.empty())
+                axes[n]->push_back(value);
+        }
+        n++;
+    }
+    return n > 0;
+}
+
+struct ColorCombination
+{
+    std::string encoder, pix_fmt, range, space;
+};
+
+struct ColorTestResult
+{
+    double encode_ms;
+    double decode_ms;
+    int frames;                               // decoded frames
+    float errors[COLOR_TEST_MAX_BANDS];       // worst box of each band
+};
+
+struct ColorJob
+{
+    ColorCombination combination;
+    FrameWriterParams params;
+    std::string skipped;      // why the combination is not tested
+    pid_t pid = -1;
+    int fd = -1;
+    bool ok = false;          // if the child gave a result
+    ColorTestResult result;
+};
+
+static void apply_combination(const ColorCombination &c, FrameWriterParams &params)
+{
+    if (!c.encoder.empty())
+    {
+        params.codec = c.encoder;
+        params.hw_method = c.encoder.find("_vaapi") != std::string::npos ? "vaapi" : "";
+        if (params.hw_method.empty())
+            params.hw_device.clear();
+        else if (params.hw_device.empty())
+            params.hw_device = "/dev/dri/renderD128";
+    }
+    if (!c.pix_fmt.empty())
+    {
+        params.video_filter += (params.video_filter.empty() ? "" : ",");
+        params.video_filter += "format=" + c.pix_fmt;
+    }
+    if (!c.range.empty())
+        params.codec_options["color_range"] = c.range;
+    if (!c.space.empty())
+        params.codec_options["colorspace"] = c.space;
+}
+
+// Convert a decoded frame to RGB with the range and the color space
+// of the stream, and compare the mean color of each box.
+static void compare_frame(const AVFrame *frame, const ColorPattern &pattern,
+    ColorTestResult &r)
+{
+    r.frames++;
+    if (frame->width != pattern.width || frame->height != pattern.height)
+    {
+        for (size_t b = 0; b < pattern.bands.size(); b++)
+            r.errors[b] = 255;
+        return;
+    }
+
+    int w = frame->width, h = frame->height;
+    SwsContext *sws = sws_getContext(w, h, (AVPixelFormat) frame->format,
+        w, h, AV_PIX_FMT_RGB24, SWS_POINT | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT,
+        NULL, NULL, NULL);
+    if (!sws)
+    {
+        for (size_t b = 0; b < pattern.bands.size(); b++)
+            r.errors[b] = 255;
+        return;
+    }
+
+    // Ignored when the frame is RGB.
+    sws_setColorspaceDetails(sws, sws_getCoefficients(frame->colorspace),
+        frame->color_range == AVCOL_RANGE_JPEG, sws_getCoefficients(SWS_CS_DEFAULT),
+        1, 0, 1 << 16, 1 << 16);
+
+    std::vector<uint8_t> rgb(w * h * 3);
+    uint8_t *dst[4] = { rgb.data(), NULL, NULL, NULL };
+    int dst_linesize[4] = { 3 * w, 0, 0, 0 };
+    sws_scale(sws, frame->data, frame->linesize, 0, h, dst, dst_linesize);
+    sws_freeContext(sws);
+
+    for (size_t b = 0; b < pattern.bands.size(); b++)
+    {
+        for (const ColorBox &box : pattern.bands[b].boxes)
+        {
+            // The edges are blurred by the chroma subsampling.
+            int margin = std::min(box.width, box.height) / 4;
+            double sum[3] = {0, 0, 0};
+            int count = 0;
+            for (int y = box.y + margin; y < box.y + box.height - margin && y < h; y++)
+            {
+                for (int x = box.x + margin; x < box.x + box.width - margin && x < w; x++)
+                {
+                    const uint8_t *p = &rgb[(y * w + x) * 3];
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    count++;
+                }
+            }
+            if (count == 0)
+                continue;
+
+            double error = std::max(std::fabs(sum[0] / count - box.r),
+                std::max(std::fabs(sum[1] / count - box.g), std::fabs(sum[2] / count - box.b)));
+            r.errors[b] = std::max(r.errors[b], float(error));
+        }
+    }
+}
+
+static bool decode_and_compare(const std::string &file, const ColorPattern &pattern,
+    ColorTestResult &r)
+{
+    AVFormatContext *fmt = NULL;
+    if (avformat_open_input(&fmt, file.c_str(), NULL, NULL) < 0)
+        return false;
+
+    AVCodec *codec = NULL;
+    AVCodecContext *ctx = NULL;
+    int index = -1;
+    if (avformat_find_stream_info(fmt, NULL) >= 0)
+        index = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (index >= 0 && codec)
+    {
+        ctx = avcodec_alloc_context3(codec);
+        if (avcodec_parameters_to_context(ctx, fmt->streams[index]->codecpar) < 0 ||
+            avcodec_open2(ctx, codec, NULL) < 0)
+        {
+            avcodec_free_context(&ctx);
+        }
+    }
+    if (!ctx)
+    {
+        avformat_close_input(&fmt);
+        return false;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    auto receive = [&] () {
+        while (avcodec_receive_frame(ctx, frame) == 0)
+        {
+            compare_frame(frame, pattern, r);
+            av_frame_unref(frame);
+        }
+    };
+
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    while (av_read_frame(fmt, &pkt) >= 0)
+    {
+        if (pkt.stream_index == index && avcodec_send_packet(ctx, &pkt) >= 0)
+            receive();
+        av_packet_unref(&pkt);
+    }
+    avcodec_send_packet(ctx, NULL);
+    receive();
+
+    av_frame_free(&frame);
+    avcodec_free_context(&ctx);
+    avformat_close_input(&fmt);
+    return r.frames > 0;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Encode and check the pattern in the current process.
+static bool run_combination(const FrameWriterParams &params, const ColorPattern &pattern,
+    ColorTestResult &r)
+{
+    memset(&r, 0, sizeof(r));
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        FrameWriter writer(params);
+        writer.set_clock_origin(0);
+        for (int i = 0; i < COLOR_TEST_FRAMES; i++)
+        {
+            writer.add_frame(pattern.pixels, pattern.width, pattern.height,
+                pattern.stride, int64_t(i) * 1000000 / 20, false);
+        }
+    }
+    r.encode_ms = elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    bool ok = decode_and_compare(params.file, pattern, r);
+    r.decode_ms = elapsed_ms(start);
+    return ok;
+}
+
+// Start run_combination() in a child process which reports through a pipe.
+static bool start_job(ColorJob &job, const ColorPattern &pattern)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return false;
+
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        if (!job.params.trace_video_progress)
+        {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        ColorTestResult r;
+        bool ok = run_combination(job.params, pattern, r);
+        _exit(ok && write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    job.pid = pid;
+    job.fd = fds[0];
+    return true;
+}
+
+static std::string or_default(const std::string &value, const char *def)
+{
+    return value.empty() ? def : value;
+}
+
+int do_color_matrix(FrameWriterParams params, const ColorMatrix &matrix,
+    const ColorPattern &pattern)
+{
+    if (pattern.bands.size() > COLOR_TEST_MAX_BANDS)
+    {
+        std::cerr << "Too many bands in the color pattern" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double tolerance = getenv("COLOR_TEST_TOLERANCE") ?
+        atof(getenv("COLOR_TEST_TOLERANCE")) : COLOR_TEST_DEFAULT_TOLERANCE;
+
+    // Only the video is tested.
+    params.file_format.clear();
+    params.format = pattern.format;
+    params.width = pattern.width;
+    params.height = pattern.height;
+    params.enable_audio = false;
+    params.audio_inputs.clear();
+    params.renditions.clear();
+    params.tiles = 1;
+    params.adaptive_quality = false;
+    params.static_max_gap_usec = 0;
+    params.roi_strength = 0;
+    params.print_stats = false;
+    params.quality_monitor_interval = 0;
+    params.flush_interval_usec = 0;
+
+    // The empty value keeps the setting of the command line.
+    auto values = [] (const std::vector<std::string> &list) {
+        return list.empty() ? std::vector<std::string>(1) : list;
+    };
+
+    EncoderCache encoders;
+    std::vector<ColorJob> jobs;
+    for (const std::string &encoder : values(matrix.encoders))
+    for (const std::string &pix_fmt : values(matrix.pix_fmts))
+    for (const std::string &range : values(matrix.ranges))
+    for (const std::string &space : values(matrix.spaces))
+    {
+        ColorJob job;
+        job.combination = ColorCombination{encoder, pix_fmt, range, space};
+        job.params = params;
+        apply_combination(job.combination, job.params);
+        job.params.file = "/tmp/wf-recorder-x-colors-" + std::to_string(getpid()) +
+            "-" + std::to_string(jobs.size()) + ".mkv";
+
+        std::stringstream problems;
+        const EncoderInfo *info = encoders.find(job.params.codec);
+        if (!encoders.validate(job.params, problems))
+        {
+            job.skipped = "not available";
+        } else if (!pix_fmt.empty() && info && info->hw_methods.empty() &&
+            std::find(info->formats.begin(), info->formats.end(), pix_fmt) == info->formats.end())
+        {
+            job.skipped = "pixel format not supported";
+        }
+        jobs.push_back(job);
+    }
+
+    // The encoders are mostly single threaded on such a small frame.
+    int max_running = std::max(1u, std::thread::hardware_concurrency());
+    int running = 0;
+    size_t next = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (next < jobs.size() || running > 0)
+    {
+        if (next < jobs.size() && running < max_running)
+        {
+            ColorJob &job = jobs[next++];
+            if (job.skipped.empty() && start_job(job, pattern))
+                running++;
+            continue;
+        }
+
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0)
+            break;
+        for (ColorJob &job : jobs)
+        {
+            if (job.pid != pid)
+                continue;
+            // The child has exited so its result is already in the pipe.
+            job.ok = read(job.fd, &job.result, sizeof(job.result)) == sizeof(job.result);
+            close(job.fd);
+            unlink(job.params.file.c_str());
+            job.pid = -1;
+            running--;
+        }
+    }
+    double total_ms = elapsed_ms(start);
+
+    std::cout << std::left << std::setw(16) << "Encoder" << std::setw(14) << "Format"
+        << std::setw(9) << "Range" << std::setw(12) << "Space" << std::setw(8) << "Result"
+        << std::setw(22) << "Max error" << std::right << std::setw(10) << "Encode"
+        << std::setw(10) << "Decode" << std::endl;
+
+    int passed = 0, failed = 0, skipped = 0;
+    for (const ColorJob &job : jobs)
+    {
+        const ColorCombination &c = job.combination;
+        std::cout << std::left << std::setw(16) << or_default(c.encoder, params.codec.c_str())
+            << std::setw(14) << or_default(c.pix_fmt, "auto")
+            << std::setw(9) << or_default(c.range, "default")
+            << std::setw(12) << or_default(c.space, "default");
+
+        if (!job.skipped.empty())
+        {
+            std::cout << "skipped (" << job.skipped << ")" << std::endl;
+            skipped++;
+            continue;
+        }
+        if (!job.ok)
+        {
+            std::cout << "FAIL    encoding or decoding failed" << std::endl;
+            failed++;
+            continue;
+        }
+
+        const ColorTestResult &r = job.result;
+        size_t worst = 0;
+        for (size_t b = 0; b < pattern.bands.size(); b++)
+        {
+            if (r.errors[b] > r.errors[worst])
+                worst = b;
+        }
+        bool pass = r.errors[worst] <= tolerance;
+        (pass ? passed : failed)++;
+
+        std::stringstream error;
+        error << std::fixed << std::setprecision(1) << r.errors[worst]
+            << " (" << pattern.bands[worst].name << ")";
+        std::cout << std::setw(8) << (pass ? "pass" : "FAIL") << std::setw(22) << error.str()
+            << std::right << std::fixed << std::setprecision(0)
+            << std::setw(7) << r.encode_ms << " ms" << std::setw(7) << r.decode_ms << " ms"
+            << std::defaultfloat << std::endl;
+
+        if (params.trace_video_progress)
+        {
+            std::cout << "   ";
+            for (size_t b = 0; b < pattern.bands.size(); b++)
+            {
+                std::cout << " " << pattern.bands[b].name << "=" << std::fixed
+                    << std::setprecision(1) << r.errors[b] << std::defaultfloat;
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    std::cout << passed << " passed, " << failed << " failed, " << skipped
+        << " skipped in " << std::fixed << std::setprecision(1) << total_ms / 1000
+        << "s (tolerance " << tolerance << ")" << std::defaultfloat << std::endl;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
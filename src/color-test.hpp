@@ -0,0 +1,57 @@
+#ifndef COLOR_TEST_HPP
+#define COLOR_TEST_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "frame-writer.hpp"
+
+// A box of uniform color drawn in the pattern of --test-colors
+struct ColorBox
+{
+    int x, y, width, height;
+    int r, g, b;        // 8 bit components
+};
+
+// A scale of boxes going from one color to another (e.g. 'low-r')
+struct ColorBand
+{
+    std::string name;
+    std::vector<ColorBox> boxes;
+};
+
+// The frame encoded by each combination of --test-color-matrix
+struct ColorPattern
+{
+    InputFormat format;
+    int width, height, stride;
+    const uint8_t *pixels;
+    std::vector<ColorBand> bands;
+};
+
+// The values tested by --test-color-matrix. An empty list keeps the
+// setting of the command line.
+struct ColorMatrix
+{
+    std::vector<std::string> encoders;
+    std::vector<std::string> pix_fmts;    // forced with a 'format' filter
+    std::vector<std::string> ranges;      // the 'color_range' encoder option
+    std::vector<std::string> spaces;      // the 'colorspace' encoder option
+};
+
+/* Parse ENCODERS[:PIXFMTS[:RANGES[:SPACES]]], each one a comma separated
+ * list */
+bool parse_color_matrix(const std::string &spec, ColorMatrix &matrix);
+
+// Encode the pattern with every combination of the matrix, in child
+// processes running in parallel. Each output is decoded back and
+// converted to RGB as a player would do (with the range and the color
+// space signaled in the stream), then the mean color of each box is
+// compared to the one drawn. A combination passes when no box differs
+// by more than COLOR_TEST_TOLERANCE (4 by default) in any component.
+// Return EXIT_FAILURE if a combination fails.
+int do_color_matrix(FrameWriterParams params, const ColorMatrix &matrix,
+    const ColorPattern &pattern);
+
+#endif /* end of include guard: COLOR_TEST_HPP */
@@ -0,0 +1,299 @@
+#include "encoder-cache.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ENCODER_CACHE_MAGIC "wf-recorder-x encoders v1"
+
+static std::string join(const std::vector<std::string> &list)
+{
+    std::string text;
+    for (const auto &item : list)
+        text += (text.empty() ? "" : ",") + item;
+    return text;
+}
+
+static std::vector<std::string> split(const std::string &text, char sep)
+{
+    std::vector<std::string> list;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, sep))
+    {
+        if (!item.empty())
+            list.push_back(item);
+    }
+    return list;
+}
+
+// The names of the options of an AVClass, without the named constants.
+static void get_option_names(const AVClass *cls, std::set<std::string> &names)
+{
+    if (!cls)
+        return;
+    const AVOption *opt = NULL;
+    while ((opt = av_opt_next(&cls, opt)))
+    {
+        if (opt->type != AV_OPT_TYPE_CONST)
+            names.insert(opt->name);
+    }
+}
+
+std::string EncoderCache::current_key()
+{
+    // The configuration tells apart two builds of the same version.
+    std::stringstream key;
+    key << avcodec_version() << "-" << avutil_version() << "-"
+        << std::hex << std::hash<std::string>()(avcodec_configuration());
+    return key.str();
+}
+
+std::string EncoderCache::cache_path()
+{
+    std::string dir;
+    if (getenv("XDG_CACHE_HOME"))
+        dir = getenv("XDG_CACHE_HOME");
+    else if (getenv("HOME"))
+        dir = std::string(getenv("HOME")) + "/.cache";
+    else
+        return "";
+
+    mkdir(dir.c_str(), 0755);
+    dir += "/wf-recorder-x";
+    mkdir(dir.c_str(), 0755);
+    return dir + "/encoders";
+}
+
+void EncoderCache::probe()
+{
+    FrameWriter::initialize_ffmpeg();
+    key = current_key();
+
+    get_option_names(avcodec_get_class(), generic_options);
+
+    for (AVHWDeviceType type = av_hwdevice_iterate_types(AV_HWDEVICE_TYPE_NONE);
+        type != AV_HWDEVICE_TYPE_NONE; type = av_hwdevice_iterate_types(type))
+    {
+        hw_methods.push_back(av_hwdevice_get_type_name(type));
+    }
+
+    const AVCodec *codec = NULL;
+    void *it = NULL;
+    while ((codec = av_codec_iterate(&it)))
+    {
+        if (!av_codec_is_encoder(codec) || (codec->type != AVMEDIA_TYPE_VIDEO &&
+            codec->type != AVMEDIA_TYPE_AUDIO))
+        {
+            continue;
+        }
+
+        EncoderInfo info;
+        info.name = codec->name;
+        info.long_name = codec->long_name ? codec->long_name : "";
+        info.video = codec->type == AVMEDIA_TYPE_VIDEO;
+
+        for (auto *p = codec->pix_fmts; p && *p != AV_PIX_FMT_NONE; p++)
+        {
+            // The HW pixel formats are named after their device type.
+            const char *name = av_get_pix_fmt_name(*p);
+            const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(*p);
+            if (desc && (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) &&
+                av_hwdevice_find_type_by_name(name) != AV_HWDEVICE_TYPE_NONE)
+            {
+                info.hw_methods.push_back(name);
+            }
+            info.formats.push_back(name);
+        }
+        for (auto *s = codec->sample_fmts; s && *s != AV_SAMPLE_FMT_NONE; s++)
+            info.formats.push_back(av_get_sample_fmt_name(*s));
+
+        get_option_names(codec->priv_class, info.options);
+        encoders.push_back(info);
+    }
+}
+
+bool EncoderCache::load(const std::string &path)
+{
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line) || line != ENCODER_CACHE_MAGIC)
+        return false;
+    if (!std::getline(in, line) || line != "key\t" + current_key())
+        return false;
+
+    while (std::getline(in, line))
+    {
+        std::vector<std::string> fields;
+        std::stringstream fin(line);
+        std::string field;
+        while (std::getline(fin, field, '\t'))
+            fields.push_back(field);
+
+        if (fields.size() == 2 && fields[0] == "generic")
+        {
+            for (auto &name : split(fields[1], ','))
+                generic_options.insert(name);
+        } else if (fields.size() == 2 && fields[0] == "hw")
+        {
+            hw_methods = split(fields[1], ',');
+        } else if (fields.size() >= 6 && fields[0] == "encoder")
+        {
+            EncoderInfo info;
+            info.name = fields[1];
+            info.video = fields[2] == "video";
+            info.formats = split(fields[3], ',');
+            info.hw_methods = split(fields[4], ',');
+            for (auto &name : split(fields[5], ','))
+                info.options.insert(name);
+            info.long_name = fields.size() > 6 ? fields[6] : "";
+            encoders.push_back(info);
+        } else
+        {
+            return false;
+        }
+    }
+
+    key = current_key();
+    return !encoders.empty();
+}
+
+void EncoderCache::save(const std::string &path) const
+{
+    // Written next to the cache and renamed, so that concurrent
+    // instances never read a partial file.
+    std::string tmp = path + "." + std::to_string(getpid());
+    std::ofstream out(tmp);
+    out << ENCODER_CACHE_MAGIC << "\n";
+    out << "key\t" << key << "\n";
+    out << "generic\t" << join(std::vector<std::string>(generic_options.begin(),
+        generic_options.end())) << "\n";
+    out << "hw\t" << join(hw_methods) << "\n";
+    for (const auto &info : encoders)
+    {
+        out << "encoder\t" << info.name << "\t" << (info.video ? "video" : "audio")
+            << "\t" << join(info.formats) << "\t" << join(info.hw_methods)
+            << "\t" << join(std::vector<std::string>(info.options.begin(),
+                info.options.end()))
+            << "\t" << info.long_name << "\n";
+    }
+    out.close();
+
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0)
+        unlink(tmp.c_str());
+}
+
+EncoderCache::EncoderCache()
+{
+    std::string path = cache_path();
+    loaded = !path.empty() && load(path);
+    if (loaded)
+        return;
+
+    // Discard what a stale or corrupted file may have given.
+    encoders.clear();
+    generic_options.clear();
+    hw_methods.clear();
+
+    probe();
+    if (!path.empty())
+        save(path);
+}
+
+const EncoderInfo *EncoderCache::find(const std::string &name) const
+{
+    for (const auto &info : encoders)
+    {
+        if (info.name == name)
+            return &info;
+    }
+    return NULL;
+}
+
+void EncoderCache::dump(std::ostream &out) const
+{
+    for (bool video : { true, false })
+    {
+        out << (video ? "Video encoders:" : "\nAudio encoders:") << std::endl;
+        for (const auto &info : encoders)
+        {
+            if (info.video != video)
+                continue;
+            out << "  " << std::left << std::setw(18) << info.name
+                << " " << info.long_name << std::endl;
+            if (!info.formats.empty())
+                out << "      formats: " << join(info.formats) << std::endl;
+            if (!info.hw_methods.empty())
+                out << "      hw: " << join(info.hw_methods) << std::endl;
+        }
+    }
+    out << "\nHW methods: " << join(hw_methods) << std::endl;
+}
+
+bool EncoderCache::validate(const FrameWriterParams &params, std::ostream &err) const
+{
+    bool ok = true;
+
+    const EncoderInfo *video = find(params.codec);
+    if (!video || !video->video)
+    {
+        err << "Unknown video encoder '" << params.codec
+            << "' (see --list-encoders)" << std::endl;
+        ok = false;
+    } else
+    {
+        for (const auto &opt : params.codec_options)
+        {
+            if (!generic_options.count(opt.first) && !video->options.count(opt.first))
+            {
+                err << "Unknown option '" << opt.first << "' for encoder '"
+                    << params.codec << "'" << std::endl;
+                ok = false;
+            }
+        }
+
+        if (!params.hw_method.empty() && !video->hw_methods.empty() &&
+            std::find(video->hw_methods.begin(), video->hw_methods.end(),
+                params.hw_method) == video->hw_methods.end())
+        {
+            err << "Warning: encoder '" << params.codec << "' expects frames from "
+                << join(video->hw_methods) << ", not " << params.hw_method << std::endl;
+        }
+    }
+
+    if (!params.hw_method.empty() && std::find(hw_methods.begin(), hw_methods.end(),
+        params.hw_method) == hw_methods.end())
+    {
+        err << "Unknown HW method '" << params.hw_method << "' (expected one of "
+            << join(hw_methods) << ")" << std::endl;
+        ok = false;
+    }
+
+    if (params.enable_audio)
+    {
+        const EncoderInfo *audio = find(params.audio_codec);
+        if (!audio || audio->video)
+        {
+            err << "Unknown audio encoder '" << params.audio_codec << "'" << std::endl;
+            ok = false;
+        }
+    }
+
+    if (!params.file_format.empty())
+    {
+        FrameWriter::initialize_ffmpeg();
+        if (!av_guess_format(params.file_format.c_str(), NULL, NULL))
+        {
+            err << "Unknown file format '" << params.file_format << "'" << std::endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
@@ -0,0 +1,54 @@
+#ifndef ENCODER_CACHE_HPP
+#define ENCODER_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <set>
+#include <ostream>
+
+#include "frame-writer.hpp"
+
+// What an encoder of the FFmpeg libraries accepts.
+struct EncoderInfo
+{
+    std::string name;
+    std::string long_name;
+    bool video = true;
+    std::vector<std::string> formats;     // pixel or sample formats
+    std::vector<std::string> hw_methods;  // HW devices of its pixel formats
+    std::set<std::string> options;        // private options (e.g. 'crf')
+};
+
+// The capabilities of the encoders, saved in the user cache directory
+// and probed again only when the FFmpeg libraries change. This allows to
+// validate the command line before the capture starts (see --list-encoders).
+class EncoderCache
+{
+    std::string key;
+    std::vector<EncoderInfo> encoders;
+    std::set<std::string> generic_options;  // AVCodecContext options
+    std::vector<std::string> hw_methods;    // HW device types
+    bool loaded = false;                    // if the cache file was used
+
+    static std::string current_key();
+    static std::string cache_path();
+    void probe();
+    bool load(const std::string &path);
+    void save(const std::string &path) const;
+
+    public:
+    /* Read the cache, or probe the libraries if it is missing or was
+     * made by other versions of them */
+    EncoderCache();
+
+    bool from_cache() const { return loaded; }
+    const EncoderInfo *find(const std::string &name) const;
+    void dump(std::ostream &out) const;
+
+    /* Check the encoders, their options and the HW method of 'params'.
+     * The problems are printed to 'err'; return false if the
+     * configuration cannot work */
+    bool validate(const FrameWriterParams &params, std::ostream &err) const;
+};
+
+#endif /* end of include guard: ENCODER_CACHE_HPP */
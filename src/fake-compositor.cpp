@@ -0,0 +1,509 @@
+#include "fake-compositor.hpp"
+#include "av-clock.hpp"
+#include "reactor.hpp"
+#include "thread-placement.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cerrno>
+#include <cstring>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+#include "xdg-output-unstable-v1-server-protocol.h"
+#include "wlr-screencopy-unstable-v1-server-protocol.h"
+
+/* Frames of damage kept for the copies of the managers. A copy which
+ * missed more frames gets the whole output as damage. */
+#define DAMAGE_HISTORY 8
+
+static const char *output_name = "FAKE-1";
+
+static FrameRect intersect(const FrameRect& a, const FrameRect& b)
+{
+    int x1 = std::max(a.x, b.x);
+    int y1 = std::max(a.y, b.y);
+    int x2 = std::min(a.x + a.width, b.x + b.width);
+    int y2 = std::min(a.y + a.height, b.y + b.height);
+    return FrameRect{x1, y1, std::max(0, x2 - x1), std::max(0, y2 - y1)};
+}
+
+/* The frames of a screencopy manager share its damage */
+struct FakeCompositor::ManagerState
+{
+    FakeCompositor *compositor;
+    int64_t last_damage_frame = -1; // the last frame copied with damage
+};
+
+struct FakeCompositor::Frame
+{
+    FakeCompositor *compositor;
+    std::shared_ptr<ManagerState> manager;
+    wl_resource *resource;
+    FrameRect region;              // in the output
+    wl_resource *buffer;           // set by the copy request
+    bool with_damage;
+};
+
+/* The handlers of the requests of the client */
+struct FakeCompositor::Protocol
+{
+    static const struct zxdg_output_v1_interface xdg_output_impl;
+    static const struct zxdg_output_manager_v1_interface xdg_output_manager_impl;
+    static const struct zwlr_screencopy_frame_v1_interface frame_impl;
+    static const struct zwlr_screencopy_manager_v1_interface screencopy_manager_impl;
+
+    static void destroy(wl_client*, wl_resource *resource)
+    {
+        wl_resource_destroy(resource);
+    }
+
+    static void bind_output(wl_client *client, void *data, uint32_t version, uint32_t id)
+    {
+        auto compositor = (FakeCompositor*) data;
+        wl_resource *resource = wl_resource_create(client, &wl_output_interface, version, id);
+        if (!resource)
+        {
+            wl_client_post_no_memory(client);
+            return;
+        }
+        wl_resource_set_implementation(resource, NULL, compositor, NULL);
+
+        auto& p = compositor->params;
+        wl_output_send_geometry(resource, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+            "wf-recorder-x", "fake", WL_OUTPUT_TRANSFORM_NORMAL);
+        wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT, p.width, p.height,
+            int(p.fps * 1000));
+        if (version >= WL_OUTPUT_DONE_SINCE_VERSION)
+            wl_output_send_done(resource);
+    }
+
+    static void get_xdg_output(wl_client *client, wl_resource *manager,
+        uint32_t id, wl_resource *output)
+    {
+        auto compositor = (FakeCompositor*) wl_resource_get_user_data(manager);
+        wl_resource *resource = wl_resource_create(client, &zxdg_output_v1_interface,
+            wl_resource_get_version(manager), id);
+        if (!resource)
+        {
+            wl_client_post_no_memory(client);
+            return;
+        }
+        wl_resource_set_implementation(resource, &xdg_output_impl, NULL, NULL);
+
+        auto& p = compositor->params;
+        zxdg_output_v1_send_logical_position(resource, 0, 0);
+        zxdg_output_v1_send_logical_size(resource, p.width, p.height);
+        if (wl_resource_get_version(resource) >= ZXDG_OUTPUT_V1_NAME_SINCE_VERSION)
+        {
+            zxdg_output_v1_send_name(resource, output_name);
+            zxdg_output_v1_send_description(resource, "Scripted output of --fake-capture");
+        }
+        zxdg_output_v1_send_done(resource);
+        if (wl_resource_get_version(output) >= WL_OUTPUT_DONE_SINCE_VERSION)
+            wl_output_send_done(output);
+    }
+
+    static void bind_xdg_output_manager(wl_client *client, void *data,
+        uint32_t version, uint32_t id)
+    {
+        wl_resource *resource = wl_resource_create(client,
+            &zxdg_output_manager_v1_interface, version, id);
+        if (!resource)
+        {
+            wl_client_post_no_memory(client);
+            return;
+        }
+        wl_resource_set_implementation(resource, &xdg_output_manager_impl, data, NULL);
+    }
+
+    static void destroy_frame(wl_resource *resource)
+    {
+        auto frame = (Frame*) wl_resource_get_user_data(resource);
+        auto& pending = frame->compositor->pending;
+        pending.erase(std::remove(pending.begin(), pending.end(), frame), pending.end());
+        delete frame;
+    }
+
+    static void capture(wl_client *client, wl_resource *manager, uint32_t id,
+        FrameRect region)
+    {
+        auto state = *(std::shared_ptr<ManagerState>*) wl_resource_get_user_data(manager);
+        auto compositor = state->compositor;
+        auto& p = compositor->params;
+
+        wl_resource *resource = wl_resource_create(client,
+            &zwlr_screencopy_frame_v1_interface, wl_resource_get_version(manager), id);
+        if (!resource)
+        {
+            wl_client_post_no_memory(client);
+            return;
+        }
+
+        Frame *frame = new Frame;
+        frame->compositor = compositor;
+        frame->manager = state;
+        frame->resource = resource;
+        frame->region = intersect(region, FrameRect{0, 0, p.width, p.height});
+        frame->buffer = NULL;
+        frame->with_damage = false;
+        wl_resource_set_implementation(resource, &frame_impl, frame, destroy_frame);
+
+        if (frame->region.width == 0 || frame->region.height == 0)
+        {
+            zwlr_screencopy_frame_v1_send_failed(resource);
+            return;
+        }
+        zwlr_screencopy_frame_v1_send_buffer(resource, p.format, frame->region.width,
+            frame->region.height, frame->region.width * p.bytes_per_pixel);
+    }
+
+    static void capture_output(wl_client *client, wl_resource *manager, uint32_t id,
+        int32_t, wl_resource *)
+    {
+        capture(client, manager, id, FrameRect{0, 0, INT32_MAX, INT32_MAX});
+    }
+
+    static void capture_output_region(wl_client *client, wl_resource *manager,
+        uint32_t id, int32_t, wl_resource *, int32_t x, int32_t y,
+        int32_t width, int32_t height)
+    {
+        capture(client, manager, id, FrameRect{x, y, width, height});
+    }
+
+    static void destroy_manager(wl_resource *resource)
+    {
+        delete (std::shared_ptr<ManagerState>*) wl_resource_get_user_data(resource);
+    }
+
+    static void bind_screencopy_manager(wl_client *client, void *data,
+        uint32_t version, uint32_t id)
+    {
+        wl_resource *resource = wl_resource_create(client,
+            &zwlr_screencopy_manager_v1_interface, version, id);
+        if (!resource)
+        {
+            wl_client_post_no_memory(client);
+            return;
+        }
+
+        auto state = new std::shared_ptr<ManagerState>(new ManagerState);
+        (*state)->compositor = (FakeCompositor*) data;
+        wl_resource_set_implementation(resource, &screencopy_manager_impl,
+            state, destroy_manager);
+    }
+
+    static void copy(wl_resource *resource, wl_resource *buffer_resource, bool with_damage)
+    {
+        auto frame = (Frame*) wl_resource_get_user_data(resource);
+        auto compositor = frame->compositor;
+        auto& p = compositor->params;
+
+        if (frame->buffer)
+        {
+            wl_resource_post_error(resource, ZWLR_SCREENCOPY_FRAME_V1_ERROR_ALREADY_USED,
+                "frame already used");
+            return;
+        }
+
+        wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
+        if (!buffer || wl_shm_buffer_get_format(buffer) != p.format ||
+            wl_shm_buffer_get_width(buffer) != frame->region.width ||
+            wl_shm_buffer_get_height(buffer) != frame->region.height ||
+            wl_shm_buffer_get_stride(buffer) != frame->region.width * p.bytes_per_pixel)
+        {
+            wl_resource_post_error(resource, ZWLR_SCREENCOPY_FRAME_V1_ERROR_INVALID_BUFFER,
+                "invalid buffer attributes");
+            return;
+        }
+
+        frame->buffer = buffer_resource;
+        frame->with_damage = with_damage;
+        compositor->pending.push_back(frame);
+
+        if (compositor->turnaround_start_usec >= 0)
+        {
+            int64_t usec = AVClock::now_usec() - compositor->turnaround_start_usec;
+            compositor->turnarounds++;
+            compositor->turnaround_sum_usec += usec;
+            compositor->turnaround_max_usec = std::max(compositor->turnaround_max_usec, usec);
+            compositor->turnaround_start_usec = -1;
+        }
+
+        /* The output starts with the first copy */
+        if (compositor->start_usec < 0)
+        {
+            compositor->start_usec = AVClock::now_usec();
+            compositor->arm_timer();
+        }
+    }
+
+    static void frame_copy(wl_client*, wl_resource *resource, wl_resource *buffer)
+    {
+        copy(resource, buffer, false);
+    }
+
+    static void frame_copy_with_damage(wl_client*, wl_resource *resource, wl_resource *buffer)
+    {
+        copy(resource, buffer, true);
+    }
+
+    static int handle_timer(void *data)
+    {
+        ((FakeCompositor*) data)->present();
+        return 0;
+    }
+
+    static int handle_stop(int fd, uint32_t, void *data)
+    {
+        Reactor::drain(fd);
+        ((FakeCompositor*) data)->running = false;
+        return 0;
+    }
+};
+
+const struct zxdg_output_v1_interface FakeCompositor::Protocol::xdg_output_impl = {
+    .destroy = FakeCompositor::Protocol::destroy,
+};
+
+const struct zxdg_output_manager_v1_interface FakeCompositor::Protocol::xdg_output_manager_impl = {
+    .destroy = FakeCompositor::Protocol::destroy,
+    .get_xdg_output = FakeCompositor::Protocol::get_xdg_output,
+};
+
+const struct zwlr_screencopy_frame_v1_interface FakeCompositor::Protocol::frame_impl = {
+    .copy = FakeCompositor::Protocol::frame_copy,
+    .destroy = FakeCompositor::Protocol::destroy,
+    .copy_with_damage = FakeCompositor::Protocol::frame_copy_with_damage,
+};
+
+const struct zwlr_screencopy_manager_v1_interface FakeCompositor::Protocol::screencopy_manager_impl = {
+    .capture_output = FakeCompositor::Protocol::capture_output,
+    .capture_output_region = FakeCompositor::Protocol::capture_output_region,
+    .destroy = FakeCompositor::Protocol::destroy,
+};
+
+FakeCompositor::FakeCompositor(const FakeCompositorParams& _params) :
+    params(_params)
+{
+    stride = params.width * params.bytes_per_pixel;
+    screen.resize((size_t) stride * params.height);
+    fill(FrameRect{0, 0, params.width, params.height}, params.background);
+    damage.resize(DAMAGE_HISTORY);
+    total = std::max<int64_t>(1, int64_t(params.seconds * params.fps));
+
+    display = wl_display_create();
+    if (!display || wl_display_init_shm(display) != 0 ||
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+        std::cerr << "Failed to create the fake compositor: " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    /* ARGB8888 and XRGB8888 are always supported */
+    if (params.format != WL_SHM_FORMAT_ARGB8888 && params.format != WL_SHM_FORMAT_XRGB8888)
+        wl_display_add_shm_format(display, params.format);
+
+    wl_global_create(display, &wl_output_interface, 2, this, Protocol::bind_output);
+    wl_global_create(display, &zxdg_output_manager_v1_interface, 2, this,
+        Protocol::bind_xdg_output_manager);
+    wl_global_create(display, &zwlr_screencopy_manager_v1_interface, 2, this,
+        Protocol::bind_screencopy_manager);
+
+    wl_event_loop *event_loop = wl_display_get_event_loop(display);
+    timer = wl_event_loop_add_timer(event_loop, Protocol::handle_timer, this);
+    stop_fd = Reactor::make_eventfd();
+    stop_source = wl_event_loop_add_fd(event_loop, stop_fd, WL_EVENT_READABLE,
+        Protocol::handle_stop, this);
+
+    /* The other end belongs to the client once it is connected */
+    if (!wl_client_create(display, fds[0]))
+    {
+        std::cerr << "Failed to create the client of the fake compositor" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    thread = std::thread([this] () { loop(); });
+}
+
+FakeCompositor::~FakeCompositor()
+{
+    stop();
+    wl_event_source_remove(timer);
+    wl_event_source_remove(stop_source);
+    wl_display_destroy_clients(display);
+    wl_display_destroy(display);
+    close(stop_fd);
+}
+
+void FakeCompositor::stop()
+{
+    if (!thread.joinable())
+        return;
+    Reactor::notify(stop_fd);
+    thread.join();
+}
+
+void FakeCompositor::loop()
+{
+    set_thread_name("wf-fake-wl");
+
+    /* The signals are for the reactor of the capture */
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    wl_event_loop *event_loop = wl_display_get_event_loop(display);
+    while (running)
+    {
+        wl_display_flush_clients(display);
+        wl_event_loop_dispatch(event_loop, -1);
+    }
+}
+
+void FakeCompositor::fill(const FrameRect& r, uint64_t pixel)
+{
+    int bpp = params.bytes_per_pixel;
+    for (int y = r.y; y < r.y + r.height; y++)
+    {
+        uint8_t *row = screen.data() + (size_t) y * stride;
+        for (int x = r.x; x < r.x + r.width; x++)
+            memcpy(row + x * bpp, &pixel, bpp);
+    }
+}
+
+void FakeCompositor::arm_timer()
+{
+    /* Frame n is presented at start + (n + 1) periods, without drift.
+     * The timers of the event loop have a resolution of 1 ms. */
+    int64_t due_usec = start_usec + int64_t((frames + 1) * 1e6 / params.fps);
+    int64_t delay_ms = (due_usec - AVClock::now_usec() + 999) / 1000;
+    wl_event_source_timer_update(timer, int(std::max<int64_t>(1, delay_ms)));
+}
+
+void FakeCompositor::present()
+{
+    /* The end of the script, as if the user stopped the recording. The
+     * client had a period to handle the last frame. */
+    if (frames == total)
+    {
+        kill(getpid(), SIGINT);
+        return;
+    }
+
+    int64_t n = frames++;
+
+    /* The box bounces horizontally and moves down slowly */
+    int box_size = std::min(params.width, params.height) / 8;
+    int range = params.width - box_size;
+    int x = n % (2 * range);
+    FrameRect next{x < range ? x : 2 * range - x,
+        int(n / 4 % (params.height - box_size)), box_size, box_size};
+
+    fill(box, params.background);
+    fill(next, params.foreground);
+    if (n == 0)
+        damage[0] = {FrameRect{0, 0, params.width, params.height}};
+    else
+        damage[n % DAMAGE_HISTORY] = {box, next};
+    box = next;
+
+    timespec presented;
+    clock_gettime(CLOCK_MONOTONIC, &presented);
+    last_usec = presented.tv_sec * 1000000ll + presented.tv_nsec / 1000ll;
+
+    /* Every pending copy gets this frame, except the copies with damage
+     * of a manager which already gave the damage of this frame */
+    if (pending.empty())
+        missed++;
+
+    std::vector<Frame*> waiting;
+    for (auto frame : pending)
+    {
+        if (frame->with_damage && frame->manager->last_damage_frame == n)
+            waiting.push_back(frame);
+        else
+            serve(frame, n, presented);
+    }
+    if (waiting.size() < pending.size())
+    {
+        served++;
+        turnaround_start_usec = last_usec;
+    }
+    pending.swap(waiting);
+    arm_timer();
+}
+
+void FakeCompositor::serve(Frame *frame, int64_t n, const timespec& presented)
+{
+    const FrameRect& r = frame->region;
+    int bpp = params.bytes_per_pixel;
+
+    wl_shm_buffer *buffer = wl_shm_buffer_get(frame->buffer);
+    wl_shm_buffer_begin_access(buffer);
+    uint8_t *data = (uint8_t*) wl_shm_buffer_get_data(buffer);
+    for (int y = 0; y < r.height; y++)
+    {
+        memcpy(data + (size_t) y * r.width * bpp,
+            screen.data() + (size_t) (r.y + y) * stride + r.x * bpp, r.width * bpp);
+    }
+    wl_shm_buffer_end_access(buffer);
+
+    zwlr_screencopy_frame_v1_send_flags(frame->resource, 0);
+
+    if (frame->with_damage)
+    {
+        /* The damage since the last copy of the manager */
+        int64_t since = frame->manager->last_damage_frame;
+        std::vector<FrameRect> rects;
+        if (since < 0 || n - since > DAMAGE_HISTORY)
+            rects.push_back(FrameRect{0, 0, params.width, params.height});
+        for (int64_t i = since + 1; rects.empty() && i <= n; i++)
+        {
+            auto& d = damage[i % DAMAGE_HISTORY];
+            rects.insert(rects.end(), d.begin(), d.end());
+        }
+
+        for (auto& d : rects)
+        {
+            FrameRect c = intersect(d, r);
+            if (c.width > 0 && c.height > 0)
+                zwlr_screencopy_frame_v1_send_damage(frame->resource,
+                    c.x - r.x, c.y - r.y, c.width, c.height);
+        }
+        frame->manager->last_damage_frame = n;
+    }
+
+    zwlr_screencopy_frame_v1_send_ready(frame->resource,
+        uint32_t(uint64_t(presented.tv_sec) >> 32), uint32_t(presented.tv_sec),
+        uint32_t(presented.tv_nsec));
+    copies++;
+}
+
+bool FakeCompositor::passed(int64_t captured) const
+{
+    // The stop may come before the client handled the last frame.
+    return frames == total && missed <= total / MISSED_FRAMES_TOLERANCE &&
+        captured <= served && captured >= served - 1;
+}
+
+void FakeCompositor::print_stats(std::ostream &out, int64_t captured) const
+{
+    double seconds = start_usec < 0 ? 0 : (last_usec - start_usec) / 1e6;
+    out << "Fake capture: " << frames << " frames in " << std::fixed
+        << std::setprecision(2) << seconds << "s ("
+        << std::setprecision(1) << (seconds > 0 ? frames / seconds : 0.0)
+        << " fps), " << copies << " copies, " << captured << " frames captured, "
+        << missed << " missed because the capture was late" << std::endl;
+    if (turnarounds > 0)
+        out << "Fake capture: next copy requested after "
+            << std::setprecision(2) << turnaround_sum_usec / 1000.0 / turnarounds
+            << " ms on average, " << turnaround_max_usec / 1000.0 << " ms at most"
+            << std::endl;
+    out << std::defaultfloat;
+}
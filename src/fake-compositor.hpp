@@ -0,0 +1,107 @@
+#ifndef FAKE_COMPOSITOR_HPP
+#define FAKE_COMPOSITOR_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <memory>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "frame-writer.hpp"
+
+struct wl_display;
+struct wl_event_source;
+
+// The scene and the timing of --fake-capture
+struct FakeCompositorParams
+{
+    int width, height;
+    double fps;
+    uint32_t format;               // wl_shm_format of the output
+    int bytes_per_pixel;
+    uint64_t background, foreground; // pixels in that format
+    double seconds;
+};
+
+// A Wayland compositor running in a thread of the recorder, which serves
+// a single client connected through a socket pair (see client_fd()). It
+// offers wl_shm, one wl_output with its xdg-output and
+// wlr-screencopy-unstable-v1 version 2, so that the capture code is run
+// as with a real compositor.
+//
+// The output shows a box moving over a uniform background. At each frame
+// of the output (at the given rate, starting with the first copy
+// request), the pending copies are served like wlroots does: every copy
+// gets the new frame with the same presentation time, while a copy with
+// damage waits for the next frame if another copy of the same manager
+// already got the damage of this one. A period after the last frame,
+// SIGINT is sent to the process, as if the user stopped the recording.
+/* A loaded machine may miss some frames: 1 out of that many is tolerated
+ * by passed(), the count is only a measure of the timing. */
+#define MISSED_FRAMES_TOLERANCE 10
+
+class FakeCompositor
+{
+    struct Protocol;
+    struct Frame;
+    struct ManagerState;
+
+    FakeCompositorParams params;
+    wl_display *display = NULL;
+    wl_event_source *timer = NULL;
+    wl_event_source *stop_source = NULL;
+    int stop_fd = -1;
+    int fds[2] = {-1, -1};
+    std::thread thread;
+
+    std::vector<uint8_t> screen;
+    int stride;
+    FrameRect box{0, 0, 0, 0};
+    std::vector<Frame*> pending;
+
+    // The damage of the last frames of the output, by frame % size
+    std::vector<std::vector<FrameRect>> damage;
+
+    int64_t start_usec = -1;
+    int64_t last_usec = -1;
+    int64_t total;                 // frames to present
+    bool running = true;
+
+    // Statistics
+    int64_t frames = 0;
+    int64_t copies = 0;
+    int64_t served = 0;            // frames given to at least one copy
+    int64_t missed = 0;            // frames without any pending copy
+
+    // Time from a frame to the next copy request of the client
+    int64_t turnaround_start_usec = -1;
+    int64_t turnarounds = 0;
+    int64_t turnaround_sum_usec = 0;
+    int64_t turnaround_max_usec = 0;
+
+    void fill(const FrameRect& r, uint64_t pixel);
+    void present();
+    void serve(Frame *frame, int64_t n, const timespec& presented);
+    void arm_timer();
+    void loop();
+
+    public:
+    FakeCompositor(const FakeCompositorParams& params);
+    ~FakeCompositor();
+
+    /* The end of the socket pair for the client, e.g. in WAYLAND_SOCKET */
+    int client_fd() const { return fds[1]; }
+
+    /* Stop the thread of the compositor. The client stays connected. */
+    void stop();
+
+    /* If the client captured each frame it was given once (the last one
+     * may be cut by the stop) and at most 1/MISSED_FRAMES_TOLERANCE of the
+     * frames were missed. Only valid after stop(). */
+    bool passed(int64_t captured) const;
+
+    void print_stats(std::ostream &out, int64_t captured) const;
+};
+
+#endif /* end of include guard: FAKE_COMPOSITOR_HPP */
@@ -9,9 +9,15 @@
 #include <queue>
 #include <cstring>
 #include "averr.h"
+#include "pixel-convert.hpp"
+#include "thread-placement.hpp"
 #include <iomanip>
-
-#define AUDIO_RATE 44100
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 static const AVRational US_RATIONAL{1,1000000} ; // = 1us as a AVRational
 
@@ -29,17 +35,18 @@ static inline bool is_fmt_supported(AVPixelFormat fmt, const AVPixelFormat *supp
   return false;
 }
 
-class FFmpegInitialize
+// Loads the whole database of available codecs and formats. This is done
+// on first use instead of during the static initialization so that it
+// happens in the thread which prepares the encoder, in parallel with the
+// Wayland setup.
+static std::once_flag ffmpeg_initialized;
+
+void FrameWriter::initialize_ffmpeg()
 {
-public :
-  FFmpegInitialize()
-  {
-    // Loads the whole database of available codecs and formats.
+  std::call_once(ffmpeg_initialized, [] () {
     av_register_all();
-  }
-};
-
-static FFmpegInitialize ffmpegInitialize;
+  });
+}
 
 
 #define forall_codecs(var) for ( void * var##_it = NULL ; (codec=av_codec_iterate(&var##_it)) ; )
@@ -50,6 +57,7 @@ static FFmpegInitialize ffmpegInitialize;
 void
 FrameWriter::dump_available_encoders(std::ostream &out)
 {
+  initialize_ffmpeg();
   const AVCodec *codec = NULL ;
   out << "Available encoders:" << std::endl ; 
   //for ( void * it = NULL ; (codec=av_codec_iterate(&it)) ; ) {
@@ -174,13 +182,161 @@ void FrameWriter::load_codec_options(AVDictionary **dict)
     }
 }
 
+// Filters that explicitly move frames from or to a HW device. The
+// automatic HW pipeline is not used when the user filters contain one.
+static bool has_hw_transfer(const std::string &filters)
+{
+  for (const char *name : { "hwupload", "hwmap", "hwdownload" }) {
+    if (filters.find(name) != std::string::npos)
+      return true;
+  }
+  return false;
+}
+
+static bool is_hw_format(AVPixelFormat fmt)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+  return desc && (desc->flags & AV_PIX_FMT_FLAG_HWACCEL);
+}
+
+static bool is_high_depth(AVPixelFormat fmt)
+{
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+  return desc && desc->comp[0].depth > 8;
+}
+
+// Build the filters that move the frames to the HW device. The goal is
+// to find the cheapest upload point:
+//
+//  - If the device accepts RGB frames and has its own scale filter
+//    (e.g. scale_vaapi), the RGB frames are uploaded and converted
+//    by the device. Without user filters, the upload is done before
+//    the filter graph using our own pool of HW frames (so no hwupload).
+//
+//  - Otherwise, the frames are converted to a YUV format by the CPU
+//    and then uploaded.
+//
+// If the encoder does not accept HW frames, they are downloaded at the
+// end. This is not useful in practice but allows to exercise the HW
+// pipeline with any device such as Vulkan via lavapipe.
+//
+std::string FrameWriter::build_hw_pipeline(AVCodec *codec, const std::string &user_filter)
+{
+  AVPixelFormat input_fmt = get_input_format();
+
+  AVHWFramesConstraints *constraints =
+    av_hwdevice_get_hwframe_constraints(hw_device_context, NULL);
+  if (!constraints || !constraints->valid_hw_formats || !constraints->valid_sw_formats) {
+    av_hwframe_constraints_free(&constraints);
+    std::cerr << "Cannot get the constraints of HW device '" << params.hw_method
+              << "'. Use the filters 'hwupload' and/or 'hwdownload'.\n";
+    return user_filter;
+  }
+
+  AVPixelFormat device_hw_fmt = constraints->valid_hw_formats[0];
+  bool rgb_upload = is_fmt_supported(input_fmt, constraints->valid_sw_formats);
+
+  // The software format of the encoded frames.
+  // NV12 is the most common format for HW encoders.
+  bool hw_encoder = false;
+  for (auto *p = codec->pix_fmts ; p && *p != AV_PIX_FMT_NONE ; p++)
+    hw_encoder = hw_encoder || is_hw_format(*p);
+  AVPixelFormat sw_fmt = AV_PIX_FMT_NONE;
+  if (!hw_encoder && codec->pix_fmts) {
+    for (auto *p = codec->pix_fmts ; *p != AV_PIX_FMT_NONE ; p++) {
+      if (is_fmt_supported(*p, constraints->valid_sw_formats)) {
+        sw_fmt = *p;
+        break;
+      }
+    }
+  }
+  // P010 keeps the precision of the 10 and 16 bit captures.
+  if (sw_fmt == AV_PIX_FMT_NONE && is_high_depth(input_fmt) &&
+      is_fmt_supported(AV_PIX_FMT_P010, constraints->valid_sw_formats))
+    sw_fmt = AV_PIX_FMT_P010;
+  if (sw_fmt == AV_PIX_FMT_NONE && is_fmt_supported(AV_PIX_FMT_NV12, constraints->valid_sw_formats))
+    sw_fmt = AV_PIX_FMT_NV12;
+  if (sw_fmt == AV_PIX_FMT_NONE)
+    sw_fmt = constraints->valid_sw_formats[0];
+  av_hwframe_constraints_free(&constraints);
+
+  std::string hw_scaler = "scale_" + params.hw_method ;
+  bool gpu_convert = rgb_upload && avfilter_get_by_name(hw_scaler.c_str());
+  const char *sw_fmt_name = av_get_pix_fmt_name(sw_fmt);
+
+  std::stringstream text;
+  // Without user filters, the frames are uploaded before entering the
+  // graph unless the pool of HW frames cannot be created.
+  if (gpu_convert && user_filter.empty() && init_hw_upload(device_hw_fmt)) {
+    text << hw_scaler << "=format=" << sw_fmt_name ;
+  } else {
+    text << (user_filter.empty() ? "null" : user_filter) << "," ;
+    if (gpu_convert)
+      text << "hwupload," << hw_scaler << "=format=" << sw_fmt_name ;
+    else
+      text << "format=" << sw_fmt_name << ",hwupload" ;
+  }
+
+  hw_filter_output = hw_encoder;
+  if (!hw_encoder)
+    text << ",hwdownload,format=" << sw_fmt_name ;
+
+  std::cerr << "Using HW pipeline '" << text.str() << "'"
+            << (hw_upload_context ? " with upload before the filters" : "")
+            << std::endl;
+  return text.str();
+}
+
+// Create the pool of HW frames used to upload the captured frames.
+// Return false if the device does not accept them, in which case they
+// must be uploaded by the filters.
+bool FrameWriter::init_hw_upload(AVPixelFormat hw_fmt)
+{
+  AVBufferRef *ref = av_hwframe_ctx_alloc(hw_device_context);
+  if (!ref) {
+    std::cerr << "Failed to allocate HW frames context\n";
+    exit(-1);
+  }
+
+  AVHWFramesContext *frames = (AVHWFramesContext *) ref->data;
+  frames->format    = hw_fmt;
+  frames->sw_format = get_input_format();
+  frames->width     = params.width;
+  frames->height    = params.height;
+
+  int err = av_hwframe_ctx_init(ref);
+  if (err < 0) {
+    std::cerr << "Failed to initialize HW frames context: " << averr(err)
+              << ", uploading with 'hwupload'" << std::endl;
+    av_buffer_unref(&ref);
+    return false;
+  }
+
+  hw_upload_context = ref;
+  return true;
+}
+
 AVPixelFormat FrameWriter::get_input_format()
 {
   // TODO: use RGBA instead of  RGB0 because of the 'overlay' filter.
   //       ==> Should set it back to RGB0 before the encoder.
   //       ==> Manually? can a filter do that?
-  return params.format == INPUT_FORMAT_BGR0 ?
-    AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA;
+  switch (params.format) {
+  case INPUT_FORMAT_BGR0:    return AV_PIX_FMT_BGRA;
+  case INPUT_FORMAT_RGB0:    return AV_PIX_FMT_RGBA;
+  // Converted by convert_input_frame()
+  case INPUT_FORMAT_X2RGB10:
+  case INPUT_FORMAT_X2BGR10: return AV_PIX_FMT_GBRP10;
+  case INPUT_FORMAT_RGBA16F:
+  case INPUT_FORMAT_BGRA16F: return AV_PIX_FMT_GBRP16;
+  }
+  return AV_PIX_FMT_NONE;
+}
+
+int FrameWriter::get_input_bytes_per_pixel()
+{
+  return (params.format == INPUT_FORMAT_RGBA16F ||
+          params.format == INPUT_FORMAT_BGRA16F) ? 8 : 4;
 }
 
 static void sort_filter_graph(AVFilterGraph *graph)
@@ -216,11 +372,158 @@ static void sort_filter_graph(AVFilterGraph *graph)
   }
 }
 
+// Get the properties of the (input of the) sink that is the output
+// of the whole filter.
+void FrameWriter::get_filter_output(AVFilterContext *sink_ctx,
+                                    VideoFilterOutput &out)
+{
+  AVFilterLink * filter_output = sink_ctx->inputs[0] ;
+  
+  out.width  = filter_output->w ;
+  out.height = filter_output->h ;
+  out.sar    = filter_output->sample_aspect_ratio ; 
+  out.pix_fmt = (AVPixelFormat) filter_output->format ;
+  out.time_base = filter_output->time_base;
+  out.frame_rate = filter_output->frame_rate; // can be 1/0 if unknown
+
+  std::cerr << "Encoding input format (" << sink_ctx->name << "):"
+            << " w=" << out.width
+            << " h=" << out.height
+            << " pixfmt=" << av_get_pix_fmt_name(out.pix_fmt)
+            << " sample_aspect_ratio=" << out.sar
+            << " time_base=" << out.time_base
+            << " frame_rate=" << out.frame_rate
+            << "\n";
+}
+
+// The name of the file of a tile: 'out.mkv' -> 'out.tile1.mkv'
+static std::string get_tile_file(const std::string &file, int index)
+{
+  std::string suffix = ".tile" + std::to_string(index) ;
+  size_t dot = file.rfind('.');
+  size_t slash = file.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return file + suffix;
+  return file.substr(0, dot) + suffix + file.substr(dot);
+}
+
+// The size of the frames produced by the user filters (e.g. 'scale',
+// 'crop' or 'transpose'), from a graph configured with them alone.
+void FrameWriter::get_user_filter_size(int &width, int &height)
+{
+  width = params.width;
+  height = params.height;
+  if (params.video_filter.empty())
+    return;
+
+  AVFilterGraph *graph = avfilter_graph_alloc();
+  std::stringstream args;
+  args << "video_size=" << params.width << "x" << params.height
+       << ":pix_fmt=" << int(get_input_format())
+       << ":time_base=" << US_RATIONAL.num << "/" << US_RATIONAL.den
+       << ":pixel_aspect=1/1";
+
+  AVFilterContext *source_ctx = NULL;
+  AVFilterContext *sink_ctx = NULL;
+  int err = avfilter_graph_create_filter(&source_ctx, avfilter_get_by_name("buffer"),
+                                         "Source", args.str().c_str(), NULL, graph);
+  if (err >= 0)
+    err = avfilter_graph_create_filter(&sink_ctx, avfilter_get_by_name("buffersink"),
+                                       "Sink", NULL, NULL, graph);
+
+  AVFilterInOut *outputs = avfilter_inout_alloc();
+  outputs->name       = av_strdup("in");
+  outputs->filter_ctx = source_ctx;
+  outputs->pad_idx    = 0;
+  outputs->next       = NULL;
+  AVFilterInOut *inputs = avfilter_inout_alloc();
+  inputs->name        = av_strdup("out");
+  inputs->filter_ctx  = sink_ctx;
+  inputs->pad_idx     = 0;
+  inputs->next        = NULL;
+
+  if (err >= 0)
+    err = avfilter_graph_parse_ptr(graph, params.video_filter.c_str(),
+                                   &inputs, &outputs, NULL);
+  if (err >= 0)
+    err = avfilter_graph_config(graph, NULL);
+  if (err < 0) {
+    std::cerr << "Failed to configure the video filter for the tiles: " << averr(err) << std::endl;
+    exit(-1);
+  }
+
+  width = sink_ctx->inputs[0]->w;
+  height = sink_ctx->inputs[0]->h;
+
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+  avfilter_graph_free(&graph);
+}
+
+// Split the frame into vertical tiles (see --tiles). The first tile
+// goes to the main output and the others are encoded as renditions, each
+// one in its own thread. The tiles are cut from the output of the user
+// filters and aligned on 2 pixels for the chroma subsampling.
+void FrameWriter::init_tiles()
+{
+  main_area = FrameRect{0, 0, params.width, params.height};
+  if (params.tiles <= 1)
+    return;
+
+  if (hw_device_context) {
+    std::cerr << "Tiles are not supported with a HW encoder" << std::endl;
+    exit(-1);
+  }
+
+  int width, height;
+  get_user_filter_size(width, height);
+
+  int n = params.tiles;
+  if (width < 2 * n) {
+    std::cerr << "The video is too narrow for " << n << " tiles" << std::endl;
+    exit(-1);
+  }
+
+  for (int i=0; i<n; i++) {
+    int x0 = (width * i / n) & ~1 ;
+    int x1 = (i == n-1) ? width : (width * (i+1) / n) & ~1 ;
+    FrameRect area = {x0, 0, x1 - x0, height};
+    std::cerr << "Tile " << i << ": " << area.width << "x" << area.height
+              << "+" << area.x << " -> "
+              << (i == 0 ? params.file : get_tile_file(params.file, i)) << std::endl;
+    if (i == 0) {
+      // The regions of interest are in the coordinates of the capture,
+      // assumed to be scaled uniformly by the user filters.
+      main_tile = area;
+      main_area = FrameRect{int(int64_t(x0) * params.width / width), 0,
+                            int(int64_t(x1 - x0) * params.width / width), params.height};
+      continue;
+    }
+
+    FrameWriterRendition r;
+    r.width = area.width;
+    r.height = area.height;
+    r.bit_rate = 0;
+    r.file = get_tile_file(params.file, i);
+    r.crop = area;
+    params.renditions.push_back(r);
+  }
+}
+
+static std::string get_crop_filter(const FrameRect &r)
+{
+  std::stringstream text;
+  text << "crop=w=" << r.width << ":h=" << r.height << ":x=" << r.x << ":y=" << r.y;
+  return text.str();
+}
+
 void FrameWriter::init_video_filters(AVCodec *codec)
 {
   int err;
 
   AVFilterGraph *filter_graph = avfilter_graph_alloc();
+  if (params.filter_threads > 0)
+    filter_graph->nb_threads = params.filter_threads;
  
   const AVFilter * source = avfilter_get_by_name("buffer");
   const AVFilter * sink   = avfilter_get_by_name("buffersink");
@@ -230,6 +533,23 @@ void FrameWriter::init_video_filters(AVCodec *codec)
     exit(-1);
   }
 
+  std::string filter_text = params.video_filter ;
+
+  if (hw_device_context && !has_hw_transfer(filter_text)) {
+    filter_text = build_hw_pipeline(codec, filter_text);
+  } else {
+    // Assume that the user filters are producing HW frames
+    hw_filter_output = (hw_device_context != NULL);
+  }
+
+  if ( filter_text.empty() ) {
+    filter_text = "null" ;     // "null" is the dummy video filter
+  }
+
+  AVPixelFormat source_fmt = get_input_format();
+  if (hw_upload_context)
+    source_fmt = ((AVHWFramesContext *) hw_upload_context->data)->format;
+
   // Build the configuration of the 'buffer' filter.
   // See: ffmpeg -h filter=buffer
   // See: https://ffmpeg.org/ffmpeg-filters.html#buffer
@@ -244,7 +564,7 @@ void FrameWriter::init_video_filters(AVCodec *codec)
                  ":sws_param=flags=fast_bilinear"  
                  ,
                  params.width, params.height,      // video size
-                 int(this->get_input_format()),    // pix_fmt             
+                 int(source_fmt),                  // pix_fmt             
                  US_RATIONAL.num, US_RATIONAL.den, // time_base. We use micro-seconds
                  1,1                               // pixel_aspect
                  /* ... */                         // sws_param
@@ -261,15 +581,32 @@ void FrameWriter::init_video_filters(AVCodec *codec)
     std::cerr << "Cannot create video filter in: " << averr(err) << std::endl;;
     exit(-1);
   }
-  
 
-  AVFilterContext * sink_ctx = NULL ;
-  err = avfilter_graph_create_filter(&sink_ctx, sink, "Sink",
-                                     NULL, NULL, filter_graph);
-  if (err < 0) {
-    std::cerr << "Cannot create video filter out: " << averr(err) << std::endl;;
-    exit(-1);
+  if (hw_upload_context) {
+    AVBufferSrcParameters *par = av_buffersrc_parameters_alloc();
+    par->hw_frames_ctx = hw_upload_context;
+    err = av_buffersrc_parameters_set(source_ctx, par);
+    av_free(par);
+    if (err < 0) {
+      std::cerr << "Cannot set HW frames of video filter in: " << averr(err) << std::endl;;
+      exit(-1);
+    }
+  }
+
+  // One sink for the main output and one for each rendition.
+  std::vector<AVFilterContext*> sinks;
+  for (size_t i=0; i<=params.renditions.size(); i++) {
+    std::string name = (i==0) ? "Sink" : "Sink" + std::to_string(i) ;
+    AVFilterContext * sink_ctx = NULL ;
+    err = avfilter_graph_create_filter(&sink_ctx, sink, name.c_str(),
+                                       NULL, NULL, filter_graph);
+    if (err < 0) {
+      std::cerr << "Cannot create video filter out: " << averr(err) << std::endl;;
+      exit(-1);
+    }
+    sinks.push_back(sink_ctx);
   }
+  AVFilterContext * sink_ctx = sinks[0] ;
 
   // We also need to tell the sink which pixel formats are supported.
   // by the video encoder. codevIndicate to our sink  pixel formats
@@ -291,24 +628,34 @@ void FrameWriter::init_video_filters(AVCodec *codec)
      AV_PIX_FMT_YUV420P,
      AV_PIX_FMT_NONE
     } ;
+  static const AVPixelFormat only_yuv420p10[] =
+    {
+     AV_PIX_FMT_YUV420P10,
+     AV_PIX_FMT_NONE
+    } ;
 
   // Force the pixel format to yuv420p on user request (-to-yuv)
-  // but only if the codec supports that value.
+  // but only if the codec supports that value. The 10 bit variant
+  // is used for the captures deeper than 8 bits.
   // TODO: An option to select any pixel format would be nice.
   if ( params.to_yuv ) { 
-    if ( is_fmt_supported(AV_PIX_FMT_YUV420P, supported_pix_fmts) ) {
+    if ( is_high_depth(get_input_format()) &&
+         is_fmt_supported(AV_PIX_FMT_YUV420P10, supported_pix_fmts) ) {
+      supported_pix_fmts = only_yuv420p10 ;
+    } else if ( is_fmt_supported(AV_PIX_FMT_YUV420P, supported_pix_fmts) ) {
       supported_pix_fmts = only_yuv420p ;
     } else {
       std::cerr << "Ignoring request to force yuv420p.\n";
     }
   }
   
-  err = av_opt_set_int_list(sink_ctx, "pix_fmts", supported_pix_fmts,
-                            AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
-
-  if (err < 0) {
-    std::cerr << "Failed to set pix_fmts: " << averr(err) << std::endl;;
-    exit(-1);
+  for (AVFilterContext *ctx : sinks) {
+    err = av_opt_set_int_list(ctx, "pix_fmts", supported_pix_fmts,
+                              AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+    if (err < 0) {
+      std::cerr << "Failed to set pix_fmts: " << averr(err) << std::endl;;
+      exit(-1);
+    }
   }
 
   // Create the connections to the filter graph
@@ -329,13 +676,22 @@ void FrameWriter::init_video_filters(AVCodec *codec)
   outputs->pad_idx    = 0;
   outputs->next       = NULL;
   
-  AVFilterInOut *inputs  = avfilter_inout_alloc();
-  inputs->name       = av_strdup("out");
-  inputs->filter_ctx = sink_ctx;
-  inputs->pad_idx    = 0;
-  inputs->next       = NULL;
+  // The renditions are connected to the sinks 'rout0', 'rout1', ...
+  AVFilterInOut *inputs  = NULL;
+  for (size_t i=sinks.size(); i-- > 0 ; ) {
+    AVFilterInOut *io = avfilter_inout_alloc();
+    io->name       = av_strdup( (i==0) ? "out" : ("rout" + std::to_string(i-1)).c_str() );
+    io->filter_ctx = sinks[i];
+    io->pad_idx    = 0;
+    io->next       = inputs;
+    inputs = io;
+    if (!io->name) {
+      std::cerr << "Failed to parse allocate inout filter links" << std::endl ;
+      exit(-1);
+    }
+  }
   
-  if (!outputs->name || !inputs->name) {
+  if (!outputs->name) {
     std::cerr << "Failed to parse allocate inout filter links" << std::endl ;
     exit(-1);
   }
@@ -352,9 +708,51 @@ void FrameWriter::init_video_filters(AVCodec *codec)
   //filter_graph->scale_sws_opts = av_strdup("in_range=tv:out_range=tv");
 #endif
   
-  std::string filter_text = params.video_filter ;
-  if ( filter_text.empty() ) {
-    filter_text = "null" ;     // "null" is the dummy video filter
+  // The renditions are produced by splitting the output of the user
+  // filters. Each branch is then scaled once to the rendition size.
+  //
+  //   [in] user filters, split=3 [out][r0][r1] ;
+  //   [r0] scale=1280:720 [rout0] ;
+  //   [r1] scale=854:480  [rout1]
+  //
+  // The tiles are renditions cut by a 'crop' filter, which only moves
+  // the data pointers. The main output is then the first tile.
+  //
+  //   [in] user filters, split=3 [m][r0][r1] ;
+  //   [m]  crop=w=640:h=1080:x=0:y=0    [out] ;
+  //   [r0] crop=w=640:h=1080:x=640:y=0  [rout0] ;
+  //   [r1] crop=w=640:h=1080:x=1280:y=0 [rout1]
+  //
+  bool main_cropped = main_tile.width > 0 ;
+  if (!params.renditions.empty()) {
+    // Use the scale filter of the HW method (e.g. 'scale_vaapi') if the
+    // frames are already uploaded at that point.
+    std::string scaler = "scale" ;
+    if (hw_filter_output) {
+      std::string hw_scaler = "scale_" + params.hw_method ;
+      if (avfilter_get_by_name(hw_scaler.c_str()))
+        scaler = hw_scaler;
+    }
+    std::stringstream text;
+    text << filter_text << ",split=" << (params.renditions.size()+1)
+         << (main_cropped ? "[m]" : "[out]");
+    for (size_t i=0; i<params.renditions.size(); i++)
+      text << "[r" << i << "]";
+    if (main_cropped)
+      text << ";[m]" << get_crop_filter(main_tile) << "[out]";
+    for (size_t i=0; i<params.renditions.size(); i++) {
+      const FrameWriterRendition &r = params.renditions[i];
+      text << ";[r" << i << "]";
+      if (r.crop.width > 0) {
+        text << get_crop_filter(r.crop);
+        if (r.width != r.crop.width || r.height != r.crop.height)
+          text << "," << scaler << "=w=" << r.width << ":h=" << r.height;
+      } else {
+        text << scaler << "=w=" << r.width << ":h=" << r.height;
+      }
+      text << "[rout" << i << "]";
+    }
+    filter_text = text.str();
   }
   std::cerr << "Using video filter: " << filter_text << std::endl;;    
 
@@ -398,26 +796,17 @@ void FrameWriter::init_video_filters(AVCodec *codec)
     std::cout << std::string(80,'#') << std::endl ;     
   }
   
-  // The (input of the) sink is the output of the whole filter.  
-  AVFilterLink * filter_output = sink_ctx->inputs[0] ;
-  
-  this->vfilter.width  = filter_output->w ;
-  this->vfilter.height = filter_output->h ;
-  this->vfilter.sar    = filter_output->sample_aspect_ratio ; 
-  this->vfilter.pix_fmt = (AVPixelFormat) filter_output->format ;
-  this->vfilter.time_base = filter_output->time_base;
-  this->vfilter.frame_rate = filter_output->frame_rate; // can be 1/0 if unknown
+  get_filter_output(sink_ctx, this->vfilter);
 
   this->hw_frame_context = av_buffersink_get_hw_frames_ctx(sink_ctx); 
-    
-  std::cerr << "Encoding input format:"
-            << " w=" << this->vfilter.width
-            << " h=" << this->vfilter.height
-            << " pixfmt=" << av_get_pix_fmt_name(this->vfilter.pix_fmt)
-            << " sample_aspect_ratio=" << this->vfilter.sar
-            << " time_base=" << this->vfilter.time_base
-            << " frame_rate=" << this->vfilter.frame_rate
-            << "\n";
+
+  for (size_t i=0; i<params.renditions.size(); i++) {
+    std::unique_ptr<RenditionOutput> r(new RenditionOutput);
+    r->desc = params.renditions[i];
+    r->sink = sinks[i+1];
+    get_filter_output(r->sink, r->vfilter);
+    this->renditions.push_back(std::move(r));
+  }
       
   // TODO: free the graph in destructor
   this->videoFilterGraph = filter_graph;
@@ -442,53 +831,241 @@ void FrameWriter::init_video_stream()
       std::exit(-1);
     }
 
+  init_tiles();
   init_video_filters(codec);
-    
-  videoStream = avformat_new_stream(fmtCtx, codec);
-  if (!videoStream)
+
+  videoCodecCtx = open_video_encoder(fmtCtx, codec, vfilter, hw_frame_context,
+                                     &options, &videoStream);
+  av_dict_free(&options);
+
+  init_renditions(codec);
+
+  if (params.adaptive_quality)
+    init_quality_control();
+
+  if (params.quality_monitor_interval > 0)
+    {
+      // The references would have to be downloaded from the device.
+      if (hw_frame_context)
+        std::cerr << "The quality monitor does not support HW encoding" << std::endl;
+      else
+        quality_monitor.reset(new QualityMonitor(videoStream->codecpar, vfilter.time_base,
+          params.quality_monitor_interval, params.trace_video_progress));
+    }
+
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(56, 29, 100)
+  if (params.roi_strength > 0)
+    std::cerr << "Regions of interest are not supported by this version of FFMpeg\n";
+#endif
+}
+
+// Encoders that can change those options on the fly while encoding
+// (e.g. libx264 calls x264_encoder_reconfig() when 'crf' changes).
+static const std::map<std::string, std::vector<std::string>> runtime_quality_options =
+  {
+   { "libx264",    { "crf", "qp" } },
+   { "libx264rgb", { "crf", "qp" } },
+  };
+
+// Increase of the quality option for each level
+static const double QUALITY_STEP = 3;
+
+void FrameWriter::init_quality_control()
+{
+  auto it = runtime_quality_options.find(params.codec);
+  if (it != runtime_quality_options.end()) {
+    // Control the option that is in use. A negative value means unset.
+    for (const std::string &name : it->second) {
+      double value;
+      if (av_opt_get_double(videoCodecCtx->priv_data, name.c_str(), 0, &value) >= 0
+          && value >= 0) {
+        quality_option = name;
+        quality_base = value;
+        break;
+      }
+    }
+    // Otherwise, 'crf' is the default rate control unless a bitrate is given.
+    if (quality_option.empty() && videoCodecCtx->bit_rate <= 0 &&
+        av_opt_find(videoCodecCtx->priv_data, "crf", NULL, 0, 0)) {
+      quality_option = "crf";
+      quality_base = 23;
+    }
+  }
+
+  if (!quality_option.empty())
+    quality_steps = 4;
+
+  // Two more levels for the decimation by 2 and by 3
+  quality_controller.reset(new QualityController(quality_steps + 2));
+
+  std::cerr << "Adaptive quality: ";
+  if (quality_option.empty())
+    std::cerr << "frame decimation only" << std::endl;
+  else
+    std::cerr << quality_option << "=" << quality_base
+              << " then frame decimation" << std::endl;
+}
+
+void FrameWriter::apply_quality_level(int level)
+{
+  int quality_level = std::min(level, quality_steps);
+  if (!quality_option.empty()) {
+    double value = quality_base + QUALITY_STEP * quality_level;
+    int err = av_opt_set_double(videoCodecCtx->priv_data, quality_option.c_str(), value, 0);
+    if (err < 0) {
+      std::cerr << "Failed to set " << quality_option << ": " << averr(err) << std::endl;
+    }
+    if (params.trace_video_progress)
+      std::cerr << "TRACE: adaptive: " << quality_option << "=" << value << "\n";
+  }
+
+  decimation = 1 + std::max(0, level - quality_steps);
+  if (params.trace_video_progress)
+    std::cerr << "TRACE: adaptive: decimation=" << decimation << "\n";
+}
+
+// Above that number, the damaged regions are merged into a single one.
+static const size_t MAX_DAMAGE_RECTS = 32 ;
+
+void FrameWriter::add_damage(const FrameRect& rect)
+{
+  if (params.roi_strength <= 0)
+    return;
+
+  if (pending_damage.size() < MAX_DAMAGE_RECTS) {
+    pending_damage.push_back(rect);
+    return;
+  }
+
+  // Too many small rectangles are not useful to the encoder anyway.
+  FrameRect &box = pending_damage[0] ;
+  for (const FrameRect &r : pending_damage) {
+    int x1 = std::max(box.x + box.width,  r.x + r.width);
+    int y1 = std::max(box.y + box.height, r.y + r.height);
+    box.x = std::min(box.x, r.x);
+    box.y = std::min(box.y, r.y);
+    box.width  = x1 - box.x;
+    box.height = y1 - box.y;
+  }
+  pending_damage.resize(1);
+  add_damage(rect);
+}
+
+// Attach the damaged regions accumulated since the last encoded frame
+// as AV_FRAME_DATA_REGIONS_OF_INTEREST so that encoders supporting it
+// (e.g. libx264, libx265) spend more bits where the content changes.
+void FrameWriter::attach_regions_of_interest(AVFrame *frame)
+{
+  if (pending_damage.empty())
+    return;
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(56, 29, 100)
+  // The rectangles are in the coordinates of the captured frame which
+  // may have been cropped (see --tiles) and scaled by the filters.
+  double sx = double(frame->width)  / main_area.width ;
+  double sy = double(frame->height) / main_area.height ;
+
+  // Ignore the rectangles outside of the main output.
+  std::vector<FrameRect> rects;
+  for (const FrameRect &r : pending_damage) {
+    if (r.x < main_area.x + main_area.width && r.x + r.width > main_area.x &&
+        r.y < main_area.y + main_area.height && r.y + r.height > main_area.y)
+      rects.push_back(FrameRect{r.x - main_area.x, r.y - main_area.y, r.width, r.height});
+  }
+  pending_damage.clear();
+  if (rects.empty())
+    return;
+
+  size_t n = rects.size();
+  AVFrameSideData *sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                               n * sizeof(AVRegionOfInterest));
+  if (!sd) {
+    std::cerr << "Failed to allocate regions of interest\n";
+    exit(-1);
+  }
+
+  AVRegionOfInterest *roi = (AVRegionOfInterest *) sd->data;
+  for (size_t i=0; i<n; i++) {
+    const FrameRect &r = rects[i];
+    roi[i].self_size = sizeof(AVRegionOfInterest);
+    roi[i].left   = std::max(0, int(r.x * sx));
+    roi[i].top    = std::max(0, int(r.y * sy));
+    roi[i].right  = std::min(frame->width,  int(ceil((r.x + r.width)  * sx)));
+    roi[i].bottom = std::min(frame->height, int(ceil((r.y + r.height) * sy)));
+    // A negative offset means a better quality.
+    roi[i].qoffset = av_make_q(-int(params.roi_strength * 100), 100);
+  }
+
+  if (params.trace_video_progress)
+    std::cerr << "TRACE: attached " << n << " regions of interest\n";
+#endif
+
+  pending_damage.clear();
+}
+
+void FrameWriter::report_capture_backlog(int pending, int capacity)
+{
+  capture_backlog = pending;
+  capture_capacity = capacity;
+}
+
+AVCodecContext *
+FrameWriter::open_video_encoder(AVFormatContext *fmt, AVCodec *codec,
+                                const VideoFilterOutput &vf,
+                                AVBufferRef *hw_frames,
+                                AVDictionary **options,
+                                AVStream **stream)
+{
+  AVStream *st = avformat_new_stream(fmt, codec);
+  if (!st)
     {
       std::cerr << "Failed to open stream" << std::endl;
       std::exit(-1);
     }
 
-  videoCodecCtx = videoStream->codec;   
+  AVCodecContext *ctx = st->codec;   
     
-  videoCodecCtx->width      = vfilter.width;
-  videoCodecCtx->height     = vfilter.height;
-  videoCodecCtx->time_base  = vfilter.time_base; // may be changed by avcodec_open2
-  videoCodecCtx->sample_aspect_ratio = vfilter.sar ;
+  ctx->width      = vf.width;
+  ctx->height     = vf.height;
+  ctx->time_base  = vf.time_base; // may be changed by avcodec_open2
+  ctx->sample_aspect_ratio = vf.sar ;
 
   // This is just a hint. Some encoders will change the value to AVCOL_RANGE_MPEG
   // (e.g. vp9_vaapi)
-  videoCodecCtx->color_range = AVCOL_RANGE_JPEG ;
+  ctx->color_range = AVCOL_RANGE_JPEG ;
   
   // Note: since out input if RGB, FFMpeg will usually select
   // YUV444p over the more common but less accurate YUV420p.
   // Can be changed by a 'format=yuv420p' filter or by
   // the --to-yuv option.
   // Remark: Setting 
-  videoCodecCtx->pix_fmt    = vfilter.pix_fmt ;
+  ctx->pix_fmt    = vf.pix_fmt ;
     
   std::cerr << "Selected encoding pixel format = "
-            << av_get_pix_fmt_name(videoCodecCtx->pix_fmt) << std::endl;
+            << av_get_pix_fmt_name(ctx->pix_fmt) << std::endl;
 
   // Does that matter?   
-  videoCodecCtx->framerate = vfilter.frame_rate ;
+  ctx->framerate = vf.frame_rate ;
 
-  if ( this->hw_frame_context ) {
-    videoCodecCtx->hw_frames_ctx = av_buffer_ref(this->hw_frame_context);
+  if ( hw_frames ) {
+    ctx->hw_frames_ctx = av_buffer_ref(hw_frames);
   }   
 
-  if (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
-    videoCodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  // The encoder options (e.g. -p threads=4) take precedence.
+  if (params.encoder_threads >= 0)
+    ctx->thread_count = params.encoder_threads;
+  if (params.encoder_thread_type)
+    ctx->thread_type = params.encoder_thread_type;
+
+  if (fmt->oformat->flags & AVFMT_GLOBALHEADER)
+    ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
   int err;
-  err = avcodec_open2(videoCodecCtx, codec, &options);
+  err = avcodec_open2(ctx, codec, options);
   if (err < 0) {
     std::cerr << "avcodec_open2 failed: " << averr(err) << std::endl;
     std::exit(-1);
   }
-  av_dict_free(&options);
 
 #if 1
   // 
@@ -496,18 +1073,18 @@ void FrameWriter::init_video_stream()
   // because their videoCodecCtx is not equal to their videoStream->codec
   //
   //
-  err = avcodec_parameters_from_context(videoStream->codecpar, videoCodecCtx);
+  err = avcodec_parameters_from_context(st->codecpar, ctx);
   if (err < 0) {
     std::cerr << "avcodec_parameters_from_context failed: " << averr(err) << std::endl;
     std::exit(-1);
   }
 
   
-  if (videoCodecCtx->nb_coded_side_data) {
+  if (ctx->nb_coded_side_data) {
     int i;
-    for (i = 0; i < videoCodecCtx->nb_coded_side_data; i++) {
-      const AVPacketSideData *sd_src = &videoCodecCtx->coded_side_data[i];
-      uint8_t *dst_data = av_stream_new_side_data(videoStream, sd_src->type, sd_src->size);
+    for (i = 0; i < ctx->nb_coded_side_data; i++) {
+      const AVPacketSideData *sd_src = &ctx->coded_side_data[i];
+      uint8_t *dst_data = av_stream_new_side_data(st, sd_src->type, sd_src->size);
       if (!dst_data) {
         std::cerr << "bad side data" << std::endl;
         std::exit(-1);
@@ -523,7 +1100,139 @@ void FrameWriter::init_video_stream()
   //   The value written now is just a hint for avformat_write_header().
   //   It can be modified so we cannot avoid calling av_packet_rescale_ts()
   //   on all packets.
-  videoStream->time_base = US_RATIONAL;
+  st->time_base = US_RATIONAL;
+
+  *stream = st;
+  return ctx;
+}
+
+// Options of the muxers that keep a file playable when the trailer is
+// never written: the MP4 files are fragmented and the Matroska clusters
+// are closed at least once per interval.
+static void set_crash_safe_options(AVFormatContext *fmtCtx, int64_t interval_usec,
+                                   AVDictionary **options)
+{
+  if (interval_usec <= 0 || !fmtCtx->priv_data)
+    return;
+
+  if (av_opt_find(fmtCtx->priv_data, "movflags", NULL, 0, 0)) {
+    av_dict_set(options, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+    av_dict_set_int(options, "frag_duration", interval_usec, 0);
+  }
+  if (av_opt_find(fmtCtx->priv_data, "cluster_time_limit", NULL, 0, 0))
+    av_dict_set_int(options, "cluster_time_limit", interval_usec / 1000, 0);
+}
+
+void FrameWriter::init_renditions(AVCodec *codec)
+{
+  for (auto &r : renditions) {
+    std::cerr << "Rendition " << r->desc.width << "x" << r->desc.height
+              << " -> " << r->desc.file << std::endl;
+
+    if (avformat_alloc_output_context2(&r->fmtCtx, NULL, NULL,
+                                       r->desc.file.c_str()) < 0) {
+      std::cerr << "Failed to allocate output context for " << r->desc.file << std::endl;
+      std::exit(-1);
+    }
+
+    // Same encoder options than the main output except for the bitrate.
+    AVDictionary *options = NULL;
+    for (auto& opt : params.codec_options)
+      av_dict_set(&options, opt.first.c_str(), opt.second.c_str(), 0);
+    if (r->desc.bit_rate > 0)
+      av_dict_set_int(&options, "b", r->desc.bit_rate, 0);
+
+    r->codecCtx = open_video_encoder(r->fmtCtx, codec, r->vfilter,
+                                     av_buffersink_get_hw_frames_ctx(r->sink),
+                                     &options, &r->stream);
+    av_dict_free(&options);
+
+    av_dump_format(r->fmtCtx, 0, r->desc.file.c_str(), 1);
+    if (avio_open(&r->fmtCtx->pb, r->desc.file.c_str(), AVIO_FLAG_WRITE) < 0)
+      {
+        std::cerr << "avio_open failed for " << r->desc.file << std::endl;
+        std::exit(-1);
+      }
+    AVDictionary *mux_options = NULL;
+    set_crash_safe_options(r->fmtCtx, params.flush_interval_usec, &mux_options);
+    if (avformat_write_header(r->fmtCtx, &mux_options) < 0)
+      {
+        std::cerr << "Failed to write file header for " << r->desc.file << std::endl;
+        std::exit(-1);
+      }
+    av_dict_free(&mux_options);
+    r->mux.reset(new MuxThread(r->fmtCtx, r->desc.file, params.flush_interval_usec));
+
+    RenditionOutput *ptr = r.get();
+    r->thread = std::thread([=] () { rendition_loop(ptr); });
+  }
+}
+
+// Encode the frames queued for a rendition until finish_rendition()
+// is called. Each rendition owns its file and its mux thread.
+void FrameWriter::rendition_loop(RenditionOutput *r)
+{
+  set_thread_name(r->desc.crop.width > 0 ? "wf-tile" : "wf-rendition");
+
+  while (true) {
+    AVFrame *frame = NULL;
+    {
+      std::unique_lock<std::mutex> lock(r->mutex);
+      r->cond.wait(lock, [r] { return r->done || !r->queue.empty(); });
+      if (!r->queue.empty()) {
+        frame = r->queue.front();
+        r->queue.pop_front();
+      }
+    }
+    // The writer may be waiting for room in the queue of a tile.
+    r->cond.notify_all();
+
+    // frame is NULL once the queue is drained after finish_rendition()
+    // and that flushes the encoder.
+    int got_output;
+    do {
+      AVPacket pkt;
+      av_init_packet(&pkt);
+      pkt.data = NULL;
+      pkt.size = 0;
+      got_output = 0;
+      avcodec_encode_video2(r->codecCtx, &pkt, frame, &got_output);
+      if (got_output) {
+        av_packet_rescale_ts(&pkt, r->vfilter.time_base, r->stream->time_base);
+        pkt.stream_index = r->stream->index;
+        r->mux->write(&pkt);
+      }
+    } while (!frame && got_output);
+
+    if (!frame)
+      break;
+    av_frame_free(&frame);
+  }
+}
+
+void FrameWriter::finish_rendition(RenditionOutput *r)
+{
+  {
+    std::lock_guard<std::mutex> lock(r->mutex);
+    r->done = true;
+  }
+  r->cond.notify_one();
+  r->thread.join();
+
+  if (r->dropped)
+    std::cerr << "Rendition " << r->desc.file << ": dropped "
+              << r->dropped << " frames" << std::endl;
+
+  r->mux->finish();
+  if (params.print_stats)
+    r->mux->print_stats(std::cerr);
+  r->mux = nullptr;
+
+  av_write_trailer(r->fmtCtx);
+  if (!(r->fmtCtx->oformat->flags & AVFMT_NOFILE))
+    avio_closep(&r->fmtCtx->pb);
+  avcodec_close(r->codecCtx);
+  avformat_free_context(r->fmtCtx);
 }
 
 static uint64_t get_codec_channel_layout(AVCodec *codec)
@@ -541,6 +1250,17 @@ static uint64_t get_codec_channel_layout(AVCodec *codec)
   return codec->channel_layouts[0];
 }
 
+static int get_codec_sample_rate(AVCodec *codec)
+{
+  if (!codec->supported_samplerates)
+    return AUDIO_RATE;
+  for (int i = 0; codec->supported_samplerates[i]; i++) {
+    if (codec->supported_samplerates[i] == AUDIO_RATE)
+      return AUDIO_RATE;
+  }
+  return codec->supported_samplerates[0];
+}
+
 static enum AVSampleFormat get_codec_sample_fmt(AVCodec *codec)
 {
   int i = 0;
@@ -556,85 +1276,163 @@ static enum AVSampleFormat get_codec_sample_fmt(AVCodec *codec)
   return codec->sample_fmts[0];
 }
 
-void FrameWriter::init_audio_stream()
+void FrameWriter::init_audio_stream(AudioOutput *out, const std::string &title)
 {
-  AVCodec* codec = avcodec_find_encoder_by_name("aac");
+  AVCodec* codec = avcodec_find_encoder_by_name(params.audio_codec.c_str());
   if (!codec)
     {
-      std::cerr << "Failed to find the aac codec" << std::endl;
+      std::cerr << "Failed to find the " << params.audio_codec << " codec" << std::endl;
       std::exit(-1);
     }
 
-  audioStream = avformat_new_stream(fmtCtx, codec);
-  if (!audioStream)
+  out->stream = avformat_new_stream(fmtCtx, codec);
+  if (!out->stream)
     {
       std::cerr << "Failed to open audio stream" << std::endl;
       std::exit(-1);
     }
+  if (!title.empty())
+    av_dict_set(&out->stream->metadata, "title", title.c_str(), 0);
 
-  audioCodecCtx = audioStream->codec;
-  audioCodecCtx->bit_rate = lrintf(128000.0f);
-  audioCodecCtx->sample_fmt = get_codec_sample_fmt(codec);
-  audioCodecCtx->channel_layout = get_codec_channel_layout(codec);
-  audioCodecCtx->sample_rate = AUDIO_RATE;
-  audioCodecCtx->time_base = (AVRational) { 1, 1000 };
-  audioCodecCtx->channels = av_get_channel_layout_nb_channels(audioCodecCtx->channel_layout);
+  AVCodecContext *ctx = out->codecCtx = out->stream->codec;
+  ctx->bit_rate = lrintf(128000.0f);
+  ctx->sample_fmt = get_codec_sample_fmt(codec);
+  ctx->channel_layout = get_codec_channel_layout(codec);
+  ctx->sample_rate = get_codec_sample_rate(codec);
+  ctx->time_base = (AVRational) { 1, 1000 };
+  ctx->channels = av_get_channel_layout_nb_channels(ctx->channel_layout);
 
   if (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
-    audioCodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
   int err;
-  if ((err = avcodec_open2(audioCodecCtx, codec, NULL)) < 0)
+  if ((err = avcodec_open2(ctx, codec, NULL)) < 0)
     {
       std::cerr << "(audio) avcodec_open2 failed " << err << std::endl;
       std::exit(-1);
     }
 
-  swrCtx = swr_alloc();
-  if (!swrCtx)
+  // Codecs such as PCM accept any number of samples.
+  if (ctx->frame_size == 0)
+    ctx->frame_size = AUDIO_FRAME_SIZE;
+
+  out->mix.resize(ctx->frame_size * ctx->channels);
+  out->frame = av_frame_alloc();
+  out->pool = av_buffer_pool_init(av_samples_get_buffer_size(NULL, ctx->channels,
+                                                             ctx->frame_size,
+                                                             ctx->sample_fmt, 0),
+                                  NULL);
+
+  // Float samples are directly copied or deinterleaved in the frames.
+  // The other formats are converted by swresample.
+  if (ctx->sample_fmt == AV_SAMPLE_FMT_FLT || ctx->sample_fmt == AV_SAMPLE_FMT_FLTP)
+    return;
+
+  out->swr = swr_alloc();
+  if (!out->swr)
     {
       std::cerr << "Failed to allocate swr context" << std::endl;
       std::exit(-1);
     }
 
-  av_opt_set_int(swrCtx, "in_sample_rate", AUDIO_RATE, 0);
-  av_opt_set_int(swrCtx, "out_sample_rate", audioCodecCtx->sample_rate, 0);
-  av_opt_set_sample_fmt(swrCtx, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
-  av_opt_set_sample_fmt(swrCtx, "out_sample_fmt", audioCodecCtx->sample_fmt, 0);
-  av_opt_set_channel_layout(swrCtx, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-  av_opt_set_channel_layout(swrCtx, "out_channel_layout", audioCodecCtx->channel_layout, 0);
+  av_opt_set_int(out->swr, "in_sample_rate", ctx->sample_rate, 0);
+  av_opt_set_int(out->swr, "out_sample_rate", ctx->sample_rate, 0);
+  av_opt_set_sample_fmt(out->swr, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+  av_opt_set_sample_fmt(out->swr, "out_sample_fmt", ctx->sample_fmt, 0);
+  av_opt_set_channel_layout(out->swr, "in_channel_layout", ctx->channel_layout, 0);
+  av_opt_set_channel_layout(out->swr, "out_channel_layout", ctx->channel_layout, 0);
 
-  if (swr_init(swrCtx))
+  if (swr_init(out->swr))
     {
       std::cerr << "Failed to initialize swr" << std::endl;
       std::exit(-1);
     }
 }
 
+void FrameWriter::init_audio_input(AudioInput *in)
+{
+  // The input is captured with the rate and channels of the encoder.
+  // The resampler only adds or drops samples to follow the capture clock.
+  in->swr = swr_alloc();
+  if (!in->swr)
+    {
+      std::cerr << "Failed to allocate swr context" << std::endl;
+      std::exit(-1);
+    }
+
+  av_opt_set_int(in->swr, "in_sample_rate", audioCodecCtx->sample_rate, 0);
+  av_opt_set_int(in->swr, "out_sample_rate", audioCodecCtx->sample_rate, 0);
+  av_opt_set_sample_fmt(in->swr, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+  av_opt_set_sample_fmt(in->swr, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+  av_opt_set_channel_layout(in->swr, "in_channel_layout", audioCodecCtx->channel_layout, 0);
+  av_opt_set_channel_layout(in->swr, "out_channel_layout", audioCodecCtx->channel_layout, 0);
+  // Enable the resampler so that swr_set_compensation() is cheap.
+  av_opt_set_int(in->swr, "flags", SWR_FLAG_RESAMPLE, 0);
+
+  if (swr_init(in->swr))
+    {
+      std::cerr << "Failed to initialize swr" << std::endl;
+      std::exit(-1);
+    }
+
+  in->pending.channels = audioCodecCtx->channels;
+  in->pending.rate = audioCodecCtx->sample_rate;
+}
+
+void FrameWriter::init_audio()
+{
+  for (auto &desc : params.audio_inputs)
+    {
+      audio_inputs.emplace_back(new AudioInput());
+      audio_inputs.back()->desc = desc;
+    }
+
+  // A single input is not mixed.
+  bool separate = params.separate_audio || audio_inputs.size() == 1;
+  for (auto &in : audio_inputs)
+    {
+      if (separate || audio_outputs.empty())
+        {
+          audio_outputs.emplace_back(new AudioOutput());
+          init_audio_stream(audio_outputs.back().get(), separate ? in->desc.name : "mix");
+        }
+      audio_outputs.back()->inputs.push_back(in.get());
+    }
+
+  audioCodecCtx = audio_outputs[0]->codecCtx;
+  for (auto &in : audio_inputs)
+    init_audio_input(in.get());
+}
+
 void FrameWriter::init_codecs()
 {
   init_video_stream();
   if (params.enable_audio)
-    init_audio_stream();
+    init_audio();
   av_dump_format(fmtCtx, 0, params.file.c_str(), 1);
   if (avio_open(&fmtCtx->pb, params.file.c_str(), AVIO_FLAG_WRITE))
     {
       std::cerr << "avio_open failed" << std::endl;
       std::exit(-1);
     }
-  AVDictionary *dummy = NULL;
-  if (avformat_write_header(fmtCtx, &dummy) != 0)
+  AVDictionary *mux_options = NULL;
+  set_crash_safe_options(fmtCtx, params.flush_interval_usec, &mux_options);
+  if (avformat_write_header(fmtCtx, &mux_options) != 0)
     {
       std::cerr << "Failed to write file header" << std::endl;
       std::exit(-1);
     }
-  av_dict_free(&dummy);
+  av_dict_free(&mux_options);
+
+  mux.reset(new MuxThread(fmtCtx, params.file, params.flush_interval_usec));
 }
 
 
 FrameWriter::FrameWriter(const FrameWriterParams& _params) :
   params(_params)
 {
+  initialize_ffmpeg();
+
   if (params.enable_ffmpeg_debug_output)
     av_log_set_level(AV_LOG_DEBUG);
   else
@@ -662,30 +1460,276 @@ FrameWriter::FrameWriter(const FrameWriterParams& _params) :
   init_codecs();
 }
 
+// A fast hash of the frame content. The 8 independent lanes allow the
+// compiler to vectorize the loop (e.g. 2 x SSE4.1 or 1 x AVX2 register).
+static uint64_t hash_pixels(const uint8_t* pixels, size_t size)
+{
+  const int LANES = 8 ;
+  const uint32_t PRIME = 0x9E3779B1u ;
+  uint32_t h[LANES] ;
+  for (int k=0; k<LANES; k++)
+    h[k] = 0x811C9DC5u + k ;
+
+  size_t n = size / (LANES*sizeof(uint32_t)) ;
+  for (size_t i=0; i<n; i++) {
+    uint32_t w[LANES] ;
+    memcpy(w, pixels + i*sizeof(w), sizeof(w)) ;
+    for (int k=0; k<LANES; k++)
+      h[k] = (h[k] ^ w[k]) * PRIME ;
+  }
+  for (size_t i=n*LANES*sizeof(uint32_t); i<size; i++)
+    h[i%LANES] = (h[i%LANES] ^ pixels[i]) * PRIME ;
+
+  uint64_t result = 0 ;
+  for (int k=0; k<LANES; k++)
+    result = (result ^ h[k]) * 0x100000001B3ull + (result >> 29) ;
+  return result ;
+}
+
+// Tell if the frame is identical to the previous one and should not be
+// encoded. The pts of the encoded frames are the capture timestamps so
+// dropping frames produces a variable frame rate video.
+bool FrameWriter::is_static_frame(const uint8_t* pixels, size_t size, int64_t usec)
+{
+  if (params.static_max_gap_usec <= 0)
+    return false;
+
+  uint64_t hash = hash_pixels(pixels, size);
+  bool same = (last_frame_usec >= 0) && (hash == last_frame_hash);
+  last_frame_hash = hash;
+
+  if (same && usec - last_frame_usec < params.static_max_gap_usec) {
+    static_frames++;
+    return true;
+  }
+
+  // Refresh the video with a keyframe after a long static period so that
+  // seeking in the recording stays responsive.
+  if (same)
+    force_keyframe = true;
+
+  last_frame_usec = usec;
+  return false;
+}
+
 void FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert)
+{
+  add_frame(pixels, params.width, params.height,
+            get_input_bytes_per_pixel() * params.width, usec, y_invert);
+}
+
+// Unpack a frame of a format deeper than 8 bits to planar RGB.
+AVFrame *FrameWriter::convert_input_frame(const uint8_t* pixels, int width, int height,
+                                          int stride, bool y_invert)
+{
+  AVFrame *frame = av_frame_alloc();
+  frame->width  = width;
+  frame->height = height;
+  frame->format = get_input_format();
+
+  // The 3 planes are in a single buffer.
+  int linesize = FFALIGN(2*width, 32);
+  int size = 3 * linesize * height;
+  if (size != input_pool_size) {
+    av_buffer_pool_uninit(&input_pool);
+    input_pool = av_buffer_pool_init(size, NULL);
+    input_pool_size = size;
+  }
+  frame->buf[0] = av_buffer_pool_get(input_pool);
+  if (!frame->buf[0]) {
+    std::cerr << "Failed to allocate frame" << std::endl;
+    exit(-1);
+  }
+  for (int i=0; i<3; i++) {
+    frame->data[i] = frame->buf[0]->data + i * linesize * height;
+    frame->linesize[i] = linesize;
+  }
+
+  if (y_invert) {
+    pixels += (int64_t) stride * (height-1);
+    stride = -stride;
+  }
+
+  switch (params.format) {
+  case INPUT_FORMAT_X2RGB10:
+  case INPUT_FORMAT_X2BGR10:
+    convert_x2rgb10_to_gbrp10(pixels, stride, width, height,
+                              params.format == INPUT_FORMAT_X2BGR10,
+                              frame->data, frame->linesize);
+    break;
+  case INPUT_FORMAT_RGBA16F:
+  case INPUT_FORMAT_BGRA16F:
+    convert_rgba16f_to_gbrp16(pixels, stride, width, height,
+                              params.format == INPUT_FORMAT_BGRA16F,
+                              frame->data, frame->linesize);
+    break;
+  default:
+    break;
+  }
+  return frame;
+}
+
+// Build the graph that scales a frame of the given size to the size of
+// the encoder. The aspect ratio is kept and the picture is centered with
+// black borders.
+void FrameWriter::init_resize_filter(int width, int height)
+{
+  int err;
+  avfilter_graph_free(&resizeGraph);
+
+  double scale = std::min(double(params.width) / width,
+                          double(params.height) / height);
+  resize_area.width  = std::min(params.width,  std::max(2, int(width * scale + 0.5) & ~1));
+  resize_area.height = std::min(params.height, std::max(2, int(height * scale + 0.5) & ~1));
+  resize_area.x = (params.width  - resize_area.width)  / 2;
+  resize_area.y = (params.height - resize_area.height) / 2;
+  resize_width  = width;
+  resize_height = height;
+
+  std::cerr << "Capture size changed to " << width << "x" << height
+            << ", scaling to " << resize_area.width << "x" << resize_area.height
+            << " in " << params.width << "x" << params.height << std::endl;
+
+  resizeGraph = avfilter_graph_alloc();
+  if (params.filter_threads > 0)
+    resizeGraph->nb_threads = params.filter_threads;
+
+  std::stringstream source_args;
+  source_args << "video_size=" << width << "x" << height
+              << ":pix_fmt=" << int(get_input_format())
+              << ":time_base=" << US_RATIONAL
+              << ":pixel_aspect=1/1";
+  err = avfilter_graph_create_filter(&resizeSourceCtx, avfilter_get_by_name("buffer"),
+                                     "ResizeSource", source_args.str().c_str(),
+                                     NULL, resizeGraph);
+  if (err >= 0)
+    err = avfilter_graph_create_filter(&resizeSinkCtx, avfilter_get_by_name("buffersink"),
+                                       "ResizeSink", NULL, NULL, resizeGraph);
+  if (err < 0) {
+    std::cerr << "Cannot create resize filter: " << averr(err) << std::endl;
+    exit(-1);
+  }
+
+  // The main graph expects the same pixel format as before.
+  const AVPixelFormat pix_fmts[] = { get_input_format(), AV_PIX_FMT_NONE };
+  err = av_opt_set_int_list(resizeSinkCtx, "pix_fmts", pix_fmts,
+                            AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+  if (err < 0) {
+    std::cerr << "Failed to set pix_fmts: " << averr(err) << std::endl;
+    exit(-1);
+  }
+
+  std::stringstream text;
+  text << "scale=" << resize_area.width << ":" << resize_area.height << ":flags=bilinear"
+       << ",pad=" << params.width << ":" << params.height
+       << ":" << resize_area.x << ":" << resize_area.y << ":color=black"
+       << ",setsar=1";
+
+  AVFilterInOut *outputs = avfilter_inout_alloc();
+  outputs->name       = av_strdup("in");
+  outputs->filter_ctx = resizeSourceCtx;
+  outputs->pad_idx    = 0;
+  outputs->next       = NULL;
+
+  AVFilterInOut *inputs = avfilter_inout_alloc();
+  inputs->name       = av_strdup("out");
+  inputs->filter_ctx = resizeSinkCtx;
+  inputs->pad_idx    = 0;
+  inputs->next       = NULL;
+
+  err = avfilter_graph_parse_ptr(resizeGraph, text.str().c_str(), &inputs, &outputs, NULL);
+  if (err >= 0)
+    err = avfilter_graph_config(resizeGraph, NULL);
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+  if (err < 0) {
+    std::cerr << "Failed to configure resize filter: " << averr(err) << std::endl;
+    exit(-1);
+  }
+}
+
+// Scale and pad a frame to the size of the encoder. The damaged regions
+// are moved accordingly.
+AVFrame *FrameWriter::resize_frame(AVFrame *frame)
+{
+  int width = frame->width, height = frame->height;
+  if (!resizeGraph || width != resize_width || height != resize_height)
+    init_resize_filter(width, height);
+
+  int err = av_buffersrc_add_frame_flags(resizeSourceCtx, frame, 0);
+  av_frame_free(&frame);
+
+  AVFrame *resized = av_frame_alloc();
+  if (err >= 0)
+    err = av_buffersink_get_frame(resizeSinkCtx, resized);
+  if (err < 0) {
+    std::cerr << "Failed to resize frame: " << averr(err) << std::endl;
+    exit(-1);
+  }
+
+  double sx = double(resize_area.width)  / width ;
+  double sy = double(resize_area.height) / height ;
+  for (FrameRect &r : pending_damage) {
+    int x1 = int(ceil((r.x + r.width)  * sx));
+    int y1 = int(ceil((r.y + r.height) * sy));
+    r.x = resize_area.x + int(r.x * sx);
+    r.y = resize_area.y + int(r.y * sy);
+    r.width  = resize_area.x + x1 - r.x;
+    r.height = resize_area.y + y1 - r.y;
+  }
+  return resized;
+}
+
+void FrameWriter::add_frame(const uint8_t* pixels, int width, int height, int stride,
+                            int64_t usec, bool y_invert)
 {
   // Ignore y_invert! Can easily be done with a filter
   if (params.trace_video_progress) std::cerr << "TRACE: received input frame\n";
   int err;
 
-  // Create a frame for the pixels
-  AVFrame * frame = av_frame_alloc();
-  frame->width       = params.width;
-  frame->height      = params.height;
-  frame->format      = get_input_format(); // a 32 bit RGBx pixel format
-  frame->data[0]     = (uint8_t*) pixels;
-  frame->linesize[0] = 4*params.width;
-  frame->pts         = usec;  // because our time_base is US_RATIONAL
+  if (is_static_frame(pixels, size_t(stride) * height, usec)) {
+    if (params.trace_video_progress) std::cerr << "TRACE: dropped static input frame\n";
+    return;
+  }
 
-  if (y_invert) {
-    // Do a cheap vflip using pointer manipulations.
-    // Remark: This is also how the 'vflip' filter is operating
-    //         but we cannot use 'vflip' because that invertion
-    //         is not requested on-the-fly
-    frame->data[0] += frame->linesize[0] * (frame->height-1);
-    frame->linesize[0] = -frame->linesize[0];
+  if (decimation > 1 && (decimation_count++ % decimation) != 0) {
+    if (params.trace_video_progress) std::cerr << "TRACE: decimated input frame\n";
+    return;
   }
 
+  auto start_time = std::chrono::steady_clock::now();
+
+  // Create a frame for the pixels
+  AVFrame * frame;
+  if (params.format == INPUT_FORMAT_BGR0 || params.format == INPUT_FORMAT_RGB0) {
+    frame = av_frame_alloc();
+    frame->width       = width;
+    frame->height      = height;
+    frame->format      = get_input_format(); // a 32 bit RGBx pixel format
+    frame->data[0]     = (uint8_t*) pixels;
+    frame->linesize[0] = stride;
+
+    if (y_invert) {
+      // Do a cheap vflip using pointer manipulations.
+      // Remark: This is also how the 'vflip' filter is operating
+      //         but we cannot use 'vflip' because that invertion
+      //         is not requested on-the-fly
+      frame->data[0] += frame->linesize[0] * (frame->height-1);
+      frame->linesize[0] = -frame->linesize[0];
+    }
+  } else {
+    frame = convert_input_frame(pixels, width, height, stride, y_invert);
+  }
+  frame->pts = usec;  // because our time_base is US_RATIONAL
+
+  // The size of the capture has changed since the encoder was created.
+  if (width != params.width || height != params.height) {
+    if (params.trace_video_progress) std::cerr << "TRACE: resizing input frame\n";
+    frame = resize_frame(frame);
+  } else if (resizeGraph) {
+    std::cerr << "Capture size is back to " << width << "x" << height << std::endl;
+    avfilter_graph_free(&resizeGraph);
+  }
   
   // Is that needed? That makes sense for a RGB 'screencast'
   // but the documentation says that this is about the 'YUV range'
@@ -695,6 +1739,22 @@ void FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert)
   }
 
 
+  // Upload the frame to the HW device using our pool of HW frames.
+  if (hw_upload_context) {
+    AVFrame *hw = av_frame_alloc();
+    err = av_hwframe_get_buffer(hw_upload_context, hw, 0);
+    if (err >= 0)
+      err = av_hwframe_transfer_data(hw, frame, 0);
+    if (err < 0) {
+      std::cerr << "Failed to upload frame: " << averr(err) << std::endl;
+      exit(-1);
+    }
+    hw->pts = frame->pts;
+    hw->color_range = frame->color_range;
+    av_frame_free(&frame);
+    frame = hw;
+  }
+
   // Push the RGB frame into the filtergraph */
   err = av_buffersrc_add_frame_flags(videoFilterSourceCtx, frame, 0);
   if (err < 0) {
@@ -743,6 +1803,13 @@ void FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert)
     //       frames are produced by a decoder and so may
     //       have additional flags set. 
     filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (force_keyframe) {
+      filtered_frame->pict_type = AV_PICTURE_TYPE_I;
+      force_keyframe = false;
+    }
+
+    if (params.roi_strength > 0)
+      attach_regions_of_interest(filtered_frame);
 
     // printf("filtered color_range = %d\n", filtered_frame->color_range );
     // filtered_frame->color_range = AVCOL_RANGE_JPEG;
@@ -753,37 +1820,329 @@ void FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert)
     pkt.data = NULL;
     pkt.size = 0;
 
+    if (quality_monitor)
+      quality_monitor->add_reference(filtered_frame);
+
     int got_output=0;
     avcodec_encode_video2(videoCodecCtx, &pkt, filtered_frame, &got_output);
 
     av_frame_unref(filtered_frame);
     
+    encoded_frames++;
     if (got_output)
-      finish_frame(pkt, true);    
+      finish_frame(pkt, videoStream);    
+  }
+
+  // Pass the frames of each rendition to its encoding thread.
+  // While capturing, a rendition that cannot keep up is dropping
+  // frames instead of slowing down the main output. The tiles are
+  // waited for since a missing frame would break the mosaic, and so
+  // are all the renditions when the input is not live.
+  static const size_t max_rendition_queue = 16 ;
+  for (auto &r : renditions) {
+    while (av_buffersink_get_frame(r->sink, filtered_frame) >= 0) {
+      filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+      std::unique_lock<std::mutex> lock(r->mutex);
+      if (r->desc.crop.width > 0 || params.offline)
+        r->cond.wait(lock, [&r] { return r->queue.size() < max_rendition_queue; });
+      if (r->queue.size() >= max_rendition_queue) {
+        if (r->dropped++ == 0)
+          std::cerr << "Rendition " << r->desc.file
+                    << " cannot keep up, dropping frames" << std::endl;
+        av_frame_unref(filtered_frame);
+        continue;
+      }
+      AVFrame *queued = av_frame_alloc();
+      av_frame_move_ref(queued, filtered_frame);
+      r->queue.push_back(queued);
+      lock.unlock();
+      r->cond.notify_all();
+    }
   }
 
   av_frame_free(&filtered_frame);
   av_frame_free(&frame);          
+
+  if (quality_controller) {
+    auto encode_usec = std::chrono::duration_cast<std::chrono::microseconds>
+      (std::chrono::steady_clock::now() - start_time).count();
+    if (quality_controller->update(usec, encode_usec, capture_backlog, capture_capacity)) {
+      if (params.trace_video_progress)
+        std::cerr << "TRACE: adaptive: " << quality_controller->reason() << "\n";
+      apply_quality_level(quality_controller->level());
+    }
+  }
 }
 
 #define SRC_RATE 1e6
 #define DST_RATE 1e3
 
-static int64_t conv_audio_pts(SwrContext *ctx, int64_t in)
+static int64_t conv_audio_pts(SwrContext *ctx, int64_t in, int rate,
+                              int64_t dst_rate = DST_RATE)
 {
-  int64_t d = (int64_t) AUDIO_RATE * AUDIO_RATE;
+  int64_t d = (int64_t) rate * rate;
 
   /* Convert from audio_src_tb to 1/(src_samplerate * dst_samplerate) */
-  in = av_rescale_rnd(in, d, SRC_RATE, AV_ROUND_NEAR_INF);
+  if (in != INT64_MIN)
+    in = av_rescale_rnd(in, d, SRC_RATE, AV_ROUND_NEAR_INF);
 
   /* In units of 1/(src_samplerate * dst_samplerate) */
   in = swr_next_pts(ctx, in);
 
   /* Convert from 1/(src_samplerate * dst_samplerate) to audio_dst_tb */
-  return av_rescale_rnd(in, DST_RATE, d, AV_ROUND_NEAR_INF);
+  return av_rescale_rnd(in, dst_rate, d, AV_ROUND_NEAR_INF);
+}
+
+// Interval between two A/V clock traces
+#define CLOCK_TRACE_USEC 10000000
+
+void FrameWriter::compensate_audio_drift(AudioInput *in, int64_t capture_usec)
+{
+  AVClock &clock = in->clock;
+  if (!clock.has_origin())
+    return;
+
+  int rate = audioCodecCtx->sample_rate;
+  int64_t input_usec = av_rescale(in->input_samples, SRC_RATE, rate);
+  clock.add_audio_chunk(capture_usec, input_usec,
+                        conv_audio_pts(in->swr, INT64_MIN, rate, SRC_RATE));
+
+  if (clock.needs_resync())
+    {
+      // Restart the pts from the capture time. This always happens for
+      // the first chunk since the audio starts after the first frame.
+      if (params.trace_video_progress)
+        std::cerr << "TRACE: audio '" << in->desc.name << "' resync at "
+                  << clock.to_pts(capture_usec) << "us\n";
+      conv_audio_pts(in->swr, clock.to_pts(capture_usec), rate);
+      swr_set_compensation(in->swr, 0, 0);
+      clock.resync();
+      return;
+    }
+
+  // The compensation is spread over the next second.
+  swr_set_compensation(in->swr, clock.compensation(rate), rate);
+
+  if (params.trace_video_progress && capture_usec >= in->next_clock_trace)
+    {
+      std::cerr << "TRACE: audio '" << in->desc.name << "' " << clock.stats() << "\n";
+      in->next_clock_trace = capture_usec + CLOCK_TRACE_USEC;
+    }
+}
+
+// Gaps and overlaps in the pts of an audio input below that number of
+// samples are ignored (rounding of the pts, start of the resampler).
+#define AUDIO_PTS_TOLERANCE 32
+
+// Above that gap, an input is considered to have been interrupted
+// (e.g. suspend). The pts jumps instead of being filled with silence.
+#define AUDIO_MAX_GAP_USEC 1000000
+
+// An input lagging behind the others by more than that delay is
+// mixed as silence.
+#define AUDIO_MAX_LAG_USEC 500000
+
+// Return where to write 'count' samples at 'data_pts' once the gap
+// since the pending samples is filled with silence. commit() then
+// keeps the ones actually written.
+float *FrameWriter::AudioBuffer::reserve(int64_t data_pts, int count)
+{
+  int64_t gap = data_pts - end();
+  int64_t silence = 0;
+  overlap = 0;
+  if (pts < 0 || gap > av_rescale(AUDIO_MAX_GAP_USEC, rate, SRC_RATE))
+    {
+      first = last = 0;
+      pts = data_pts;
+    }
+  else if (gap > AUDIO_PTS_TOLERANCE)
+    silence = gap;
+  else if (gap < -AUDIO_PTS_TOLERANCE)
+    overlap = -gap;
+
+  // Move the pending samples to the front only once at least as many
+  // were consumed, so that each sample is moved at most once.
+  size_t needed = (silence + count) * channels;
+  if (last + needed > samples.size() && first >= last - first)
+    {
+      std::copy(samples.begin() + first, samples.begin() + last, samples.begin());
+      last -= first;
+      first = 0;
+    }
+  if (last + needed > samples.size())
+    samples.resize(last + needed);
+
+  std::fill(samples.begin() + last, samples.begin() + last + silence * channels, 0.0f);
+  last += silence * channels;
+  return samples.data() + last;
+}
+
+void FrameWriter::AudioBuffer::commit(int count)
+{
+  // Drop the start of what overlaps the pending samples.
+  int drop = std::min<int64_t>(overlap, count);
+  if (drop > 0)
+    std::copy(samples.begin() + last + drop * channels,
+              samples.begin() + last + count * channels, samples.begin() + last);
+  last += (count - drop) * channels;
+  overlap = 0;
+}
+
+void FrameWriter::AudioBuffer::consume(int64_t until_pts)
+{
+  int64_t n = std::max<int64_t>(0, std::min(until_pts - pts, size()));
+  first += n * channels;
+  pts += n;
+  if (first == last)
+    first = last = 0;
+}
+
+// dst += gain * src. This is the inner loop of the audio mix.
+static void mix_samples(float *dst, const float *src, float gain, size_t count)
+{
+  size_t i = 0;
+#ifdef __SSE__
+  const __m128 g = _mm_set1_ps(gain);
+  for (; i + 8 <= count; i += 8)
+    {
+      __m128 a = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g));
+      __m128 b = _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_mul_ps(_mm_loadu_ps(src + i + 4), g));
+      _mm_storeu_ps(dst + i, a);
+      _mm_storeu_ps(dst + i + 4, b);
+    }
+#endif
+  for (; i < count; i++)
+    dst[i] += gain * src[i];
+}
+
+// Encode all the frames for which every input of the output has
+// provided its samples. Must be called with audio_mutex held.
+void FrameWriter::mix_audio_output(AudioOutput *out)
+{
+  int frame_size = out->codecCtx->frame_size;
+  int channels = out->codecCtx->channels;
+  int64_t max_gap = av_rescale(AUDIO_MAX_GAP_USEC, out->codecCtx->sample_rate, SRC_RATE);
+  int64_t max_lag = av_rescale(AUDIO_MAX_LAG_USEC, out->codecCtx->sample_rate, SRC_RATE);
+
+  for (;;)
+    {
+      int64_t first = INT64_MAX, last = -1;
+      for (AudioInput *in : out->inputs)
+        {
+          if (in->pending.pts < 0)
+            continue;
+          first = std::min(first, in->pending.pts);
+          last = std::max(last, in->pending.end());
+        }
+      if (last < 0)
+        return;
+
+      // Start, or restart after all the inputs were interrupted.
+      if (out->pts < 0 || first - out->pts > max_gap)
+        out->pts = first;
+
+      bool ready = true;
+      for (AudioInput *in : out->inputs)
+        ready = ready && in->pending.end() >= out->pts + frame_size;
+      if (!ready && last < out->pts + frame_size + max_lag)
+        return;
+
+      // A single input at unity gain is encoded from its pending samples.
+      AudioBuffer *only = out->inputs.size() == 1 && out->inputs[0]->desc.gain == 1.0f ?
+        &out->inputs[0]->pending : NULL;
+      if (only && only->pts <= out->pts && only->end() >= out->pts + frame_size)
+        {
+          encode_audio(out, only->data() + (out->pts - only->pts) * channels, out->pts);
+          only->consume(out->pts + frame_size);
+          out->pts += frame_size;
+          continue;
+        }
+
+      std::fill(out->mix.begin(), out->mix.end(), 0.0f);
+      for (AudioInput *in : out->inputs)
+        {
+          AudioBuffer &b = in->pending;
+          if (b.pts < 0)
+            continue;
+          int64_t begin = std::max(b.pts, out->pts);
+          int64_t end = std::min(b.end(), out->pts + frame_size);
+          if (end > begin)
+            mix_samples(&out->mix[(begin - out->pts) * channels],
+                        b.data() + (begin - b.pts) * channels,
+                        in->desc.gain, (end - begin) * channels);
+          // Drop what was mixed and what arrived too late.
+          b.consume(out->pts + frame_size);
+        }
+
+      encode_audio(out, out->mix.data(), out->pts);
+      out->pts += frame_size;
+    }
+}
+
+// Split interleaved samples into one plane per channel.
+static void deinterleave_samples(float **planes, const float *src, int channels, int count)
+{
+  int i = 0;
+#ifdef __SSE__
+  if (channels == 2)
+    {
+      // L0 R0 L1 R1 | L2 R2 L3 R3  ->  L0 L1 L2 L3 | R0 R1 R2 R3
+      for (; i + 4 <= count; i += 4)
+        {
+          __m128 a = _mm_loadu_ps(src + 2*i);
+          __m128 b = _mm_loadu_ps(src + 2*i + 4);
+          _mm_storeu_ps(planes[0] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+          _mm_storeu_ps(planes[1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+    }
+#endif
+  for (; i < count; i++)
+    for (int c = 0; c < channels; c++)
+      planes[c][i] = src[i*channels + c];
+}
+
+void FrameWriter::convert_audio(AudioOutput *out, const float *samples, AVFrame *frame)
+{
+  AVCodecContext *ctx = out->codecCtx;
+  if (ctx->sample_fmt == AV_SAMPLE_FMT_FLTP)
+    deinterleave_samples((float**) frame->extended_data, samples, ctx->channels, ctx->frame_size);
+  else if (ctx->sample_fmt == AV_SAMPLE_FMT_FLT)
+    memcpy(frame->data[0], samples, ctx->frame_size * ctx->channels * sizeof(float));
+  else
+    {
+      const uint8_t *in = (const uint8_t*) samples;
+      swr_convert(out->swr, frame->extended_data, frame->nb_samples, &in, ctx->frame_size);
+    }
+}
+
+void FrameWriter::encode_audio(AudioOutput *out, const float *samples, int64_t pts)
+{
+  AVCodecContext *ctx = out->codecCtx;
+  AVFrame *frame = out->frame;
+  frame->format         = ctx->sample_fmt;
+  frame->sample_rate    = ctx->sample_rate;
+  frame->channel_layout = ctx->channel_layout;
+  frame->channels       = ctx->channels;
+  frame->nb_samples     = ctx->frame_size;
+  frame->buf[0] = av_buffer_pool_get(out->pool);
+  if (!frame->buf[0])
+    {
+      std::cerr << "Failed to allocate audio frame" << std::endl;
+      exit(-1);
+    }
+  av_samples_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                         ctx->channels, ctx->frame_size, ctx->sample_fmt, 0);
+  frame->extended_data = frame->data;
+
+  convert_audio(out, samples, frame);
+  frame->pts = av_rescale(pts, DST_RATE, ctx->sample_rate);
+
+  send_audio_pkt(out, frame);
+  // The buffer returns to the pool when the encoder releases it.
+  av_frame_unref(frame);
 }
 
-void FrameWriter::send_audio_pkt(AVFrame *frame)
+void FrameWriter::send_audio_pkt(AudioOutput *out, AVFrame *frame)
 {
   AVPacket pkt;
   av_init_packet(&pkt);
@@ -791,73 +2150,92 @@ void FrameWriter::send_audio_pkt(AVFrame *frame)
   pkt.size = 0;
 
   int got_output;
-  avcodec_encode_audio2(audioCodecCtx, &pkt, frame, &got_output);
+  avcodec_encode_audio2(out->codecCtx, &pkt, frame, &got_output);
   if (got_output)
-    finish_frame(pkt, false);
+    finish_frame(pkt, out->stream);
 }
 
 size_t FrameWriter::get_audio_buffer_size()
 {
-  return audioCodecCtx->frame_size << 3;
+  return audioCodecCtx->frame_size * audioCodecCtx->channels * sizeof(float);
 }
 
-void FrameWriter::add_audio(const void* buffer)
+int FrameWriter::get_audio_sample_rate()
 {
-  AVFrame *inputf = av_frame_alloc();
-  inputf->sample_rate    = AUDIO_RATE;
-  inputf->format         = AV_SAMPLE_FMT_FLT;
-  inputf->channel_layout = AV_CH_LAYOUT_STEREO;
-  inputf->nb_samples     = audioCodecCtx->frame_size;
+  return audioCodecCtx->sample_rate;
+}
 
-  av_frame_get_buffer(inputf, 0);
-  memcpy(inputf->data[0], buffer, get_audio_buffer_size());
+int FrameWriter::get_audio_channels()
+{
+  return audioCodecCtx->channels;
+}
 
-  AVFrame *outputf = av_frame_alloc();
-  outputf->format         = audioCodecCtx->sample_fmt;
-  outputf->sample_rate    = audioCodecCtx->sample_rate;
-  outputf->channel_layout = audioCodecCtx->channel_layout;
-  outputf->nb_samples     = audioCodecCtx->frame_size;
-  av_frame_get_buffer(outputf, 0);
+void FrameWriter::set_clock_origin(int64_t usec)
+{
+  for (auto &in : audio_inputs)
+    in->clock.set_origin(usec);
+}
+
+// Resample a chunk of an input to follow the capture clock, straight
+// into its pending samples. Return the number of samples written. Must
+// be called with audio_mutex held.
+int FrameWriter::resample_audio(AudioInput *in, const void *buffer, int64_t capture_usec)
+{
+  int rate = audioCodecCtx->sample_rate;
+  int frame_size = audioCodecCtx->frame_size;
 
-  outputf->pts = conv_audio_pts(swrCtx, INT64_MIN);
-  swr_convert_frame(swrCtx, outputf, inputf);
+  compensate_audio_drift(in, capture_usec);
+  in->input_samples += frame_size;
 
-  send_audio_pkt(outputf);
+  int64_t pts = conv_audio_pts(in->swr, INT64_MIN, rate, rate);
 
-  av_frame_free(&inputf);
-  av_frame_free(&outputf);
+  int capacity = swr_get_out_samples(in->swr, frame_size);
+  uint8_t *out = (uint8_t*) in->pending.reserve(pts, capacity);
+  const uint8_t *data = (const uint8_t*) buffer;
+  int count = swr_convert(in->swr, &out, capacity, &data, frame_size);
+  in->pending.commit(std::max(count, 0));
+  return count;
 }
 
-void FrameWriter::finish_frame(AVPacket& pkt, bool is_video)
+void FrameWriter::add_audio(int index, const void* buffer, int64_t capture_usec)
 {
-  static std::mutex fmt_mutex, pending_mutex;
+  // Each input is resampled in the thread of its PulseReader.
+  AudioInput *in = audio_inputs[index].get();
+  std::lock_guard<std::mutex> lock(audio_mutex);
+  if (resample_audio(in, buffer, capture_usec) <= 0)
+    return;
+
+  for (auto &out : audio_outputs)
+    mix_audio_output(out.get());
+}
 
-  if (is_video)
+void FrameWriter::finish_frame(AVPacket& pkt, AVStream *stream)
+{
+  if (stream == videoStream)
     {
       if (params.trace_video_progress) std::cerr << "TRACE: received video packet\n";
+      if (quality_monitor)
+        quality_monitor->add_packet(&pkt);
       av_packet_rescale_ts(&pkt, vfilter.time_base, videoStream->time_base);
-      pkt.stream_index = videoStream->index;
     } else
     {
-      av_packet_rescale_ts(&pkt, (AVRational){ 1, 1000 }, audioStream->time_base);
-      pkt.stream_index = audioStream->index;
+      av_packet_rescale_ts(&pkt, (AVRational){ 1, 1000 }, stream->time_base);
     }
+  pkt.stream_index = stream->index;
 
-  /* We use two locks to ensure that if WLOG the audio thread is waiting for
-   * the video one, when the video becomes ready the audio thread will be the
-   * next one to obtain the lock */
-  if (params.enable_audio)
-    {
-      pending_mutex.lock();
-      fmt_mutex.lock();
-      pending_mutex.unlock();
-    }
-
-  av_interleaved_write_frame(fmtCtx, &pkt);
-  av_packet_unref(&pkt);
+  // The video and audio threads only queue the packet.
+  mux->write(&pkt);
+}
 
-  if (params.enable_audio)
-    fmt_mutex.unlock();
+void FrameWriter::print_stats(std::ostream &out)
+{
+  out << "STATS: encoded frames: " << encoded_frames
+      << ", static frames: " << static_frames << std::endl;
+  for (auto &in : audio_inputs)
+    out << "STATS: audio '" << in->desc.name << "': " << in->clock.stats() << std::endl;
+  if (quality_monitor)
+    quality_monitor->print_stats(out);
+  mux->print_stats(out);
 }
 
 FrameWriter::~FrameWriter()
@@ -872,15 +2250,30 @@ FrameWriter::~FrameWriter()
     {
       avcodec_encode_video2(videoCodecCtx, &pkt, NULL, &got_output);
       if (got_output)
-        finish_frame(pkt, true);
+        finish_frame(pkt, videoStream);
     }
 
-  for (int got_output = 1; got_output && params.enable_audio;)
-    {
-      avcodec_encode_audio2(audioCodecCtx, &pkt, NULL, &got_output);
-      if (got_output)
-        finish_frame(pkt, false);
-    }
+  for (auto &out : audio_outputs)
+    for (int got_output = 1; got_output;)
+      {
+        avcodec_encode_audio2(out->codecCtx, &pkt, NULL, &got_output);
+        if (got_output)
+          finish_frame(pkt, out->stream);
+      }
+
+  for (auto &r : renditions)
+    finish_rendition(r.get());
+
+  mux->finish();
+
+  if (static_frames)
+    std::cerr << "Dropped " << static_frames << " static frames" << std::endl;
+
+  if (quality_monitor)
+    quality_monitor->finish();
+
+  if (params.print_stats || quality_monitor)
+    print_stats(std::cerr);
 
   // Writing the end of the file.
   av_write_trailer(fmtCtx);
@@ -889,11 +2282,21 @@ FrameWriter::~FrameWriter()
   if (!(outputFmt->flags & AVFMT_NOFILE))
     avio_closep(&fmtCtx->pb);
   avcodec_close(videoStream->codec);
+  av_buffer_unref(&hw_upload_context);
   // Freeing all the allocated memory:
   av_frame_free(&encoder_frame);
-  if (params.enable_audio)
-    avcodec_close(audioStream->codec);
+  for (auto &out : audio_outputs)
+    {
+      avcodec_close(out->codecCtx);
+      swr_free(&out->swr);
+      av_frame_free(&out->frame);
+      av_buffer_pool_uninit(&out->pool);
+    }
+  for (auto &in : audio_inputs)
+    swr_free(&in->swr);
   // TODO: free all HW related stuffs.
   // TODO: free all Filter related stuffs.
+  avfilter_graph_free(&resizeGraph);
+  av_buffer_pool_uninit(&input_pool);
   avformat_free_context(fmtCtx);
 }
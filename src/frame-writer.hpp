@@ -8,8 +8,23 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "quality-control.hpp"
+#include "quality-monitor.hpp"
+#include "mux-thread.hpp"
+#include "av-clock.hpp"
 
-#define AUDIO_RATE 44100
+// The preferred audio sample rate. The capture is done at the
+// sample rate of the audio encoder to avoid resampling.
+#define AUDIO_RATE 48000
+
+// The audio frame size for the codecs accepting any frame size.
+#define AUDIO_FRAME_SIZE 1024
 
 extern "C"
 {
@@ -24,13 +39,46 @@ extern "C"
     #include <libavutil/pixdesc.h>
     #include <libavutil/hwcontext.h>
     #include <libavutil/opt.h>
+    #include <libavutil/buffer.h>
+    #include <libavutil/samplefmt.h>
   
 }
 
+// A rectangle in the coordinates of the captured frame.
+struct FrameRect
+{
+    int x, y, width, height;
+};
+
 enum InputFormat
 {
      INPUT_FORMAT_BGR0,
-     INPUT_FORMAT_RGB0
+     INPUT_FORMAT_RGB0,
+     INPUT_FORMAT_X2RGB10,   // 2:10:10:10 in a 32 bit word
+     INPUT_FORMAT_X2BGR10,
+     INPUT_FORMAT_RGBA16F,   // 4 half floats
+     INPUT_FORMAT_BGRA16F
+};
+
+// An additional encoding of the captured video at a different
+// size and/or bitrate. Each rendition is written to its own file.
+struct FrameWriterRendition
+{
+    int width;
+    int height;
+    int64_t bit_rate; // 0 to keep the encoder options of the main output
+    std::string file;
+
+    // The part of the frame that is encoded (see --tiles). The whole
+    // frame when its width is 0.
+    FrameRect crop = {0, 0, 0, 0};
+};
+
+// An audio source captured by its own PulseReader.
+struct FrameWriterAudioInput
+{
+    std::string name;  // the PulseAudio device, empty for the default
+    float gain;
 };
 
 struct FrameWriterParams
@@ -43,6 +91,13 @@ struct FrameWriterParams
     InputFormat format;
 
     std::string video_filter;
+
+    std::vector<FrameWriterRendition> renditions;
+
+    // If more than 1, the frames are split into that many vertical
+    // tiles, each one encoded in its own thread. The main output only
+    // receives the first one.
+    int tiles;
   
     std::string codec;
     std::map<std::string, std::string> codec_options;
@@ -53,10 +108,49 @@ struct FrameWriterParams
     int64_t audio_sync_offset;
 
     bool enable_audio;
+    std::string audio_codec;
+    std::vector<FrameWriterAudioInput> audio_inputs;
+    bool separate_audio;  // one audio stream per input instead of a mix
     bool enable_ffmpeg_debug_output;
 
     bool trace_video_progress; 
     bool to_yuv;
+
+    // Lower the encoding quality, then the framerate, when the
+    // encoder cannot keep up with the capture.
+    bool adaptive_quality;
+
+    // If not 0, identical consecutive frames are not encoded unless
+    // the previous encoded frame is older than that delay.
+    int64_t static_max_gap_usec;
+
+    // If not 0, the damaged regions of the frames are encoded with a
+    // better quality. This is the quantizer offset in the range (0,1].
+    double roi_strength;
+
+    // Print statistics at the end of the recording.
+    bool print_stats;
+
+    // The frames are not captured in real time (--transcode and
+    // --replay-max-speed), so the renditions are waited for instead
+    // of dropping frames.
+    bool offline;
+
+    // Threads of the video encoders (-1 keeps the default of the
+    // encoder, 0 is one thread per core) and of the filter graph (0
+    // keeps the FFMpeg default).
+    int encoder_threads;
+    int encoder_thread_type;  // FF_THREAD_FRAME, FF_THREAD_SLICE or 0
+    int filter_threads;
+
+    // If not 0, one frame out of that many is decoded back from the
+    // main output to measure its PSNR and SSIM.
+    int quality_monitor_interval;
+
+    // If not 0, the outputs are fragmented (MP4) or split into clusters
+    // (Matroska) and synced to the disk at that interval, so that they
+    // stay playable when the recorder is killed.
+    int64_t flush_interval_usec;
 };
 
 class FrameWriter
@@ -69,13 +163,14 @@ class FrameWriter
   AVStream* videoStream=NULL;
   AVCodecContext* videoCodecCtx=NULL;
   AVFormatContext* fmtCtx=NULL;
+  std::unique_ptr<MuxThread> mux;   // writes the packets into fmtCtx
 
   AVFilterContext * videoFilterSourceCtx = NULL;
   AVFilterContext * videoFilterSinkCtx = NULL;
   AVFilterGraph   * videoFilterGraph = NULL;
 
-  // Properties of the video filter output.
-  struct {
+  // Properties of a video filter output.
+  struct VideoFilterOutput {
     int width;
     int height;
     AVRational sar;  // sample aspect ratio
@@ -83,45 +178,205 @@ class FrameWriter
     AVRational time_base;
     AVRational frame_rate; // can be 1/0 if unknown
   } vfilter ;
+
+  // A rendition is fed by its own sink of the video filter graph
+  // and encoded in its own thread into its own file.
+  struct RenditionOutput {
+    FrameWriterRendition desc;
+    AVFilterContext *sink = NULL;
+    VideoFilterOutput vfilter;
+    AVFormatContext *fmtCtx = NULL;
+    AVStream *stream = NULL;
+    AVCodecContext *codecCtx = NULL;
+    std::unique_ptr<MuxThread> mux;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<AVFrame*> queue;
+    bool done = false;
+    int dropped = 0;
+  };
+  std::vector<std::unique_ptr<RenditionOutput>> renditions;
   
   AVBufferRef *hw_device_context = NULL;
   AVBufferRef *hw_frame_context = NULL;
+
+  // When not NULL, the captured frames are uploaded to the HW device
+  // using that pool before entering the filter graph.
+  AVBufferRef *hw_upload_context = NULL;
+  bool hw_filter_output = false;   // if the user filters output HW frames
+  std::string build_hw_pipeline(AVCodec *codec, const std::string &user_filter);
+  bool init_hw_upload(AVPixelFormat hw_fmt);
   
   AVPixelFormat get_input_format();
+  int get_input_bytes_per_pixel();
+
+  // The formats deeper than 8 bits are converted to planar RGB before
+  // the filter graph. The buffers come from a pool.
+  AVBufferPool *input_pool = NULL;
+  int input_pool_size = 0;
+  AVFrame *convert_input_frame(const uint8_t* pixels, int width, int height,
+                               int stride, bool y_invert);
   void init_hw_accel();
   void init_codecs();
   void init_video_filters(AVCodec *codec);
+  void init_tiles();
+  void get_user_filter_size(int &width, int &height);
   void init_video_stream();
+  AVCodecContext *open_video_encoder(AVFormatContext *fmt, AVCodec *codec,
+                                     const VideoFilterOutput &vf,
+                                     AVBufferRef *hw_frames,
+                                     AVDictionary **options,
+                                     AVStream **stream);
+  static void get_filter_output(AVFilterContext *sink_ctx, VideoFilterOutput &out);
+  void init_renditions(AVCodec *codec);
+  void rendition_loop(RenditionOutput *r);
+  void finish_rendition(RenditionOutput *r);
   
   AVFrame *encoder_frame = NULL;
   AVFrame *hw_frame = NULL;
   
-  SwrContext *swrCtx=NULL;
-  AVStream *audioStream=NULL;
-  AVCodecContext *audioCodecCtx=NULL;
-  void init_swr();
-  void init_audio_stream();
-  void send_audio_pkt(AVFrame *frame);
+  // Interleaved float samples waiting to be mixed, in samples[first,
+  // last). 'pts' is the pts of the first one (-1 until the first
+  // samples). The resampler writes in place (see reserve()) and the
+  // space consumed is only reclaimed when it is needed.
+  struct AudioBuffer {
+    std::vector<float> samples;
+    size_t first = 0, last = 0;
+    int channels = 0;
+    int rate = 0;
+    int64_t pts = -1;
+    int64_t overlap = 0;     // samples dropped by the next commit()
+    int64_t size() const { return (last - first) / channels; }
+    int64_t end() const { return pts < 0 ? -1 : pts + size(); }
+    const float *data() const { return samples.data() + first; }
+    float *reserve(int64_t data_pts, int count);
+    void commit(int count);
+    void consume(int64_t until_pts);
+  };
+
+  // An audio source. Each one has its own clock and is resampled
+  // independently to follow the capture clock.
+  struct AudioInput {
+    FrameWriterAudioInput desc;
+    SwrContext *swr = NULL;
+    AVClock clock;
+    int64_t input_samples = 0;
+    int64_t next_clock_trace = 0;
+    AudioBuffer pending;
+  };
+  std::vector<std::unique_ptr<AudioInput>> audio_inputs;
+
+  // An audio stream, the mix of one or more inputs.
+  struct AudioOutput {
+    AVStream *stream = NULL;
+    AVCodecContext *codecCtx = NULL;
+    SwrContext *swr = NULL;  // from interleaved float to the codec format,
+                             // NULL if the codec takes float samples
+    std::vector<AudioInput*> inputs;
+    int64_t pts = -1;        // next pts to encode, in samples
+    std::vector<float> mix;
+
+    // The encoded frames are reused and their refcounted buffers come
+    // from a pool, so there is no allocation per frame.
+    AVBufferPool *pool = NULL;
+    AVFrame *frame = NULL;
+  };
+  std::vector<std::unique_ptr<AudioOutput>> audio_outputs;
+  std::mutex audio_mutex;
+
+  AVCodecContext *audioCodecCtx = NULL;  // the codec of the first output
+  void init_audio();
+  void init_audio_stream(AudioOutput *out, const std::string &title);
+  void init_audio_input(AudioInput *in);
+  int resample_audio(AudioInput *in, const void *buffer, int64_t capture_usec);
+  void compensate_audio_drift(AudioInput *in, int64_t capture_usec);
+  void mix_audio_output(AudioOutput *out);
+  void encode_audio(AudioOutput *out, const float *samples, int64_t pts);
+  void convert_audio(AudioOutput *out, const float *samples, AVFrame *frame);
+  void send_audio_pkt(AudioOutput *out, AVFrame *frame);
   
-  void finish_frame(AVPacket& pkt, bool isVideo);
+  void finish_frame(AVPacket& pkt, AVStream *stream);
+
+  // Adaptive quality (see --adaptive-quality)
+  std::unique_ptr<QualityController> quality_controller;
+  std::string quality_option;   // a runtime reconfigurable option such as 'crf'
+  double quality_base = 0;      // its initial value
+  int quality_steps = 0;        // number of levels that are changing quality_option
+  int decimation = 1;           // only encode one frame out of 'decimation'
+  int64_t decimation_count = 0;
+  int capture_backlog = 0;
+  int capture_capacity = 1;
+  void init_quality_control();
+  void apply_quality_level(int level);
+
+  // Static frame detection (see --drop-static)
+  uint64_t last_frame_hash = 0;
+  int64_t last_frame_usec = -1;  // pts of the last frame sent to the filters
+  bool force_keyframe = false;
+  int64_t static_frames = 0;
+  bool is_static_frame(const uint8_t* pixels, size_t size, int64_t usec);
+
+  // Quality metrics of the main output (see --quality-monitor)
+  std::unique_ptr<QualityMonitor> quality_monitor;
+
+  int64_t encoded_frames = 0;
+  void print_stats(std::ostream &out);
+
+  // Region of interest encoding (see --roi)
+  std::vector<FrameRect> pending_damage;
+  FrameRect main_area = {0, 0, 0, 0};  // the part of the frame in the main output
+  FrameRect main_tile = {0, 0, 0, 0};  // its crop after the user filters (see --tiles)
+  void attach_regions_of_interest(AVFrame *frame);
+
+  // Capture size changes (e.g. a mode change or a rotation). The frames
+  // are scaled and padded to the size of the encoder by a small filter
+  // graph placed before the main one, rebuilt for each new input size.
+  AVFilterGraph *resizeGraph = NULL;
+  AVFilterContext *resizeSourceCtx = NULL;
+  AVFilterContext *resizeSinkCtx = NULL;
+  int resize_width = 0, resize_height = 0;  // input size of resizeGraph
+  FrameRect resize_area = {0, 0, 0, 0};     // where the input is placed
+  void init_resize_filter(int width, int height);
+  AVFrame *resize_frame(AVFrame *frame);
 
 public: // stsatic utility functions
   
   static void dump_available_encoders(std::ostream &out); 
+
+  // Register the codecs and formats (done once, by the first caller)
+  static void initialize_ffmpeg();
   
 public :
   FrameWriter(const FrameWriterParams& params);
   void add_frame(const uint8_t* pixels, int64_t usec, bool y_invert);
+  /* Same with a frame of any size, which is scaled and padded to the
+   * size of the encoder when it differs from params.width x height */
+  void add_frame(const uint8_t* pixels, int width, int height, int stride,
+                 int64_t usec, bool y_invert);
+
+  /* Declare a damaged region of the next frame passed to add_frame */
+  void add_damage(const FrameRect& rect);
+
+  /* Number of captured frames waiting to be encoded (see add_frame) */
+  void report_capture_backlog(int pending, int capacity);
+
+  /* The CLOCK_MONOTONIC time (usec) of the frame with pts 0 */
+  void set_clock_origin(int64_t usec);
   
-  /* Buffer must have size get_audio_buffer_size() */
-  void add_audio(const void* buffer);
+  /* Buffer must have size get_audio_buffer_size() and contain
+   * interleaved float samples at get_audio_sample_rate() for the
+   * audio input 'index' of params.audio_inputs. The first sample
+   * was captured at 'capture_usec' (CLOCK_MONOTONIC) */
+  void add_audio(int index, const void* buffer, int64_t capture_usec);
   size_t get_audio_buffer_size();
+  int get_audio_sample_rate();
+  int get_audio_channels();
   
   ~FrameWriter();
 };
 
-#include <memory>
-#include <mutex>
 #include <atomic>
 
 extern std::mutex frame_writer_mutex, frame_writer_pending_mutex;
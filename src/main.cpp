@@ -8,7 +8,10 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <future>
 #include <getopt.h>
+#include <poll.h>
 
 #include <limits.h>
 #include <stdio.h>
@@ -21,6 +24,14 @@
 
 #include "frame-writer.hpp"
 #include "pulse.hpp"
+#include "transcode.hpp"
+#include "raw-dump.hpp"
+#include "encoder-cache.hpp"
+#include "reactor.hpp"
+#include "thread-placement.hpp"
+#include "presets.hpp"
+#include "color-test.hpp"
+#include "fake-compositor.hpp"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 
@@ -37,15 +48,6 @@ std::map<std::string,std::string> auto_hwaccel =
    { "vp9_vaapi",   "vaapi" }
    };
 
-// Default filters for some hwaccel methods.
-std::map<std::string,std::string> auto_filter =
-  {
-   { "h264_vaapi" , "hwupload,scale_vaapi=format=nv12" }  ,
-   { "hevc_vaapi" , "hwupload,scale_vaapi=format=nv12" }  ,
-   { "vp8_vaapi"  , "hwupload,scale_vaapi=format=nv12" }  ,
-   { "vp9_vaapi"  , "hwupload,scale_vaapi=format=nv12" }  ,
-  }; 
-
 std::mutex frame_writer_mutex, frame_writer_pending_mutex;
 std::unique_ptr<FrameWriter> frame_writer;
 
@@ -130,7 +132,13 @@ struct wf_buffer
 
   
     timespec presented;
-    uint32_t base_usec;
+    int64_t base_usec;
+
+    std::vector<FrameRect> damage; // only when copy_with_damage is used
+
+    /* The screencopy frame being copied into that buffer, if any */
+    struct zwlr_screencopy_frame_v1 *frame = NULL;
+    bool copy_done = false;
 
     std::atomic<bool> released{true}; // if the buffer can be used to store new pending frames
     std::atomic<bool> available{false}; // if the buffer can be used to feed the encoder
@@ -138,11 +146,45 @@ struct wf_buffer
 
 std::atomic<bool> exit_main_loop{false};
 
+// Eventfds notified when a buffer becomes available to the writer thread
+// and when the writer thread releases it.
+int buffer_available_fd = -1;
+int buffer_released_fd = -1;
+
+static void request_exit()
+{
+    exit_main_loop = true;
+    if (buffer_available_fd >= 0)
+        Reactor::notify(buffer_available_fd);
+}
+
 #define MAX_BUFFERS 16
 wf_buffer buffers[MAX_BUFFERS];
 size_t active_buffer = 0;
 
-bool buffer_copy_done = false;
+// Number of screencopy frames requested in advance (see --inflight-frames)
+int max_inflight_frames = 2;
+
+// Frames published by the Wayland capture (checked by --fake-capture)
+int64_t captured_frames = 0;
+
+// Use copy_with_damage to get the damaged regions (wlr-screencopy v2)
+bool use_damage = false;
+
+// Minimal interval between the encoded frames which only update small
+// regions, such as the motion of the cursor (see --cursor-fps)
+int64_t cursor_min_gap_usec = 0;
+
+/* The largest damaged region of an update considered as a cursor motion */
+#define CURSOR_MAX_SIZE 256
+
+// If not empty, the captured buffers are also dumped into that file
+std::string dump_raw_file;
+
+// The main thread, which receives the frames from the compositor, and
+// the writer thread with everything it creates (see --capture-cpus)
+ThreadPlacement capture_placement;
+ThreadPlacement encoder_placement;
 
 static int backingfile(off_t size)
 {
@@ -193,10 +235,23 @@ static struct wl_buffer *create_shm_buffer(uint32_t fmt,
     return buffer;
 }
 
-static void frame_handle_buffer(void *, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+/* The user data of the frame listener is the wf_buffer receiving the copy */
+static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
     uint32_t width, uint32_t height, uint32_t stride)
 {
-    auto& buffer = buffers[active_buffer];
+    auto& buffer = *(wf_buffer*) data;
+
+    /* The geometry can change during the recording (mode change,
+     * rotation, ...). The writer is not using the buffer, so it can be
+     * replaced. */
+    if (buffer.wl_buffer && (buffer.format != (wl_shm_format)format ||
+        buffer.width != (int)width || buffer.height != (int)height ||
+        buffer.stride != (int)stride))
+    {
+        wl_buffer_destroy(buffer.wl_buffer);
+        munmap(buffer.data, buffer.stride * buffer.height);
+        buffer.wl_buffer = NULL;
+    }
 
     buffer.format = (wl_shm_format)format;
     buffer.width = width;
@@ -213,25 +268,35 @@ static void frame_handle_buffer(void *, struct zwlr_screencopy_frame_v1 *frame,
         exit(EXIT_FAILURE);
     }
 
-    zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
+    buffer.damage.clear();
+    if (use_damage)
+        zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer.wl_buffer);
+    else
+        zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
 }
 
-static void frame_handle_flags(void*, struct zwlr_screencopy_frame_v1 *, uint32_t flags) {
-    buffers[active_buffer].y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+static void frame_handle_flags(void *data, struct zwlr_screencopy_frame_v1 *, uint32_t flags) {
+    ((wf_buffer*) data)->y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
 }
 
-static void frame_handle_ready(void *, struct zwlr_screencopy_frame_v1 *,
+static void frame_handle_ready(void *data, struct zwlr_screencopy_frame_v1 *,
     uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec) {
 
-    auto& buffer = buffers[active_buffer];
-    buffer_copy_done = true;
+    auto& buffer = *(wf_buffer*) data;
+    buffer.copy_done = true;
     buffer.presented.tv_sec = ((1ll * tv_sec_hi) << 32ll) | tv_sec_low;
     buffer.presented.tv_nsec = tv_nsec;
 }
 
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    ((wf_buffer*) data)->damage.push_back(
+        FrameRect{int(x), int(y), int(width), int(height)});
+}
+
 static void frame_handle_failed(void *, struct zwlr_screencopy_frame_v1 *) {
     fprintf(stderr, "failed to copy frame\n");
-    exit_main_loop = true;
+    request_exit();
 }
 
 static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
@@ -239,10 +304,54 @@ static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
     .flags = frame_handle_flags,
     .ready = frame_handle_ready,
     .failed = frame_handle_failed,
+    .damage = frame_handle_damage,
+};
+
+/* The geometry of the buffers, known from the first screencopy frame */
+struct buffer_geometry
+{
+    wl_shm_format format;
+    int width = 0, height = 0, stride = 0;
+    bool done = false;
+    bool failed = false;
+};
+
+static void probe_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *,
+    uint32_t format, uint32_t width, uint32_t height, uint32_t stride)
+{
+    auto geometry = (buffer_geometry*) data;
+    geometry->format = (wl_shm_format)format;
+    geometry->width = width;
+    geometry->height = height;
+    geometry->stride = stride;
+    geometry->done = true;
+}
+
+static void probe_handle_flags(void*, struct zwlr_screencopy_frame_v1 *, uint32_t) { }
+
+static void probe_handle_ready(void*, struct zwlr_screencopy_frame_v1 *,
+    uint32_t, uint32_t, uint32_t) { }
+
+static void probe_handle_damage(void*, struct zwlr_screencopy_frame_v1 *,
+    uint32_t, uint32_t, uint32_t, uint32_t) { }
+
+static void probe_handle_failed(void *data, struct zwlr_screencopy_frame_v1 *) {
+    auto geometry = (buffer_geometry*) data;
+    geometry->failed = true;
+    geometry->done = true;
+}
+
+/* Only the buffer event is used, the probe frame is never copied */
+static const struct zwlr_screencopy_frame_v1_listener probe_listener = {
+    .buffer = probe_handle_buffer,
+    .flags = probe_handle_flags,
+    .ready = probe_handle_ready,
+    .failed = probe_handle_failed,
+    .damage = probe_handle_damage,
 };
 
 static void handle_global(void*, struct wl_registry *registry,
-    uint32_t name, const char *interface, uint32_t) {
+    uint32_t name, const char *interface, uint32_t version) {
 
     if (strcmp(interface, wl_output_interface.name) == 0)
     {
@@ -257,8 +366,9 @@ static void handle_global(void*, struct wl_registry *registry,
     }
     else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0)
     {
+        // version 2 for copy_with_damage, if available
         screencopy_manager = (zwlr_screencopy_manager_v1*) wl_registry_bind(registry, name,
-            &zwlr_screencopy_manager_v1_interface, 1);
+            &zwlr_screencopy_manager_v1_interface, std::min(version, 2u));
     }
     else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0)
     {
@@ -286,6 +396,77 @@ static int next_frame(int frame)
     return (frame + 1) % MAX_BUFFERS;
 }
 
+/* Pass a filled buffer to the writer thread */
+static void publish_buffer(wf_buffer& buffer)
+{
+    buffer.released = false;
+    buffer.available = true;
+    Reactor::notify(buffer_available_fd);
+}
+
+static bool all_buffers_released()
+{
+    for (auto& buffer : buffers)
+    {
+        if (!buffer.released)
+            return false;
+    }
+    return true;
+}
+
+/* Time-to-first-frame reporting. The reference is the static
+ * initialization of the program. */
+static const std::chrono::steady_clock::time_point startup_time =
+    std::chrono::steady_clock::now();
+
+static double ms_since_startup()
+{
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - startup_time).count();
+}
+
+/* A FrameWriter built before the first frame (see do_wayland_capture) */
+struct PrewarmedWriter
+{
+    FrameWriter *writer;
+    wl_shm_format format;
+    int width, height;
+};
+
+static void dump_buffer(RawDumpWriter& dump, const wf_buffer& buffer)
+{
+    RawFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.format = buffer.format;
+    header.width = buffer.width;
+    header.height = buffer.height;
+    header.stride = buffer.stride;
+    header.y_invert = buffer.y_invert;
+    header.presented_usec = timespec_to_usec(buffer.presented);
+    header.size = (uint64_t) buffer.stride * buffer.height;
+
+    if (buffer.damage.size() <= RAW_DUMP_MAX_DAMAGE)
+    {
+        header.damage_count = buffer.damage.size();
+        std::copy(buffer.damage.begin(), buffer.damage.end(), header.damage);
+    } else
+    {
+        /* Too many rectangles, keep their bounding box */
+        int x1 = INT_MAX, y1 = INT_MAX, x2 = 0, y2 = 0;
+        for (const FrameRect& r : buffer.damage)
+        {
+            x1 = std::min(x1, r.x);
+            y1 = std::min(y1, r.y);
+            x2 = std::max(x2, r.x + r.width);
+            y2 = std::max(y2, r.y + r.height);
+        }
+        header.damage_count = 1;
+        header.damage[0] = FrameRect{x1, y1, x2 - x1, y2 - y1};
+    }
+
+    dump.write(header, buffer.data);
+}
+
 struct PixelFormatInfo {
   wl_shm_format wl_fmt ;
   InputFormat   fmt ;
@@ -299,6 +480,15 @@ PixelFormatInfo supported_pixel_formats [] =
    { WL_SHM_FORMAT_XRGB8888, INPUT_FORMAT_BGR0, false, "xrgb8888" },
    { WL_SHM_FORMAT_ABGR8888, INPUT_FORMAT_RGB0, true,  "abgr8888" },
    { WL_SHM_FORMAT_XBGR8888, INPUT_FORMAT_RGB0, false, "xbgr8888" },
+   // Deeper formats offered by HDR capable compositors
+   { WL_SHM_FORMAT_ARGB2101010, INPUT_FORMAT_X2RGB10, true,  "argb2101010" },
+   { WL_SHM_FORMAT_XRGB2101010, INPUT_FORMAT_X2RGB10, false, "xrgb2101010" },
+   { WL_SHM_FORMAT_ABGR2101010, INPUT_FORMAT_X2BGR10, true,  "abgr2101010" },
+   { WL_SHM_FORMAT_XBGR2101010, INPUT_FORMAT_X2BGR10, false, "xbgr2101010" },
+   { WL_SHM_FORMAT_ABGR16161616F, INPUT_FORMAT_RGBA16F, true,  "abgr16161616f" },
+   { WL_SHM_FORMAT_XBGR16161616F, INPUT_FORMAT_RGBA16F, false, "xbgr16161616f" },
+   { WL_SHM_FORMAT_ARGB16161616F, INPUT_FORMAT_BGRA16F, true,  "argb16161616f" },
+   { WL_SHM_FORMAT_XRGB16161616F, INPUT_FORMAT_BGRA16F, false, "xrgb16161616f" },
   };
 
 #if 0
@@ -322,8 +512,10 @@ static InputFormat get_input_format(wl_shm_format wl_fmt)
     }
   }
 
-  fprintf(stderr, "Unsupported buffer format %d, exiting.", wl_fmt);
-  std::exit(0);
+  // Besides the first two, the wl_shm formats are DRM fourcc codes.
+  fprintf(stderr, "Unsupported buffer format %d (%c%c%c%c), exiting.\n", wl_fmt,
+          wl_fmt & 0xff, (wl_fmt >> 8) & 0xff, (wl_fmt >> 16) & 0xff, (wl_fmt >> 24) & 0xff);
+  std::exit(EXIT_FAILURE);
 
 #if 0
     if (buffer.format == WL_SHM_FORMAT_ARGB8888)
@@ -341,8 +533,33 @@ static InputFormat get_input_format(wl_shm_format wl_fmt)
 #endif
 }
 
-static void write_loop(FrameWriterParams params, PulseReaderParams pulseParams)
+/* Tell if the damage of a buffer is limited to a few small regions,
+ * typically the previous and the new position of the cursor */
+static bool is_small_update(const wf_buffer& buffer)
 {
+    if (buffer.damage.empty() || buffer.damage.size() > 4)
+        return false;
+
+    for (const FrameRect& r : buffer.damage)
+    {
+        if (r.width > CURSOR_MAX_SIZE || r.height > CURSOR_MAX_SIZE)
+            return false;
+    }
+    return true;
+}
+
+static void release_buffer(wf_buffer& buffer)
+{
+    buffer.available = false;
+    buffer.released = true;
+    Reactor::notify(buffer_released_fd);
+}
+
+static void write_loop(FrameWriterParams params, PulseReaderParams pulseParams,
+    std::shared_future<PrewarmedWriter> prewarmed = std::shared_future<PrewarmedWriter>())
+{
+    apply_thread_placement(encoder_placement, "wf-writer");
+
     /* Ignore SIGINT, main loop is responsible for the exit_main_loop signal */
     sigset_t sigset;
     sigemptyset(&sigset);
@@ -350,52 +567,174 @@ static void write_loop(FrameWriterParams params, PulseReaderParams pulseParams)
     pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
     int last_encoded_frame = 0;
-    std::unique_ptr<PulseReader> pr;
+    std::vector<std::unique_ptr<PulseReader>> readers;
+    std::unique_ptr<RawDumpWriter> dump;
+    if (!dump_raw_file.empty())
+        dump = std::unique_ptr<RawDumpWriter> (new RawDumpWriter(dump_raw_file));
+
+    /* A small update postponed by --cursor-fps. It is dropped if another
+     * frame comes before the deadline and encoded otherwise. Its damage
+     * is already given to the writer. */
+    wf_buffer *deferred = NULL;
+    int64_t deferred_deadline = 0;
+    int64_t last_encoded_usec = 0;
 
     while(!exit_main_loop)
     {
         // wait for frame to become available
-        while(buffers[last_encoded_frame].available != true) {
-            std::this_thread::sleep_for(std::chrono::microseconds(1000));
+        bool timed_out = false;
+        while(buffers[last_encoded_frame].available != true && !exit_main_loop &&
+            !timed_out)
+        {
+            int timeout_ms = -1;
+            if (deferred)
+            {
+                timeout_ms = std::max<int64_t>(0,
+                    (deferred_deadline - AVClock::now_usec() + 999) / 1000);
+            }
+            pollfd pfd = { buffer_available_fd, POLLIN, 0 };
+            timed_out = poll(&pfd, 1, timeout_ms) == 0;
+            Reactor::drain(buffer_available_fd);
+        }
+
+        if (!buffers[last_encoded_frame].available)
+        {
+            /* Nothing came after the deferred update (or the capture is
+             * stopping): the last position of the cursor is encoded */
+            if (!deferred)
+                break;
+            std::lock_guard<std::mutex> lock(frame_writer_mutex);
+            frame_writer->add_frame((unsigned char*)deferred->data, deferred->width,
+                deferred->height, deferred->stride, deferred->base_usec,
+                deferred->y_invert);
+            last_encoded_usec = deferred->base_usec;
+            release_buffer(*deferred);
+            deferred = NULL;
+            continue;
         }
         auto& buffer = buffers[last_encoded_frame];
 
+        if (dump)
+            dump_buffer(*dump, buffer);
+
         frame_writer_pending_mutex.lock();
         frame_writer_mutex.lock();
         frame_writer_pending_mutex.unlock();
 
+        bool first_frame = !frame_writer;
         if (!frame_writer)
         {
+            /* Use the writer prepared during the Wayland setup, unless the
+             * geometry has changed since the probe */
+            if (prewarmed.valid())
+            {
+                PrewarmedWriter pw = prewarmed.get();
+                prewarmed = std::shared_future<PrewarmedWriter>();
+                if (pw.format == buffer.format && pw.width == buffer.width &&
+                    pw.height == buffer.height)
+                {
+                    frame_writer = std::unique_ptr<FrameWriter> (pw.writer);
+                } else
+                {
+                    std::cerr << "The buffer geometry has changed since the "
+                        "probe, creating a new encoder" << std::endl;
+                    delete pw.writer;
+                }
+            }
+
             /* This is the first time buffer attributes are available */
-            params.format = get_input_format(buffer.format);
-            params.width = buffer.width;
-            params.height = buffer.height;
-            frame_writer = std::unique_ptr<FrameWriter> (new FrameWriter(params));
+            if (!frame_writer)
+            {
+                params.format = get_input_format(buffer.format);
+                params.width = buffer.width;
+                params.height = buffer.height;
+                frame_writer = std::unique_ptr<FrameWriter> (new FrameWriter(params));
+            }
+
+            /* The presentation times are given in CLOCK_MONOTONIC */
+            frame_writer->set_clock_origin(timespec_to_usec(buffer.presented)
+                - buffer.base_usec);
 
             if (params.enable_audio)
             {
                 pulseParams.audio_frame_size = frame_writer->get_audio_buffer_size();
-                pr = std::unique_ptr<PulseReader> (new PulseReader(pulseParams));
-                pr->start();
+                pulseParams.sample_rate = frame_writer->get_audio_sample_rate();
+                pulseParams.channels = frame_writer->get_audio_channels();
+                pulseParams.trace = params.trace_video_progress;
+                for (size_t i = 0; i < params.audio_inputs.size(); i++)
+                {
+                    pulseParams.audio_source = params.audio_inputs[i].name;
+                    pulseParams.audio_index = i;
+                    readers.emplace_back(new PulseReader(pulseParams));
+                }
+                for (auto& pr : readers)
+                    pr->start();
             }
         }
 
-        frame_writer->add_frame((unsigned char*)buffer.data, buffer.base_usec,
-            buffer.y_invert);
+        int pending = 0;
+        for (auto& b : buffers)
+            pending += b.available ? 1 : 0;
+        frame_writer->report_capture_backlog(pending, MAX_BUFFERS);
+
+        for (const FrameRect& r : buffer.damage)
+        {
+            // The damage is given in buffer coordinates.
+            FrameRect rect = r;
+            if (buffer.y_invert)
+                rect.y = buffer.height - r.y - r.height;
+            frame_writer->add_damage(rect);
+        }
+
+        /* A newer frame replaces the deferred one */
+        if (deferred)
+            release_buffer(*deferred);
+        deferred = NULL;
+
+        if (cursor_min_gap_usec > 0 && !first_frame && is_small_update(buffer) &&
+            buffer.base_usec - last_encoded_usec < cursor_min_gap_usec)
+        {
+            if (params.trace_video_progress)
+                std::cerr << "TRACE: deferred small update\n";
+            deferred = &buffer;
+            deferred_deadline = AVClock::now_usec() + cursor_min_gap_usec -
+                (buffer.base_usec - last_encoded_usec);
+            buffer.available = false;
+            frame_writer_mutex.unlock();
+            last_encoded_frame = next_frame(last_encoded_frame);
+            continue;
+        }
+
+        frame_writer->add_frame((unsigned char*)buffer.data, buffer.width,
+            buffer.height, buffer.stride, buffer.base_usec, buffer.y_invert);
+        last_encoded_usec = buffer.base_usec;
 
         frame_writer_mutex.unlock();
 
-        buffer.available = false;
-        buffer.released = true;
+        if (first_frame)
+        {
+            std::cout << "First frame encoded after " << std::fixed
+                << std::setprecision(1) << ms_since_startup() << " ms"
+                << std::defaultfloat << std::endl;
+        }
+
+        release_buffer(buffer);
 
         last_encoded_frame = next_frame(last_encoded_frame);
     }
 
+    if (deferred)
+        release_buffer(*deferred);
+
     std::lock_guard<std::mutex> lock(frame_writer_mutex);
-    /* Free the PulseReader connection first. This way it'd flush any remaining
+    /* Free the PulseReader connections first. This way they'd flush any remaining
      * frames to the FrameWriter */
-    pr = nullptr;
+    readers.clear();
     frame_writer = nullptr;
+
+    /* Stopped before the first frame */
+    if (prewarmed.valid())
+        delete prewarmed.get().writer;
 }
 
 void handle_sigint(int)
@@ -571,6 +910,33 @@ static const int ARG_SET_TEST_FORMAT = LONGARG;
 static const int ARG_TEST_COLORS    = LONGARG; 
 static const int ARG_FFMPEG_DEBUG   = LONGARG ;
 static const int ARG_VAAPI          = LONGARG ;
+static const int ARG_RENDITION      = 'R';
+static const int ARG_ADAPTIVE_QUALITY = LONGARG;
+static const int ARG_DROP_STATIC    = LONGARG;
+static const int ARG_ROI            = LONGARG;
+static const int ARG_AUDIO_LATENCY  = LONGARG;
+static const int ARG_STATS          = LONGARG;
+static const int ARG_SEPARATE_AUDIO = LONGARG;
+static const int ARG_LOSSLESS       = LONGARG;
+static const int ARG_TRANSCODE      = LONGARG;
+static const int ARG_DUMP_RAW       = LONGARG;
+static const int ARG_REPLAY         = LONGARG;
+static const int ARG_REPLAY_MAX_SPEED = LONGARG;
+static const int ARG_LIST_ENCODERS  = LONGARG;
+static const int ARG_INFLIGHT_FRAMES = LONGARG;
+static const int ARG_FAKE_CAPTURE   = LONGARG;
+static const int ARG_CURSOR_FPS     = LONGARG;
+static const int ARG_TILES          = LONGARG;
+static const int ARG_ENCODER_THREADS = LONGARG;
+static const int ARG_FILTER_THREADS = LONGARG;
+static const int ARG_CAPTURE_CPUS   = LONGARG;
+static const int ARG_ENCODER_CPUS   = LONGARG;
+static const int ARG_CAPTURE_PRIORITY = LONGARG;
+static const int ARG_PRESET         = LONGARG;
+static const int ARG_AUTOTUNE       = LONGARG;
+static const int ARG_QUALITY_MONITOR = LONGARG;
+static const int ARG_TEST_COLOR_MATRIX = LONGARG;
+static const int ARG_FLUSH_INTERVAL = LONGARG;
       
 
 static struct option options[] =
@@ -589,16 +955,47 @@ static struct option options[] =
    { "hw-accel",        required_argument, NULL, ARG_HW_ACCEL },
    { "ffmpeg-debug",    no_argument,       NULL, ARG_FFMPEG_DEBUG },
    { "audio",           optional_argument, NULL, ARG_AUDIO },
+   { "audio-latency",   required_argument, NULL, ARG_AUDIO_LATENCY },
+   { "separate-audio",  no_argument,       NULL, ARG_SEPARATE_AUDIO },
    { "yuv420p",         no_argument,       NULL, ARG_YUV420P},   
    { "video-filter",    required_argument, NULL, ARG_VIDEO_FILTER},
    { "video-trace",     no_argument,       NULL, ARG_VIDEO_TRACE },   
    { "vaapi",           no_argument,       NULL, ARG_VAAPI },   
    { "set-test-format", required_argument, NULL, ARG_SET_TEST_FORMAT },   
    { "test-colors",     no_argument,       NULL, ARG_TEST_COLORS },   
+   { "test-color-matrix", required_argument, NULL, ARG_TEST_COLOR_MATRIX },
+   { "rendition",       required_argument, NULL, ARG_RENDITION },
+   { "adaptive-quality", no_argument,      NULL, ARG_ADAPTIVE_QUALITY },
+   { "drop-static",     optional_argument, NULL, ARG_DROP_STATIC },
+   { "roi",             optional_argument, NULL, ARG_ROI },
+   { "stats",           no_argument,       NULL, ARG_STATS },
+   { "lossless",        no_argument,       NULL, ARG_LOSSLESS },
+   { "transcode",       required_argument, NULL, ARG_TRANSCODE },
+   { "dump-raw",        required_argument, NULL, ARG_DUMP_RAW },
+   { "replay",          required_argument, NULL, ARG_REPLAY },
+   { "replay-max-speed", no_argument,      NULL, ARG_REPLAY_MAX_SPEED },
+   { "list-encoders",   no_argument,       NULL, ARG_LIST_ENCODERS },
+   { "inflight-frames", required_argument, NULL, ARG_INFLIGHT_FRAMES },
+   { "fake-capture",    required_argument, NULL, ARG_FAKE_CAPTURE },
+   { "cursor-fps",      required_argument, NULL, ARG_CURSOR_FPS },
+   { "tiles",           required_argument, NULL, ARG_TILES },
+   { "encoder-threads", required_argument, NULL, ARG_ENCODER_THREADS },
+   { "filter-threads",  required_argument, NULL, ARG_FILTER_THREADS },
+   { "capture-cpus",    required_argument, NULL, ARG_CAPTURE_CPUS },
+   { "encoder-cpus",    required_argument, NULL, ARG_ENCODER_CPUS },
+   { "capture-priority", required_argument, NULL, ARG_CAPTURE_PRIORITY },
+   { "preset",          required_argument, NULL, ARG_PRESET },
+   { "autotune",        required_argument, NULL, ARG_AUTOTUNE },
+   { "quality-monitor", required_argument, NULL, ARG_QUALITY_MONITOR },
+   { "flush-interval",  required_argument, NULL, ARG_FLUSH_INTERVAL },
    { 0,                 0,                 NULL,  0  }
   };
 
 static const char * default_filename = "recording.mp4" ;
+static const char * default_lossless_filename = "recording-lossless.mkv" ;
+static const char * default_audio_codec = "aac" ;
+static const int default_static_max_gap_ms = 2000 ;
+static const double default_roi_strength = 0.3 ;
 
 static bool is_alphanum(int v) {
   return
@@ -721,12 +1118,24 @@ static void show_usage(std::ostream &out, const char *app)
       text << "Show the mouse cursor in the recording. This is the default.";
       break;
     case ARG_AUDIO:
-      argname = "DEVICE";
+      argname = "DEVICE[:GAIN]";
       text << "Enable audio recordig using the specified Pulseaudio" << std::endl << indent ;      
-      text << "device number or identifier";
+      text << "device number or identifier. Can be repeated to" << std::endl << indent ;
+      text << "record several devices which are mixed with the" << std::endl << indent ;
+      text << "given GAIN (1.0 by default).";
+      break;
+    case ARG_SEPARATE_AUDIO:
+      text << "Write each audio device in its own audio stream" << std::endl << indent ;
+      text << "instead of mixing them.";
+      break;
+    case ARG_AUDIO_LATENCY:
+      argname = "MSEC";
+      text << "Request a capture latency from PulseAudio." << std::endl << indent;
+      text << "The default is chosen by the server.";
       break;
     case ARG_YUV420P:
       text << "Use the encoding pixel format YUV210P if possible" << std::endl << indent; 
+      text << "(YUV420P10 for the 10 and 16 bit captures)." << std::endl << indent;
       text << "That option is mostly intended for software encoders."<< std::endl << indent ;
       text << "For hardware encorders, the pixel format is usually set"<< std::endl << indent;
       text << "using a filter";      
@@ -749,6 +1158,134 @@ static void show_usage(std::ostream &out, const char *app)
     case ARG_TEST_COLORS:
       text << "Generate a color test pattern.";
       break;
+    case ARG_TEST_COLOR_MATRIX:
+      argname = "ENC,..[:FMT,..[:RANGE,..[:SPACE,..]]]";
+      text << "Encode the color test pattern with each combination" << std::endl << indent;
+      text << "of encoder, pixel format, color range and color" << std::endl << indent;
+      text << "space, decode it and print which ones are accurate.";
+      break;
+    case ARG_RENDITION:
+      argname = "WxH[:BITRATE]:FILE";
+      text << "Also encode the video scaled to WxH into FILE." << std::endl << indent;
+      text << "BITRATE is an optional encoder bitrate such as 2M." << std::endl << indent;
+      text << "Can be repeated to produce several renditions.";
+      break;
+    case ARG_TILES:
+      argname = "N";
+      text << "Split the video into N vertical tiles encoded in" << std::endl << indent;
+      text << "parallel. The tile I > 0 goes to FILE.tileI.EXT.";
+      break;
+    case ARG_ENCODER_THREADS:
+      argname = "N[:frame|slice]";
+      text << "Number of threads of each video encoder and the" << std::endl << indent;
+      text << "kind of threading. 0 is one thread per core.";
+      break;
+    case ARG_FILTER_THREADS:
+      argname = "N";
+      text << "Number of threads of the video filters.";
+      break;
+    case ARG_CAPTURE_CPUS:
+      argname = "LIST";
+      text << "Pin the capture thread on the CPUs in LIST (e.g. 0-1,4).";
+      break;
+    case ARG_ENCODER_CPUS:
+      argname = "LIST";
+      text << "Pin the encoder, filter and audio threads on the CPUs" << std::endl << indent;
+      text << "in LIST.";
+      break;
+    case ARG_CAPTURE_PRIORITY:
+      argname = "N";
+      text << "Run the capture thread with the real-time priority N" << std::endl << indent;
+      text << "(SCHED_FIFO, 1 to 99).";
+      break;
+    case ARG_PRESET:
+      argname = "NAME";
+      text << "Use the encoder settings saved as NAME by --autotune." << std::endl << indent;
+      text << "The options given after it can change them.";
+      break;
+    case ARG_AUTOTUNE:
+      argname = "NAME";
+      text << "Do not capture. Benchmark several encoders on the" << std::endl << indent;
+      text << "workload of --replay or --fake-capture and save the" << std::endl << indent;
+      text << "fastest one that keeps up as the preset NAME.";
+      break;
+    case ARG_ADAPTIVE_QUALITY:
+      text << "Lower the quality, then the framerate, when the" << std::endl << indent;
+      text << "encoder cannot keep up with the capture." << std::endl << indent;
+      text << "Decisions are logged by --" << long_name(ARG_VIDEO_TRACE);
+      break;
+    case ARG_DROP_STATIC:
+      argname = "MSEC";
+      text << "Do not encode frames identical to the previous one" << std::endl << indent;
+      text << "(variable frame rate). A keyframe is still produced" << std::endl << indent;
+      text << "after MSEC milliseconds without change. The default" << std::endl << indent;
+      text << "is " << default_static_max_gap_ms << " ms.";
+      break;
+    case ARG_ROI:
+      argname = "STRENGTH";
+      text << "Encode the damaged regions of the screen with a better" << std::endl << indent;
+      text << "quality (for encoders supporting regions of interest" << std::endl << indent;
+      text << "such as libx264 and libx265). STRENGTH is a quantizer" << std::endl << indent;
+      text << "offset between 0 and 1. The default is " << default_roi_strength << ".";
+      break;
+    case ARG_STATS:
+      text << "Print statistics at the end of the recording" << std::endl << indent;
+      text << "(including the residual A/V skew).";
+      break;
+    case ARG_QUALITY_MONITOR:
+      argname = "N";
+      text << "Decode the video while recording and print the PSNR" << std::endl << indent;
+      text << "and SSIM of one frame out of N at the end.";
+      break;
+    case ARG_FLUSH_INTERVAL:
+      argname = "MSEC";
+      text << "Write the MP4 and Matroska files so that at most" << std::endl << indent;
+      text << "about twice MSEC are lost when the recorder is killed." << std::endl << indent;
+      text << "The default is 2000. 0 writes them at the end only.";
+      break;
+    case ARG_LOSSLESS:
+      text << "Capture with a cheap lossless codec (FFV1 and PCM)" << std::endl << indent;
+      text << "for a later --transcode. The filters and the codec" << std::endl << indent;
+      text << "options are ignored. The default output file is" << std::endl << indent;
+      text << default_lossless_filename ;
+      break;
+    case ARG_TRANSCODE:
+      argname = "INPUT";
+      text << "Do not capture. Encode INPUT (e.g. a --lossless" << std::endl << indent;
+      text << "capture) into the output file with the given codec," << std::endl << indent;
+      text << "filters and renditions as fast as possible.";
+      break;
+    case ARG_DUMP_RAW:
+      argname = "FILE";
+      text << "Also dump the captured buffers into FILE for --replay." << std::endl << indent;
+      text << "Warning: this is about 500MB per second in 1080p60.";
+      break;
+    case ARG_REPLAY:
+      argname = "FILE";
+      text << "Do not capture. Encode the buffers dumped in FILE by" << std::endl << indent;
+      text << "--dump-raw with their original timing.";
+      break;
+    case ARG_REPLAY_MAX_SPEED:
+      text << "Replay the buffers as fast as they can be encoded.";
+      break;
+    case ARG_LIST_ENCODERS:
+      text << "List the audio and video encoders with their formats.";
+      break;
+    case ARG_INFLIGHT_FRAMES:
+      argname = "N";
+      text << "Number of frames requested in advance to the compositor" << std::endl << indent;
+      text << "(default 2, at most " << MAX_BUFFERS/2 << ").";
+      break;
+    case ARG_FAKE_CAPTURE:
+      argname = "WxH@FPS[:FORMAT][:SECONDS]";
+      text << "Capture a fake compositor showing a moving pattern" << std::endl << indent;
+      text << "at FPS (default format xrgb8888, for 10 seconds).";
+      break;
+    case ARG_CURSOR_FPS:
+      argname = "FPS";
+      text << "Encode at most FPS frames per second when only small" << std::endl << indent;
+      text << "regions change, e.g. when only the cursor moves.";
+      break;
     default:
       text << "TO BE DOCUMENTED" ;
       break;
@@ -800,6 +1337,61 @@ std::string time_format(const char *fmt)
   return buffer;
 }
 
+// Parse the argument of --rendition in the form WxH[:BITRATE]:FILE
+static bool parse_rendition(const std::string &arg, FrameWriterRendition &r)
+{
+  int n = 0 ;
+  if (sscanf(arg.c_str(), "%dx%d:%n", &r.width, &r.height, &n) != 2 || n==0)
+    return false;
+  if (r.width <= 0 || r.height <= 0)
+    return false;
+
+  std::string rest = arg.substr(n);
+  r.bit_rate = 0;
+  size_t pos = rest.find(':');
+  if (pos != std::string::npos && pos > 0) {
+    // The bitrate is a number with an optional 'k' or 'M' suffix.
+    char *end = NULL;
+    double value = strtod(rest.c_str(), &end);
+    size_t len = end - rest.c_str();
+    if (len < pos && (rest[len]=='k' || rest[len]=='K')) {
+      value *= 1000 ;
+      len++;
+    } else if (len < pos && rest[len]=='M') {
+      value *= 1000000 ;
+      len++;
+    }
+    if (len == pos && value > 0) {
+      r.bit_rate = int64_t(value);
+      rest = rest.substr(pos+1);
+    }
+  }
+  r.file = rest;
+  return !r.file.empty();
+}
+
+// Parse the argument of --audio in the form [DEVICE][:GAIN]
+static bool parse_audio_input(const char *arg, FrameWriterAudioInput &in)
+{
+  in.name = arg ? arg : "";
+  in.gain = 1.0f;
+  size_t pos = in.name.rfind(':');
+  if (pos == std::string::npos)
+    return true;
+
+  // Only a number after the last ':' is a gain.
+  const char *gain = in.name.c_str() + pos + 1;
+  char *end = NULL;
+  double value = strtod(gain, &end);
+  if (end == gain || *end != 0)
+    return true;
+  if (value < 0)
+    return false;
+  in.gain = value;
+  in.name.erase(pos);
+  return true;
+}
+
 constexpr const char* default_cmdline_output = "interactive";
 
 //
@@ -844,6 +1436,20 @@ public:
     c = (col>>8) ;
     d = (col>>0) ;
   }
+
+  // Same with 2:10:10:10 components. The 8 bit values are expanded
+  // to 10 bits by replicating the high bits.
+  static color_t pack10(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    auto to10 = [] (uint32_t v) { return (v<<2) | (v>>6) ; } ;
+    return  ((a>>6)<<30) | (to10(b)<<20) | (to10(c)<<10) | (to10(d)<<0) ;
+  }
+
+  static void unpack10(color_t col, uint8_t &a, uint8_t &b, uint8_t &c, uint8_t &d) {
+    a = ((col>>30) & 0x3) * 0x55 ;
+    b = (col>>22) ;
+    c = (col>>12) ;
+    d = (col>>2) ;
+  }
   
   color_t gray(uint8_t v) {
     return rgb(v,v,v,default_alpha) ;
@@ -863,6 +1469,10 @@ public:
     case WL_SHM_FORMAT_XRGB8888: return pack(a,r,g,b) ; 
     case WL_SHM_FORMAT_ABGR8888: return pack(a,b,g,r) ; 
     case WL_SHM_FORMAT_XBGR8888: return pack(a,b,g,r) ; 
+    case WL_SHM_FORMAT_ARGB2101010: return pack10(a,r,g,b) ;
+    case WL_SHM_FORMAT_XRGB2101010: return pack10(a,r,g,b) ;
+    case WL_SHM_FORMAT_ABGR2101010: return pack10(a,b,g,r) ;
+    case WL_SHM_FORMAT_XBGR2101010: return pack10(a,b,g,r) ;
     default:
         return 0x66666666u ; // Hoops  
     }
@@ -875,6 +1485,10 @@ public:
     case WL_SHM_FORMAT_XRGB8888: unpack(col, a,r,g,b) ; break;
     case WL_SHM_FORMAT_ABGR8888: unpack(col, a,b,g,r) ; break;
     case WL_SHM_FORMAT_XBGR8888: unpack(col, a,b,g,r) ; break; 
+    case WL_SHM_FORMAT_ARGB2101010: unpack10(col, a,r,g,b) ; break;
+    case WL_SHM_FORMAT_XRGB2101010: unpack10(col, a,r,g,b) ; break;
+    case WL_SHM_FORMAT_ABGR2101010: unpack10(col, a,b,g,r) ; break;
+    case WL_SHM_FORMAT_XBGR2101010: unpack10(col, a,b,g,r) ; break;
     default:
       r = g = b = a = 0x66 ;
     }
@@ -953,7 +1567,8 @@ draw_color_scale(std::string name,
                  Image &img, int x0, int y0, int w, int h,
                  int step,
                  rgb c0,
-                 rgb c1)
+                 rgb c1,
+                 std::vector<ColorBand> *bands)
 
 {
   // Boxes width and height
@@ -970,6 +1585,7 @@ draw_color_scale(std::string name,
 
   if (out) fprintf(out,"#%s\n" , name.c_str() ) ;
   if (out) fprintf(out,"%d\n" , step);
+  if (bands) bands->push_back(ColorBand{name, {}}) ;
   for (int i=0;i<step;i++) {
     int x = x0+i*bw ;
     int y = y0 ;
@@ -977,10 +1593,72 @@ draw_color_scale(std::string name,
     int g = ( ( (step-1-i)*G0 + i*G1 ) / (step-1) ) >> 8 ;
     int b = ( ( (step-1-i)*B0 + i*B1 ) / (step-1) ) >> 8 ;
     if (out) fprintf(out,"%d %d = %d %d %d\n",x+bw/2,y+bh/2,r,g,b) ;
+    if (bands) bands->back().boxes.push_back(ColorBox{x, y, bw, bh, r, g, b}) ;
     img.fillbox(x,y, bw, bh, img.rgb(r,g,b) ) ;
   }
 }
 
+//
+// The color test pattern: scales of the primary and secondary colors
+// over the full range and near the two extremes, then a dithered gray
+// ramp. The bands of uniform boxes are described in the file 'f' and in
+// 'bands' when they are not NULL.
+//
+static void draw_color_pattern(Image &img, FILE *f, std::vector<ColorBand> *bands)
+{
+  int w = img.width;
+  int h = img.height;
+
+  img.fill( img.gray(128) ) ;
+
+  int dy = h/32 ;
+  int y  = dy ;
+
+  int step = 32;
+
+  int v0,v1 ;
+
+  v0=0 ; v1=255; 
+  draw_color_scale("full-w" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v1}, bands ); y += dy;
+  draw_color_scale("full-r" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v0}, bands ); y += dy; 
+  draw_color_scale("full-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v0}, bands ); y += dy;
+  draw_color_scale("full-b" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v0,v1}, bands ); y += dy;
+  draw_color_scale("full-y" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v0}, bands ); y += dy;
+  draw_color_scale("full-m" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v1}, bands ); y += dy;
+  draw_color_scale("full-c" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v1}, bands ); y += dy;
+  y += dy ;    
+
+  v0 = 0 ; v1 = 31 ; 
+  draw_color_scale("low-w" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v1}, bands ); y += dy;
+  draw_color_scale("low-r" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v0}, bands ); y += dy;
+  draw_color_scale("low-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v0}, bands ); y += dy;
+  draw_color_scale("low-b" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v0,v1}, bands ); y += dy;
+  draw_color_scale("low-y" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v0}, bands ); y += dy;
+  draw_color_scale("low-m" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v1}, bands ); y += dy;
+  draw_color_scale("low-c" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v1}, bands ); y += dy;
+  y += dy ;
+
+  v0=255; v1=255-31 ;
+  draw_color_scale("high-w" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v1}, bands ); y += dy;
+  draw_color_scale("high-r" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v0}, bands ); y += dy;
+  draw_color_scale("high-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v0}, bands ); y += dy;
+  draw_color_scale("high-b" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v0,v1}, bands ); y += dy;
+  draw_color_scale("high-y" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v0}, bands ); y += dy;
+  draw_color_scale("high-m" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v1}, bands ); y += dy;
+  draw_color_scale("high-c" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v1}, bands ); y += dy;
+
+  y += dy ;
+  while (y<h) {
+    for (int x=0;x<w;x++) {
+      int v0 = (x*255)/(w-1) ;
+      int v1 = std::min(std::max(0,v0 + ((y-x)&8) - 4),255); 
+      Image::color_t c0 = img.rgb(v1,v1,v1) ;
+      img.set(x,y,c0) ;
+    }      
+    y++ ;
+  }
+}
+
 //
 // Fake input: generate a color test pattern
 //
@@ -991,6 +1669,11 @@ int do_test_colors(FrameWriterParams params, wl_shm_format wl_fmt)
   int w = 512;
   int h = 512;    
   params.format = get_input_format(wl_fmt);
+  if (params.format == INPUT_FORMAT_RGBA16F || params.format == INPUT_FORMAT_BGRA16F) {
+    // The test image is made of 32 bit pixels
+    fprintf(stderr, "The color test does not support half float formats\n");
+    return EXIT_FAILURE;
+  }
   params.width  = w;
   params.height = h;
   params.enable_audio = false ;
@@ -1001,15 +1684,6 @@ int do_test_colors(FrameWriterParams params, wl_shm_format wl_fmt)
     Image img( w, h, wl_fmt) ;
     int64_t usec = 0 ;
     
-    img.fill( img.gray(128) ) ;
-
-    int dy = h/32 ;
-    int y  = dy ;
-
-    int step = 32;
-
-    int v0,v1 ;
-
     const char *info = getenv("COLOR_TEST_INFO");
     const char *ref = getenv("COLOR_TEST_PPM");
 
@@ -1027,45 +1701,7 @@ int do_test_colors(FrameWriterParams params, wl_shm_format wl_fmt)
     if (f) fprintf(f,"%s\n",params.file.c_str());
     if (f) fprintf(f,"%d %d\n",w,h);
           
-    v0=0 ; v1=255; 
-    draw_color_scale("full-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v1} ); y += dy;
-    draw_color_scale("full-r" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v0} ); y += dy; 
-    draw_color_scale("full-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v0} ); y += dy;
-    draw_color_scale("full-b" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v0,v1} ); y += dy;
-    draw_color_scale("full-y" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v0} ); y += dy;
-    draw_color_scale("full-m" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v1} ); y += dy;
-    draw_color_scale("full-c" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v1} ); y += dy;
-    y += dy ;    
-
-    v0 = 0 ; v1 = 31 ; 
-    draw_color_scale("low-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v1} ); y += dy;
-    draw_color_scale("low-r" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v0} ); y += dy;
-    draw_color_scale("low-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v0} ); y += dy;
-    draw_color_scale("low-b" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v0,v1} ); y += dy;
-    draw_color_scale("low-y" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v0} ); y += dy;
-    draw_color_scale("low-m" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v1} ); y += dy;
-    draw_color_scale("low-c" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v1} ); y += dy;
-    y += dy ;
-
-    v0=255; v1=255-31 ;
-    draw_color_scale("high-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v1} ); y += dy;
-    draw_color_scale("high-r" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v0} ); y += dy;
-    draw_color_scale("high-g" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v0} ); y += dy;
-    draw_color_scale("high-b" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v0,v1} ); y += dy;
-    draw_color_scale("high-y" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v1,v0} ); y += dy;
-    draw_color_scale("high-m" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v1,v0,v1} ); y += dy;
-    draw_color_scale("high-c" ,f, img, 0, y, w, dy, step, rgb{v0,v0,v0} , rgb{v0,v1,v1} ); y += dy;
-
-    y += dy ;
-    while (y<h) {
-      for (int x=0;x<w;x++) {
-        int v0 = (x*255)/(w-1) ;
-        int v1 = std::min(std::max(0,v0 + ((y-x)&8) - 4),255); 
-        Image::color_t c0 = img.rgb(v1,v1,v1) ;
-        img.set(x,y,c0) ;
-      }      
-      y++ ;
-    }
+    draw_color_pattern(img, f, NULL);
 
     if (f) fclose(f);
 
@@ -1090,6 +1726,51 @@ int do_test_colors(FrameWriterParams params, wl_shm_format wl_fmt)
   return EXIT_SUCCESS;
 }
 
+//
+// Fake input: check the color test pattern through the combinations of
+// encoders and color settings of --test-color-matrix
+//
+int do_test_color_matrix(FrameWriterParams params, const ColorMatrix &matrix,
+                         wl_shm_format wl_fmt)
+{
+  ColorPattern pattern;
+  pattern.format = get_input_format(wl_fmt);
+  if (pattern.format == INPUT_FORMAT_RGBA16F || pattern.format == INPUT_FORMAT_BGRA16F) {
+    fprintf(stderr, "The color test does not support half float formats\n");
+    return EXIT_FAILURE;
+  }
+
+  Image img( 512, 512, wl_fmt) ;
+  draw_color_pattern(img, NULL, &pattern.bands);
+
+  pattern.width = img.width;
+  pattern.height = img.height;
+  pattern.stride = img.linesize * sizeof(Image::color_t);
+  pattern.pixels = (const uint8_t*) img.data;
+  return do_color_matrix(params, matrix, pattern);
+}
+
+/* Request a screencopy frame of the output or of the selected region */
+static zwlr_screencopy_frame_v1 *capture_frame(wf_recorder_output *output)
+{
+    /* Capture the whole output if the user hasn't provided a good geometry */
+    if (!selected_region.is_selected())
+    {
+        return zwlr_screencopy_manager_v1_capture_output(
+            screencopy_manager,
+            show_cursor ? 1 : 0,
+            output->output);
+    }
+
+    return zwlr_screencopy_manager_v1_capture_output_region(
+        screencopy_manager,
+        show_cursor ? 1 : 0,
+        output->output,
+        selected_region.x - output->x,
+        selected_region.y - output->y,
+        selected_region.width, selected_region.height);
+}
+
 int do_wayland_capture(FrameWriterParams ffmpegParams) 
 {
   
@@ -1165,6 +1846,14 @@ int do_wayland_capture(FrameWriterParams ffmpegParams)
 
     printf("selected region %d %d %d %d\n", selected_region.x, selected_region.y, selected_region.width, selected_region.height);
 
+    if (ffmpegParams.roi_strength > 0 || cursor_min_gap_usec > 0)
+    {
+        use_damage = zwlr_screencopy_manager_v1_get_version(screencopy_manager) >= 2;
+        if (!use_damage)
+            fprintf(stderr, "compositor doesn't support wlr-screencopy-unstable-v1 "
+                "version 2, regions of interest and --cursor-fps are disabled\n");
+    }
+
     timespec first_frame;
     first_frame.tv_sec = -1;
     first_frame.tv_nsec = 0;
@@ -1177,80 +1866,491 @@ int do_wayland_capture(FrameWriterParams ffmpegParams)
         buffer.released = true;
     }
 
-    bool spawned_thread = false;
-    std::thread writer_thread;
+    /* Get the geometry of the buffers from a first screencopy frame, which
+     * is never copied. The encoder is then prepared in the background
+     * while the buffers are allocated, so that the first captured frame
+     * can be encoded immediately. */
+    buffer_geometry geometry;
+    auto probe = capture_frame(chosen_output);
+    zwlr_screencopy_frame_v1_add_listener(probe, &probe_listener, &geometry);
+    while (!geometry.done && wl_display_dispatch(display) != -1) {
+        // This space is intentionally left blank
+    }
+    zwlr_screencopy_frame_v1_destroy(probe);
 
-    signal(SIGINT, handle_sigint);
+    /* From now on, the signals are received by the reactor. They must be
+     * blocked before the other threads are created. */
+    int signal_fd = Reactor::make_signalfd({SIGINT, SIGTERM});
+    buffer_available_fd = Reactor::make_eventfd();
+    buffer_released_fd = Reactor::make_eventfd();
 
-    while(!exit_main_loop)
+    std::shared_future<PrewarmedWriter> prewarmed;
+    if (geometry.done && !geometry.failed)
     {
-
-        // wait for a free buffer
-        while(buffers[active_buffer].released != true) {
-          std::this_thread::sleep_for(std::chrono::microseconds(500));
+        FrameWriterParams params = ffmpegParams;
+        params.format = get_input_format(geometry.format);
+        params.width = geometry.width;
+        params.height = geometry.height;
+        prewarmed = std::async(std::launch::async, [=] () {
+            /* The threads of the encoder are created here */
+            apply_thread_placement(encoder_placement, "wf-prewarm");
+            PrewarmedWriter pw;
+            pw.writer = new FrameWriter(params);
+            pw.format = geometry.format;
+            pw.width = geometry.width;
+            pw.height = geometry.height;
+            std::cout << "Encoder ready after " << std::fixed
+                << std::setprecision(1) << ms_since_startup() << " ms"
+                << std::defaultfloat << std::endl;
+            return pw;
+        }).share();
+
+        for (auto& buffer : buffers)
+        {
+            buffer.wl_buffer = create_shm_buffer(geometry.format,
+                geometry.width, geometry.height, geometry.stride, &buffer.data);
         }
+    }
+
+    bool spawned_thread = false;
+    std::thread writer_thread;
+
+    /* Everything is driven by a single reactor: the Wayland events, the
+     * signals and the buffers released by the writer thread. */
+    Reactor reactor;
 
-        buffer_copy_done = false;
-        struct zwlr_screencopy_frame_v1 *frame = NULL;
+    /* Several copies are requested in advance, each one in its own
+     * buffer of the ring, so that the round-trip to the compositor does
+     * not limit the capture rate. They are published in the order of
+     * the ring, starting with the oldest one. */
+    size_t next_publish = 0;
+    int inflight = 0;
+    int64_t last_presented_usec = -1;
 
-        /* Capture the whole output if the user hasn't provided a good geometry */
-        if (!selected_region.is_selected())
+    auto request_copy = [&] (wf_buffer& buffer) {
+        buffer.released = false;
+        buffer.copy_done = false;
+        buffer.frame = capture_frame(chosen_output);
+        zwlr_screencopy_frame_v1_add_listener(buffer.frame, &frame_listener, &buffer);
+    };
+
+    /* Request copies while there are free buffers. Otherwise, this is
+     * done again when the writer releases one. */
+    auto request_captures = [&] () {
+        while (!exit_main_loop && inflight < max_inflight_frames &&
+            buffers[active_buffer].released)
         {
-            frame = zwlr_screencopy_manager_v1_capture_output(
-                screencopy_manager,
-                show_cursor ? 1 : 0,
-                chosen_output->output);
-        } else
+            request_copy(buffers[active_buffer]);
+            active_buffer = next_frame(active_buffer);
+            inflight++;
+        }
+    };
+
+    reactor.add_display(display, [&] () {
+        if (exit_main_loop)
         {
-            frame = zwlr_screencopy_manager_v1_capture_output_region(
-                screencopy_manager,
-                show_cursor ? 1 : 0,
-                chosen_output->output,
-                selected_region.x - chosen_output->x,
-                selected_region.y - chosen_output->y,
-                selected_region.width, selected_region.height);
+            reactor.stop();
+            return;
         }
 
-        zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, NULL);
+        while (inflight > 0 && buffers[next_publish].copy_done)
+        {
+            auto& buffer = buffers[next_publish];
+            zwlr_screencopy_frame_v1_destroy(buffer.frame);
+            buffer.frame = NULL;
+            buffer.copy_done = false;
+
+            /* The pending copies may be served by the same output frame,
+             * and a copy requested again may be served by a newer frame
+             * than a copy queued after it. A copy which is not newer than
+             * the last published one is stale: it is replaced by a new
+             * copy in the same buffer, which keeps the order of the ring
+             * and the timestamps increasing. */
+            int64_t presented_usec = timespec_to_usec(buffer.presented);
+            if (presented_usec <= last_presented_usec)
+            {
+                request_copy(buffer);
+                break;
+            }
+            last_presented_usec = presented_usec;
 
-        while (!buffer_copy_done && wl_display_dispatch(display) != -1) {
-            // This space is intentionally left blank
-          // std::this_thread::sleep_for(std::chrono::microseconds(500));
-        }
+            if (!spawned_thread)
+            {
+                std::cout << "First frame captured after " << std::fixed
+                    << std::setprecision(1) << ms_since_startup() << " ms"
+                    << std::defaultfloat << std::endl;
+                writer_thread = std::thread([=] () {
+                    write_loop(ffmpegParams, pulseParams, prewarmed);
+                });
+
+                spawned_thread = true;
+            }
 
-        auto& buffer = buffers[active_buffer];
-        //std::cout << "first buffer at " << timespec_to_usec(get_ct()) / 1.0e6<< std::endl;
+            if (first_frame.tv_sec == -1)
+                first_frame = buffer.presented;
 
-        if (!spawned_thread)
-        {
-            writer_thread = std::thread([=] () {
-                write_loop(ffmpegParams, pulseParams);
-            });
+            buffer.base_usec = presented_usec - timespec_to_usec(first_frame);
 
-            spawned_thread = true;
+            publish_buffer(buffer);
+            next_publish = next_frame(next_publish);
+            inflight--;
+            captured_frames++;
         }
 
-        if (first_frame.tv_sec == -1)
-            first_frame = buffer.presented;
+        request_captures();
+    });
 
-        buffer.base_usec = timespec_to_usec(buffer.presented)
-            - timespec_to_usec(first_frame);
+    reactor.add(buffer_released_fd, [&] () {
+        Reactor::drain(buffer_released_fd);
+        request_captures();
+    });
 
-        buffer.released = false;
-        buffer.available = true;
+    reactor.add(signal_fd, [&] () {
+        Reactor::drain(signal_fd);
+        reactor.stop();
+    });
+
+    request_captures();
+    reactor.run();
 
-        active_buffer = next_frame(active_buffer);
-        zwlr_screencopy_frame_v1_destroy(frame);
+    /* The copies in progress are abandoned */
+    for (auto& buffer : buffers)
+    {
+        if (buffer.frame)
+            zwlr_screencopy_frame_v1_destroy(buffer.frame);
+        buffer.frame = NULL;
     }
+    request_exit();
 
-    writer_thread.join();
+    if (spawned_thread)
+        writer_thread.join();
+    else if (prewarmed.valid())
+        delete prewarmed.get().writer;
+
+    close(signal_fd);
+    close(buffer_available_fd);
+    close(buffer_released_fd);
+    buffer_available_fd = buffer_released_fd = -1;
 
     for (auto& buffer : buffers)
-        wl_buffer_destroy(buffer.wl_buffer);
+    {
+        if (buffer.wl_buffer)
+            wl_buffer_destroy(buffer.wl_buffer);
+    }
 
     return EXIT_SUCCESS;
 }
 
+//
+// Fake input: replay a dump made with --dump-raw through write_loop().
+// The frames are given with their original pacing or as fast as
+// the encoder can consume them.
+//
+int do_replay(FrameWriterParams ffmpegParams, const std::string& file, bool max_speed)
+{
+    RawDumpReader replay(file);
+    if (replay.size() == 0)
+    {
+        fprintf(stderr, "No frame in %s\n", file.c_str());
+        return EXIT_FAILURE;
+    }
+
+    /* Only the video is replayed */
+    ffmpegParams.enable_audio = false;
+    ffmpegParams.audio_inputs.clear();
+    ffmpegParams.offline = max_speed;
+
+    active_buffer = 0;
+    for (auto& buffer : buffers)
+    {
+        buffer.wl_buffer = NULL;
+        buffer.available = false;
+        buffer.released = true;
+    }
+
+    int signal_fd = Reactor::make_signalfd({SIGINT, SIGTERM});
+    buffer_available_fd = Reactor::make_eventfd();
+    buffer_released_fd = Reactor::make_eventfd();
+    int timer_fd = Reactor::make_timerfd();
+
+    std::thread writer_thread([=] () {
+        write_loop(ffmpegParams, pulseParams);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    int64_t start_usec = AVClock::now_usec();
+    int64_t first_usec = replay.header(0).presented_usec;
+    size_t count = 0;
+
+    /* Publish the frames until the ring is full or the next one is not
+     * due yet. The reactor calls it again when a buffer is released or
+     * when the timer expires. */
+    Reactor reactor;
+    auto publish_frames = [&] () {
+        while (count < replay.size() && !exit_main_loop)
+        {
+            if (!buffers[active_buffer].released)
+                return;
+
+            const RawFrameHeader& header = replay.header(count);
+            int64_t due_usec = start_usec + header.presented_usec - first_usec;
+            if (!max_speed && AVClock::now_usec() < due_usec)
+            {
+                Reactor::arm_timer(timer_fd, due_usec);
+                return;
+            }
+
+            auto& buffer = buffers[active_buffer];
+            buffer.data = (void*) replay.pixels(count);
+            buffer.format = (wl_shm_format) header.format;
+            buffer.width = header.width;
+            buffer.height = header.height;
+            buffer.stride = header.stride;
+            buffer.y_invert = header.y_invert;
+            buffer.presented.tv_sec = header.presented_usec / 1000000;
+            buffer.presented.tv_nsec = header.presented_usec % 1000000 * 1000;
+            buffer.base_usec = header.presented_usec - first_usec;
+            buffer.damage.assign(header.damage, header.damage + header.damage_count);
+
+            publish_buffer(buffer);
+            active_buffer = next_frame(active_buffer);
+            count++;
+        }
+
+        /* Wait for the encoding of the pending frames */
+        if (exit_main_loop || all_buffers_released())
+            reactor.stop();
+    };
+
+    reactor.add(timer_fd, [&] () {
+        Reactor::drain(timer_fd);
+        publish_frames();
+    });
+    reactor.add(buffer_released_fd, [&] () {
+        Reactor::drain(buffer_released_fd);
+        publish_frames();
+    });
+    reactor.add(signal_fd, [&] () {
+        Reactor::drain(signal_fd);
+        reactor.stop();
+    });
+
+    publish_frames();
+    reactor.run();
+
+    request_exit();
+    writer_thread.join();
+
+    close(signal_fd);
+    close(timer_fd);
+    close(buffer_available_fd);
+    close(buffer_released_fd);
+    buffer_available_fd = buffer_released_fd = -1;
+
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    printf("Replayed %zu frames in %.2fs (%.1f fps)\n", count, seconds,
+        seconds > 0 ? count / seconds : 0.0);
+
+    return EXIT_SUCCESS;
+}
+
+//
+// Fake input: a compositor running in the recorder (see --fake-capture
+// and fake-compositor.hpp). The real capture code is connected to it, so
+// the whole capture path (screencopy, in-flight copies, ring, writer
+// thread, damage, formats, audio) can be exercised and measured without a
+// Wayland session.
+//
+struct FakeCapture
+{
+    int width = 0, height = 0;
+    double fps = 0;
+    wl_shm_format format = WL_SHM_FORMAT_XRGB8888;
+    double seconds = 10;
+};
+
+static int get_bytes_per_pixel(wl_shm_format format)
+{
+    return get_input_format(format) == INPUT_FORMAT_RGBA16F ||
+        get_input_format(format) == INPUT_FORMAT_BGRA16F ? 8 : 4;
+}
+
+/* A gray pixel (v in 0..255) in the given format */
+static uint64_t fake_pixel(wl_shm_format format, int v)
+{
+    switch (get_input_format(format))
+    {
+      case INPUT_FORMAT_X2RGB10:
+      case INPUT_FORMAT_X2BGR10:
+      {
+        uint64_t v10 = (v << 2) | (v >> 6);
+        return (3u << 30) | (v10 << 20) | (v10 << 10) | v10;
+      }
+      case INPUT_FORMAT_RGBA16F:
+      case INPUT_FORMAT_BGRA16F:
+      {
+        // Half floats of v/255 rounded to 8 bits of mantissa (exact
+        // enough for a test pattern) and an opaque alpha.
+        uint16_t h = 0;
+        if (v > 0)
+        {
+            int e = 0;
+            double m = frexp(v / 255.0, &e); // v/255 = m * 2^e, m in [0.5, 1)
+            h = uint16_t(((e + 14) << 10) | (int((m * 2 - 1) * 1024) & 0x3ff));
+        }
+        return uint64_t(h) | (uint64_t(h) << 16) | (uint64_t(h) << 32) |
+            (uint64_t(0x3c00) << 48);
+      }
+      default:
+        return 0xff000000u | (v << 16) | (v << 8) | v;
+    }
+}
+
+static bool parse_fake_capture(const std::string &arg, FakeCapture &fake)
+{
+    int n = 0;
+    if (sscanf(arg.c_str(), "%dx%d@%lf%n", &fake.width, &fake.height, &fake.fps, &n) != 3)
+        return false;
+    if (fake.width < 16 || fake.height < 16 || fake.fps <= 0)
+        return false;
+
+    std::stringstream rest(arg.substr(n));
+    std::string field;
+    std::getline(rest, field, ':'); // empty, before the first ':'
+    while (std::getline(rest, field, ':'))
+    {
+        bool found = false;
+        for (const PixelFormatInfo & it : supported_pixel_formats)
+        {
+            if (field == it.name)
+            {
+                fake.format = it.wl_fmt;
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            char *end = NULL;
+            fake.seconds = strtod(field.c_str(), &end);
+            if (*end || fake.seconds <= 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+int do_fake_capture(FrameWriterParams ffmpegParams, const FakeCapture& fake)
+{
+    FakeCompositorParams compositor_params;
+    compositor_params.width = fake.width;
+    compositor_params.height = fake.height;
+    compositor_params.fps = fake.fps;
+    compositor_params.format = fake.format;
+    compositor_params.bytes_per_pixel = get_bytes_per_pixel(fake.format);
+    compositor_params.background = fake_pixel(fake.format, 64);
+    compositor_params.foreground = fake_pixel(fake.format, 235);
+    compositor_params.seconds = fake.seconds;
+
+    /* wl_display_connect() takes the connection from WAYLAND_SOCKET */
+    FakeCompositor compositor(compositor_params);
+    setenv("WAYLAND_SOCKET", std::to_string(compositor.client_fd()).c_str(), 1);
+
+    int ret = do_wayland_capture(ffmpegParams);
+    compositor.stop();
+    compositor.print_stats(std::cout, captured_frames);
+
+    if (ret == EXIT_SUCCESS && !compositor.passed(captured_frames))
+        ret = EXIT_FAILURE;
+    return ret;
+}
+
+//
+// The workload of --autotune: the buffers of a raw dump (--replay) or a
+// generated pattern (--fake-capture, 1080p60 for 5 seconds by default).
+// The pattern is a texture scrolling horizontally, cut from a canvas
+// wider than the frames so that no frame has to be drawn during the
+// measure.
+//
+int do_autotune_capture(FrameWriterParams params, const std::string& name,
+    FakeCapture fake, const std::string& replay_file)
+{
+    AutotuneWorkload workload;
+    std::unique_ptr<RawDumpReader> replay;
+    std::vector<size_t> replay_frames;
+    std::vector<uint8_t> canvas;
+
+    if (!replay_file.empty())
+    {
+        replay = std::unique_ptr<RawDumpReader> (new RawDumpReader(replay_file));
+        if (replay->size() == 0)
+        {
+            fprintf(stderr, "No frame in %s\n", replay_file.c_str());
+            return EXIT_FAILURE;
+        }
+
+        /* Only the frames of the size of the first one are used */
+        const RawFrameHeader& first = replay->header(0);
+        for (size_t i = 0; i < replay->size(); i++)
+        {
+            if (replay->header(i).width == first.width &&
+                replay->header(i).height == first.height &&
+                replay->header(i).format == first.format)
+                replay_frames.push_back(i);
+        }
+        const RawFrameHeader& last = replay->header(replay_frames.back());
+
+        workload.format = get_input_format((wl_shm_format) first.format);
+        workload.width = first.width;
+        workload.height = first.height;
+        workload.frames = replay_frames.size();
+        workload.fps = last.presented_usec > first.presented_usec ?
+            (workload.frames - 1) * 1e6 / (last.presented_usec - first.presented_usec) : 60;
+        workload.get_frame = [&] (int i, int& stride) {
+            stride = replay->header(replay_frames[i]).stride;
+            return replay->pixels(replay_frames[i]);
+        };
+    } else
+    {
+        if (fake.width == 0)
+        {
+            fake.width = 1920;
+            fake.height = 1080;
+            fake.fps = 60;
+            fake.seconds = 5;
+        }
+
+        const int scroll = 512;
+        int bpp = get_bytes_per_pixel(fake.format);
+        int stride = (fake.width + scroll) * bpp;
+        canvas.resize((size_t) stride * fake.height);
+        for (int y = 0; y < fake.height; y++)
+        {
+            for (int x = 0; x < fake.width + scroll; x++)
+            {
+                /* Blocks of 8x8 with some structure, like text and icons */
+                uint32_t h = (x / 8) * 0x9E3779B1u ^ (y / 8) * 0x85EBCA6Bu;
+                h ^= h >> 15;
+                int v = (h & 3) ? 16 + (x + y) % 64 : 64 + (h >> 8) % 192;
+                uint64_t pixel = fake_pixel(fake.format, v);
+                memcpy(&canvas[(size_t) y * stride + x * bpp], &pixel, bpp);
+            }
+        }
+
+        workload.format = get_input_format(fake.format);
+        workload.width = fake.width;
+        workload.height = fake.height;
+        workload.fps = fake.fps;
+        workload.frames = std::max(1, int(fake.fps * fake.seconds));
+        workload.get_frame = [&, stride, bpp] (int i, int& frame_stride) {
+            frame_stride = stride;
+            return canvas.data() + (i * 4 % scroll) * bpp;
+        };
+    }
+
+    return do_autotune(name, params, workload);
+}
+
 int main(int argc, char *argv[])
 {
     FrameWriterParams params;
@@ -1260,6 +2360,19 @@ int main(int argc, char *argv[])
     params.enable_audio = false;
     params.to_yuv = false;
     params.trace_video_progress=false;   
+    params.adaptive_quality = false;
+    params.static_max_gap_usec = 0;
+    params.roi_strength = 0;
+    params.print_stats = false;
+    params.offline = false;
+    params.separate_audio = false;
+    params.tiles = 1;
+    params.encoder_threads = -1;
+    params.encoder_thread_type = 0;
+    params.filter_threads = 0;
+    params.quality_monitor_interval = 0;
+    params.flush_interval_usec = 2000 * 1000;
+    params.audio_codec = default_audio_codec;
 
     //    FrameWriter::dump_available_encoders(std::cout);
     
@@ -1272,11 +2385,23 @@ int main(int argc, char *argv[])
     enum Mode
       {
        MODE_WAYLAND_CAPTURE, 
-       MODE_TEST_COLORS
+       MODE_TEST_COLORS,
+       MODE_TEST_COLOR_MATRIX,
+       MODE_TRANSCODE,
+       MODE_REPLAY,
+       MODE_FAKE_CAPTURE,
+       MODE_AUTOTUNE
       } ;
 
     Mode mode = MODE_WAYLAND_CAPTURE ;
     wl_shm_format test_format = WL_SHM_FORMAT_XRGB8888 ; 
+    ColorMatrix color_matrix;
+    bool lossless = false ;
+    std::string transcode_input ;
+    std::string replay_file ;
+    bool replay_max_speed = false ;
+    FakeCapture fake_capture ;
+    std::string autotune_preset ;
       
     int c, i;
     std::string param;
@@ -1330,8 +2455,27 @@ int main(int argc, char *argv[])
                 break;
 
             case ARG_AUDIO:
+              {
+                FrameWriterAudioInput in;
+                if (!parse_audio_input(optarg, in)) {
+                  fprintf(stderr,"Invalid gain in '%s' for --%s\n", optarg, long_name(ARG_AUDIO));
+                  exit(1);
+                }
                 params.enable_audio = true;
-                pulseParams.audio_source = optarg ? strdup(optarg) : NULL;
+                params.audio_inputs.push_back(in);
+              }
+              break;
+
+            case ARG_SEPARATE_AUDIO:
+                params.separate_audio = true;
+                break;
+
+            case ARG_AUDIO_LATENCY:
+                pulseParams.latency_ms = atoi(optarg);
+                if (pulseParams.latency_ms <= 0) {
+                  fprintf(stderr,"Invalid latency '%s' for --%s\n", optarg, long_name(ARG_AUDIO_LATENCY));
+                  exit(1);
+                }
                 break;
 
             case ARG_YUV420P:
@@ -1406,6 +2550,192 @@ int main(int argc, char *argv[])
            case ARG_TEST_COLORS:
                 mode = MODE_TEST_COLORS;
                 break;
+
+           case ARG_TEST_COLOR_MATRIX:
+                if (!parse_color_matrix(optarg, color_matrix)) {
+                  fprintf(stderr, "Malformed color matrix '%s' (expect 'ENC,..[:FMT,..[:RANGE,..[:SPACE,..]]]')\n", optarg);
+                  return EXIT_FAILURE;
+                }
+                mode = MODE_TEST_COLOR_MATRIX;
+                break;
+
+           case ARG_ADAPTIVE_QUALITY:
+                params.adaptive_quality = true;
+                break;
+
+           case ARG_DROP_STATIC:
+              {
+                int ms = optarg ? atoi(optarg) : default_static_max_gap_ms;
+                if (ms <= 0) {
+                  fprintf(stderr,"Invalid delay '%s' for --%s\n", optarg, long_name(ARG_DROP_STATIC));
+                  exit(1);
+                }
+                params.static_max_gap_usec = ms * 1000ll;
+              }
+              break;
+
+           case ARG_ROI:
+              {
+                double strength = optarg ? atof(optarg) : default_roi_strength;
+                if (strength <= 0 || strength > 1) {
+                  fprintf(stderr,"Invalid strength '%s' for --%s\n", optarg, long_name(ARG_ROI));
+                  exit(1);
+                }
+                params.roi_strength = strength;
+              }
+              break;
+
+           case ARG_STATS:
+                params.print_stats = true;
+                break;
+
+           case ARG_FLUSH_INTERVAL:
+                {
+                  int ms = atoi(optarg);
+                  if (ms < 0) {
+                    fprintf(stderr, "Invalid delay '%s' for --%s\n", optarg, long_name(ARG_FLUSH_INTERVAL));
+                    return EXIT_FAILURE;
+                  }
+                  params.flush_interval_usec = ms * 1000ll;
+                }
+                break;
+
+           case ARG_QUALITY_MONITOR:
+                params.quality_monitor_interval = atoi(optarg);
+                if (params.quality_monitor_interval < 1) {
+                  fprintf(stderr, "Invalid quality monitor interval '%s'\n", optarg);
+                  return EXIT_FAILURE;
+                }
+                break;
+
+           case ARG_LOSSLESS:
+                lossless = true;
+                break;
+
+           case ARG_TRANSCODE:
+                mode = MODE_TRANSCODE;
+                transcode_input = optarg;
+                break;
+
+           case ARG_DUMP_RAW:
+                dump_raw_file = optarg;
+                break;
+
+           case ARG_REPLAY:
+                mode = MODE_REPLAY;
+                replay_file = optarg;
+                break;
+
+           case ARG_REPLAY_MAX_SPEED:
+                replay_max_speed = true;
+                break;
+
+           case ARG_LIST_ENCODERS:
+                EncoderCache().dump(std::cout);
+                return EXIT_SUCCESS;
+
+           case ARG_CURSOR_FPS:
+                {
+                  double fps = atof(optarg);
+                  if (fps <= 0) {
+                    fprintf(stderr, "Invalid cursor framerate '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                  }
+                  cursor_min_gap_usec = int64_t(1e6 / fps);
+                }
+                break;
+
+           case ARG_FAKE_CAPTURE:
+                if (!parse_fake_capture(optarg, fake_capture)) {
+                  fprintf(stderr, "Malformed fake capture '%s' (expect 'WxH@FPS[:FORMAT][:SECONDS]')\n", optarg);
+                  return EXIT_FAILURE;
+                }
+                mode = MODE_FAKE_CAPTURE;
+                break;
+
+           case ARG_INFLIGHT_FRAMES:
+                max_inflight_frames = atoi(optarg);
+                if (max_inflight_frames < 1 || max_inflight_frames > MAX_BUFFERS/2) {
+                  fprintf(stderr, "Invalid number of inflight frames '%s'\n", optarg);
+                  return EXIT_FAILURE;
+                }
+                break;
+
+           case ARG_TILES:
+                params.tiles = atoi(optarg);
+                if (params.tiles < 1 || params.tiles > 16) {
+                  fprintf(stderr, "Invalid number of tiles '%s' (expect 1 to 16)\n", optarg);
+                  return EXIT_FAILURE;
+                }
+                break;
+
+           case ARG_ENCODER_THREADS:
+                {
+                  char type[16] = "";
+                  int n = sscanf(optarg, "%d:%15s", &params.encoder_threads, type);
+                  if (n < 1 || params.encoder_threads < 0) {
+                    fprintf(stderr, "Invalid encoder threads '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                  }
+                  if (n == 2 && !strcmp(type, "frame")) {
+                    params.encoder_thread_type = FF_THREAD_FRAME;
+                  } else if (n == 2 && !strcmp(type, "slice")) {
+                    params.encoder_thread_type = FF_THREAD_SLICE;
+                  } else if (n == 2) {
+                    fprintf(stderr, "Invalid threading '%s' (expect frame or slice)\n", type);
+                    return EXIT_FAILURE;
+                  }
+                }
+                break;
+
+           case ARG_FILTER_THREADS:
+                params.filter_threads = atoi(optarg);
+                if (params.filter_threads < 1) {
+                  fprintf(stderr, "Invalid number of filter threads '%s'\n", optarg);
+                  return EXIT_FAILURE;
+                }
+                break;
+
+           case ARG_CAPTURE_CPUS:
+           case ARG_ENCODER_CPUS:
+                {
+                  ThreadPlacement &placement = (c == ARG_CAPTURE_CPUS) ?
+                    capture_placement : encoder_placement;
+                  if (!parse_cpu_list(optarg, placement.cpus)) {
+                    fprintf(stderr, "Invalid CPU list '%s' (expect e.g. '0-3,8')\n", optarg);
+                    return EXIT_FAILURE;
+                  }
+                  placement.pinned = true;
+                }
+                break;
+
+           case ARG_CAPTURE_PRIORITY:
+                capture_placement.rt_priority = atoi(optarg);
+                if (capture_placement.rt_priority < 1 || capture_placement.rt_priority > 99) {
+                  fprintf(stderr, "Invalid real-time priority '%s' (expect 1 to 99)\n", optarg);
+                  return EXIT_FAILURE;
+                }
+                break;
+
+           case ARG_PRESET:
+                if (!load_preset(optarg, params, std::cerr))
+                  return EXIT_FAILURE;
+                break;
+
+           case ARG_AUTOTUNE:
+                autotune_preset = optarg;
+                break;
+
+           case ARG_RENDITION:
+              {
+                FrameWriterRendition r;
+                if (!parse_rendition(optarg, r)) {
+                  fprintf(stderr,"Malformed rendition '%s' (expect 'WxH[:BITRATE]:FILE')\n", optarg);
+                  exit(1);
+                }
+                params.renditions.push_back(r);
+              }
+              break;
                 
             default:
                 printf("Non implemented command line option (%s)\n", optarg);
@@ -1419,6 +2749,20 @@ int main(int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
+    if (lossless) {
+      if (mode == MODE_TRANSCODE) {
+        fprintf(stderr, "--%s cannot be used with --%s\n", long_name(ARG_LOSSLESS), long_name(ARG_TRANSCODE));
+        return EXIT_FAILURE;
+      }
+      set_lossless_params(params);
+      if (params.file == default_filename)
+        params.file = default_lossless_filename;
+    }
+
+    // The workload is given by --replay or --fake-capture
+    if (!autotune_preset.empty())
+      mode = MODE_AUTOTUNE;
+
     // Guess the hw_method for some known codecs.
     if ( params.hw_method.empty() && !params.codec.empty() ) {
       auto it = auto_hwaccel.find(params.codec) ;
@@ -1428,16 +2772,10 @@ int main(int argc, char *argv[])
       }
     }   
 
-    // Guess a video filter for some hw methods
-    if ( params.video_filter.empty() && !params.codec.empty() ) {
-      std::cerr << "GUESSING filter\n";
-      auto it = auto_filter.find(params.codec) ;
-      if ( it != auto_filter.end() ) {
-        fprintf(stderr, "Using default filter '%s' for hardware %s\n", it->second.c_str(), params.hw_method.c_str());
-        params.video_filter = it->second ;
-      }
-    }
-    
+    // Remark: The filters uploading the frames to the HW device are
+    //         added by the FrameWriter unless the user filters
+    //         contain 'hwupload', 'hwmap' or 'hwdownload'.
+
     // Sensible default when using vaapi. 
     if ( params.hw_method == "vaapi" ) {
       // TODO: find the first render device.
@@ -1446,11 +2784,41 @@ int main(int argc, char *argv[])
       }
     }
 
+    // Check the encoders and their options now instead of when the
+    // first frame is captured.
+    {
+      EncoderCache encoders;
+      if (!encoders.validate(params, std::cerr))
+        return EXIT_FAILURE;
+    }
+
+    // The other threads are created by the capture thread, so they must
+    // not inherit its CPU set.
+    if (capture_placement.pinned && !encoder_placement.pinned) {
+      sched_getaffinity(0, sizeof(cpu_set_t), &encoder_placement.cpus);
+      encoder_placement.pinned = true;
+    }
+    bool place_capture = capture_placement.pinned || capture_placement.rt_priority > 0;
+    if (place_capture &&
+        (mode == MODE_WAYLAND_CAPTURE || mode == MODE_REPLAY || mode == MODE_FAKE_CAPTURE))
+      apply_thread_placement(capture_placement, "wf-capture");
+
     switch(mode) {
     case MODE_WAYLAND_CAPTURE:
       return do_wayland_capture(params) ;
     case MODE_TEST_COLORS:
       return do_test_colors(params, test_format);
+    case MODE_TEST_COLOR_MATRIX:
+      return do_test_color_matrix(params, color_matrix, test_format);
+    case MODE_TRANSCODE:
+      signal(SIGINT, handle_sigint);
+      return do_transcode(transcode_input, params);
+    case MODE_REPLAY:
+      return do_replay(params, replay_file, replay_max_speed);
+    case MODE_FAKE_CAPTURE:
+      return do_fake_capture(params, fake_capture);
+    case MODE_AUTOTUNE:
+      return do_autotune_capture(params, autotune_preset, fake_capture, replay_file);
     default:
       return EXIT_SUCCESS;
     }
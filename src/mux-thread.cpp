@@ -0,0 +1,149 @@
+#include "mux-thread.hpp"
+#include "thread-placement.hpp"
+#include "averr.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+MuxThread::MuxThread(AVFormatContext *_fmtCtx, const std::string &_file,
+    int64_t _sync_interval_usec) :
+    fmtCtx(_fmtCtx), file(_file), sync_interval_usec(_sync_interval_usec)
+{
+    // Any descriptor of the file can sync the data written by the
+    // AVIOContext. Pipes and devices are not synced.
+    struct stat st;
+    if (sync_interval_usec > 0 && fmtCtx->pb &&
+        stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        fd = open(file.c_str(), O_WRONLY | O_CLOEXEC);
+    }
+
+    thread = std::thread([this] () { loop(); });
+}
+
+MuxThread::~MuxThread()
+{
+    finish();
+}
+
+void MuxThread::write(AVPacket *pkt)
+{
+    AVPacket *copy = av_packet_alloc();
+    av_packet_move_ref(copy, pkt);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(copy);
+        max_queue = std::max(max_queue, queue.size());
+    }
+    cond.notify_one();
+}
+
+void MuxThread::sync()
+{
+    auto start = std::chrono::steady_clock::now();
+    avio_flush(fmtCtx->pb);
+    if (fdatasync(fd) < 0)
+    {
+        std::cerr << "Failed to sync " << file << ": " << strerror(errno) << std::endl;
+        close(fd);
+        fd = -1;
+        return;
+    }
+    int64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    max_sync_usec = std::max(max_sync_usec, usec);
+    syncs++;
+}
+
+void MuxThread::loop()
+{
+    set_thread_name("wf-mux");
+
+    // The packets written since the last sync are only in the page
+    // cache (or in the buffers of the muxer).
+    bool dirty = false;
+    auto interval = std::chrono::microseconds(sync_interval_usec);
+    auto last_sync = std::chrono::steady_clock::now();
+    while (true)
+    {
+        AVPacket *pkt = NULL;
+        bool stop = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (queue.empty() && !done)
+            {
+                // Wake up for the next sync when nothing is captured.
+                if (dirty && fd >= 0)
+                    cond.wait_until(lock, last_sync + interval);
+                else
+                    cond.wait(lock, [this] { return done || !queue.empty(); });
+            }
+            if (!queue.empty())
+            {
+                pkt = queue.front();
+                queue.pop_front();
+            } else
+            {
+                stop = done;
+            }
+        }
+
+        if (pkt)
+        {
+            int err = av_interleaved_write_frame(fmtCtx, pkt);
+            if (err < 0 && !write_failed)
+            {
+                std::cerr << "Failed to write to " << file << ": " << averr(err) << std::endl;
+                write_failed = true;
+            }
+            av_packet_free(&pkt);
+            packets++;
+            dirty = true;
+        }
+        if (stop)
+            break;
+
+        if (dirty && fd >= 0 && std::chrono::steady_clock::now() - last_sync >= interval)
+        {
+            sync();
+            dirty = false;
+            last_sync = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+void MuxThread::finish()
+{
+    if (finished)
+        return;
+    finished = true;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cond.notify_one();
+    thread.join();
+
+    // The trailer is written by the caller, so the file will be
+    // complete and needs no more sync.
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+void MuxThread::print_stats(std::ostream &out)
+{
+    out << "STATS: muxer '" << file << "': " << packets << " packets, "
+        << syncs << " syncs";
+    if (syncs > 0)
+        out << " (longest " << std::fixed << std::setprecision(1)
+            << max_sync_usec / 1000.0 << " ms)" << std::defaultfloat;
+    out << ", longest queue " << max_queue << " packets" << std::endl;
+}
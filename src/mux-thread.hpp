@@ -0,0 +1,63 @@
+#ifndef MUX_THREAD_HPP
+#define MUX_THREAD_HPP
+
+#include <stdint.h>
+#include <string>
+#include <ostream>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+extern "C"
+{
+    #include <libavformat/avformat.h>
+}
+
+// Writes the packets of an output file in its own thread, so that a
+// slow disk never stalls the encoders and the capture. When the
+// interval is not 0 and the output is a regular file, the data written
+// is also flushed to the disk with fdatasync() at most once per
+// interval (see --flush-interval).
+//
+// The header must be written before the thread starts and the trailer
+// after finish().
+class MuxThread
+{
+    AVFormatContext *fmtCtx;
+    std::string file;
+    int64_t sync_interval_usec;
+    int fd = -1;          // used for fdatasync()
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<AVPacket*> queue;
+    bool done = false;
+    bool finished = false;
+
+    // Statistics
+    int64_t packets = 0;
+    int64_t syncs = 0;
+    int64_t max_sync_usec = 0;
+    size_t max_queue = 0;
+    bool write_failed = false;
+
+    void loop();
+    void sync();
+
+    public:
+    MuxThread(AVFormatContext *fmtCtx, const std::string &file,
+        int64_t sync_interval_usec);
+    ~MuxThread();
+
+    /* Queue the packet. Its data is moved and 'pkt' is left blank */
+    void write(AVPacket *pkt);
+
+    /* Write the queued packets and stop the thread */
+    void finish();
+
+    void print_stats(std::ostream &out);
+};
+
+#endif /* end of include guard: MUX_THREAD_HPP */
@@ -0,0 +1,102 @@
+#include "pixel-convert.hpp"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void convert_x2rgb10_to_gbrp10(const uint8_t *src, int src_stride,
+    int width, int height, bool swap_rb, uint8_t *const dst[3], const int dst_stride[3])
+{
+    for (int y = 0; y < height; y++)
+    {
+        const uint32_t *s = (const uint32_t*) (src + (int64_t) y * src_stride);
+        uint16_t *g = (uint16_t*) (dst[0] + (int64_t) y * dst_stride[0]);
+        uint16_t *b = (uint16_t*) (dst[1] + (int64_t) y * dst_stride[1]);
+        uint16_t *r = (uint16_t*) (dst[2] + (int64_t) y * dst_stride[2]);
+        if (swap_rb)
+            std::swap(r, b);
+
+        int x = 0;
+#ifdef __SSE2__
+        // 8 pixels per iteration. The components are at most 10 bits so
+        // the signed saturation of the packing is harmless.
+        const __m128i mask = _mm_set1_epi32(0x3ff);
+        for (; x + 8 <= width; x += 8)
+        {
+            __m128i p0 = _mm_loadu_si128((const __m128i*) (s + x));
+            __m128i p1 = _mm_loadu_si128((const __m128i*) (s + x + 4));
+            __m128i lo = _mm_packs_epi32(_mm_and_si128(p0, mask),
+                _mm_and_si128(p1, mask));
+            __m128i mid = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 10), mask),
+                _mm_and_si128(_mm_srli_epi32(p1, 10), mask));
+            __m128i hi = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 20), mask),
+                _mm_and_si128(_mm_srli_epi32(p1, 20), mask));
+            _mm_storeu_si128((__m128i*) (b + x), lo);
+            _mm_storeu_si128((__m128i*) (g + x), mid);
+            _mm_storeu_si128((__m128i*) (r + x), hi);
+        }
+#endif
+        for (; x < width; x++)
+        {
+            uint32_t p = s[x];
+            b[x] = p & 0x3ff;
+            g[x] = (p >> 10) & 0x3ff;
+            r[x] = (p >> 20) & 0x3ff;
+        }
+    }
+}
+
+// Every half float value mapped to a 16 bit component, so the conversion
+// is a table lookup.
+static uint16_t half_to_u16[65536];
+static std::once_flag half_table_ready;
+
+static void init_half_table()
+{
+    for (int h = 0; h < 65536; h++)
+    {
+        int sign = h >> 15;
+        int exponent = (h >> 10) & 0x1f;
+        int mantissa = h & 0x3ff;
+
+        double v;
+        if (exponent == 0)
+            v = std::ldexp(mantissa, -24);
+        else if (exponent == 31)
+            v = mantissa ? 0 : 1; // NaN and infinity
+        else
+            v = std::ldexp(1024 + mantissa, exponent - 25);
+
+        if (sign || v <= 0)
+            half_to_u16[h] = 0;
+        else if (v >= 1)
+            half_to_u16[h] = 65535;
+        else
+            half_to_u16[h] = uint16_t(v * 65535 + 0.5);
+    }
+}
+
+void convert_rgba16f_to_gbrp16(const uint8_t *src, int src_stride,
+    int width, int height, bool swap_rb, uint8_t *const dst[3], const int dst_stride[3])
+{
+    std::call_once(half_table_ready, init_half_table);
+
+    for (int y = 0; y < height; y++)
+    {
+        const uint16_t *s = (const uint16_t*) (src + (int64_t) y * src_stride);
+        uint16_t *g = (uint16_t*) (dst[0] + (int64_t) y * dst_stride[0]);
+        uint16_t *b = (uint16_t*) (dst[1] + (int64_t) y * dst_stride[1]);
+        uint16_t *r = (uint16_t*) (dst[2] + (int64_t) y * dst_stride[2]);
+        if (swap_rb)
+            std::swap(r, b);
+
+        for (int x = 0; x < width; x++)
+        {
+            r[x] = half_to_u16[s[4*x + 0]];
+            g[x] = half_to_u16[s[4*x + 1]];
+            b[x] = half_to_u16[s[4*x + 2]];
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef PIXEL_CONVERT_HPP
+#define PIXEL_CONVERT_HPP
+
+#include <stdint.h>
+
+// Converters for the captured formats deeper than 8 bits. FFmpeg 4.x has
+// no pixel format for the 2:10:10:10 and the half float layouts used by
+// Wayland, so they are unpacked to planar RGB of the same depth (the
+// order of the planes is G, B, R as in AV_PIX_FMT_GBRP*). The conversion
+// to YUV is then done by the filter graph without losing precision.
+
+/* 32 bit X2RGB10 (or X2BGR10 if 'swap_rb') to AV_PIX_FMT_GBRP10 */
+void convert_x2rgb10_to_gbrp10(const uint8_t *src, int src_stride,
+    int width, int height, bool swap_rb, uint8_t *const dst[3], const int dst_stride[3]);
+
+/* 64 bit half float RGBA (or BGRA if 'swap_rb') to AV_PIX_FMT_GBRP16.
+ * The values are clamped to [0, 1] and the alpha is dropped. */
+void convert_rgba16f_to_gbrp16(const uint8_t *src, int src_stride,
+    int width, int height, bool swap_rb, uint8_t *const dst[3], const int dst_stride[3]);
+
+#endif /* end of include guard: PIXEL_CONVERT_HPP */
@@ -0,0 +1,352 @@
+#include "presets.hpp"
+#include "encoder-cache.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+std::string get_presets_path()
+{
+    std::string dir;
+    if (getenv("XDG_CONFIG_HOME"))
+        dir = getenv("XDG_CONFIG_HOME");
+    else if (getenv("HOME"))
+        dir = std::string(getenv("HOME")) + "/.config";
+    else
+        return "";
+
+    mkdir(dir.c_str(), 0755);
+    dir += "/wf-recorder-x";
+    mkdir(dir.c_str(), 0755);
+    return dir + "/presets";
+}
+
+static std::vector<std::string> read_lines(const std::string &path)
+{
+    std::vector<std::string> lines;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+        lines.push_back(line);
+    return lines;
+}
+
+bool load_preset(const std::string &name, FrameWriterParams &params, std::ostream &err)
+{
+    std::string path = get_presets_path();
+    std::vector<std::string> lines = read_lines(path);
+
+    bool found = false;
+    bool in_section = false;
+    for (const std::string &line : lines)
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (line[0] == '[')
+        {
+            in_section = line == "[" + name + "]";
+            if (in_section)
+            {
+                found = true;
+                params.codec_options.clear();
+                params.hw_method.clear();
+                params.hw_device.clear();
+                params.to_yuv = false;
+            }
+            continue;
+        }
+        if (!in_section)
+            continue;
+
+        size_t pos = line.find('=');
+        std::string key = line.substr(0, pos);
+        std::string value = pos == std::string::npos ? "" : line.substr(pos + 1);
+        if (key == "codec")
+        {
+            params.codec = value;
+        } else if (key == "hw")
+        {
+            params.hw_method = value;
+        } else if (key == "device")
+        {
+            params.hw_device = value;
+        } else if (key == "to_yuv")
+        {
+            params.to_yuv = value == "1";
+        } else if (key == "option" && value.find('=') != std::string::npos)
+        {
+            pos = value.find('=');
+            params.codec_options[value.substr(0, pos)] = value.substr(pos + 1);
+        } else
+        {
+            err << "Ignoring '" << line << "' in preset '" << name << "'" << std::endl;
+        }
+    }
+
+    if (!found)
+        err << "No preset '" << name << "' in " << path << std::endl;
+    return found;
+}
+
+bool save_preset(const std::string &name, const FrameWriterParams &params)
+{
+    std::string path = get_presets_path();
+    if (path.empty())
+        return false;
+
+    // Keep the other presets, and the comments, as they are.
+    std::vector<std::string> lines = read_lines(path);
+    std::string tmp = path + "." + std::to_string(getpid());
+    std::ofstream out(tmp);
+    if (lines.empty())
+        out << "# wf-recorder-x presets (see --preset and --autotune)" << "\n";
+
+    bool in_section = false;
+    for (const std::string &line : lines)
+    {
+        if (!line.empty() && line[0] == '[')
+            in_section = line == "[" + name + "]";
+        if (!in_section)
+            out << line << "\n";
+    }
+
+    out << "[" << name << "]" << "\n";
+    out << "codec=" << params.codec << "\n";
+    if (!params.hw_method.empty())
+        out << "hw=" << params.hw_method << "\n";
+    if (!params.hw_device.empty())
+        out << "device=" << params.hw_device << "\n";
+    out << "to_yuv=" << (params.to_yuv ? 1 : 0) << "\n";
+    for (const auto &opt : params.codec_options)
+        out << "option=" << opt.first << "=" << opt.second << "\n";
+    out.close();
+
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+struct AutotuneCandidate
+{
+    const char *codec;
+    const char *hw_method;
+    std::vector<std::pair<const char*, const char*>> options;
+};
+
+// From the cheapest to the most expensive for each encoder. The
+// unavailable encoders are skipped.
+static const std::vector<AutotuneCandidate> autotune_candidates =
+{
+    { "h264_vaapi", "vaapi", {} },
+    { "hevc_vaapi", "vaapi", {} },
+    { "libx264", "", { { "preset", "ultrafast" } } },
+    { "libx264", "", { { "preset", "superfast" } } },
+    { "libx264", "", { { "preset", "veryfast" } } },
+    { "libx264", "", { { "preset", "faster" } } },
+    { "libx264", "", { { "preset", "fast" } } },
+    { "libx265", "", { { "preset", "ultrafast" } } },
+    { "libx265", "", { { "preset", "superfast" } } },
+    { "libvpx-vp9", "", { { "deadline", "realtime" }, { "cpu-used", "8" }, { "row-mt", "1" } } },
+    { "libvpx", "", { { "deadline", "realtime" }, { "cpu-used", "16" } } },
+};
+
+struct AutotuneResult
+{
+    double fps;       // encoded frames per second
+    double cpu;       // CPU time per second, in cores
+    double bitrate;   // bits per second of video
+};
+
+static std::string describe(const AutotuneCandidate &c)
+{
+    std::string text = c.codec;
+    for (const auto &opt : c.options)
+        text += std::string(" ") + opt.first + "=" + opt.second;
+    return text;
+}
+
+static void apply_candidate(const AutotuneCandidate &c, FrameWriterParams &params)
+{
+    params.codec = c.codec;
+    params.hw_method = c.hw_method;
+    if (params.hw_method.empty())
+        params.hw_device.clear();
+    else if (params.hw_device.empty())
+        params.hw_device = "/dev/dri/renderD128";
+    for (const auto &opt : c.options)
+        params.codec_options[opt.first] = opt.second;
+}
+
+static double get_cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Encode the workload in the current process. The time to open the
+// encoder is not counted but the flush of the delayed frames is.
+static AutotuneResult measure(const FrameWriterParams &params, const AutotuneWorkload &w)
+{
+    std::unique_ptr<FrameWriter> writer(new FrameWriter(params));
+    writer->set_clock_origin(0);
+
+    double cpu_start = get_cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < w.frames; i++)
+    {
+        int stride = 0;
+        const uint8_t *pixels = w.get_frame(i, stride);
+        writer->add_frame(pixels, w.width, w.height, stride, int64_t(i * 1e6 / w.fps), false);
+    }
+    writer = nullptr;
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    AutotuneResult result;
+    result.fps = w.frames / seconds;
+    result.cpu = (get_cpu_seconds() - cpu_start) / seconds;
+
+    struct stat st;
+    result.bitrate = stat(params.file.c_str(), &st) == 0 ?
+        st.st_size * 8.0 * w.fps / w.frames : 0;
+    return result;
+}
+
+// Run measure() in a child process which reports through a pipe.
+static bool run_candidate(const FrameWriterParams &params, const AutotuneWorkload &w,
+    AutotuneResult &result)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return false;
+
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        if (!params.trace_video_progress)
+        {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        AutotuneResult r = measure(params, w);
+        _exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool ok = read(fds[0], &result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    unlink(params.file.c_str());
+    return ok;
+}
+
+int do_autotune(const std::string &name, FrameWriterParams params,
+    const AutotuneWorkload &workload)
+{
+    // Only the video encoder is measured.
+    params.file = "/tmp/wf-recorder-x-autotune-" + std::to_string(getpid()) + ".mkv";
+    params.file_format.clear();
+    params.format = workload.format;
+    params.width = workload.width;
+    params.height = workload.height;
+    params.enable_audio = false;
+    params.audio_inputs.clear();
+    params.renditions.clear();
+    params.tiles = 1;
+    params.adaptive_quality = false;
+    params.static_max_gap_usec = 0;
+    params.roi_strength = 0;
+    params.print_stats = false;
+    params.quality_monitor_interval = 0;
+    params.flush_interval_usec = 0;
+
+    // Some margin is kept for the compositor and the audio.
+    double target_fps = workload.fps * 1.1;
+
+    std::cout << "Encoding " << workload.frames << " frames of " << workload.width
+        << "x" << workload.height << " with each candidate, " << std::fixed
+        << std::setprecision(1) << target_fps << " fps are needed" << std::endl;
+    std::cout << std::left << std::setw(44) << "Candidate" << std::right
+        << std::setw(8) << "fps" << std::setw(8) << "CPU"
+        << std::setw(14) << "bitrate" << std::endl;
+
+    EncoderCache encoders;
+    const AutotuneCandidate *best = NULL;
+    double best_fps = 0;
+    for (const AutotuneCandidate &c : autotune_candidates)
+    {
+        FrameWriterParams p = params;
+        apply_candidate(c, p);
+
+        std::cout << std::left << std::setw(44) << describe(c) << std::right;
+        std::stringstream problems;
+        AutotuneResult r;
+        if (!encoders.validate(p, problems))
+        {
+            std::cout << std::setw(8) << "-" << "  not available" << std::endl;
+            continue;
+        }
+        if (!run_candidate(p, workload, r))
+        {
+            std::cout << std::setw(8) << "-" << "  failed" << std::endl;
+            continue;
+        }
+
+        std::cout << std::setw(8) << r.fps << std::setw(8) << r.cpu
+            << std::setw(9) << r.bitrate / 1e6 << " Mb/s"
+            << (r.fps < target_fps ? "  too slow" : "") << std::endl;
+        if (r.fps >= target_fps && r.fps > best_fps)
+        {
+            best = &c;
+            best_fps = r.fps;
+        }
+    }
+    std::cout << std::defaultfloat;
+
+    if (!best)
+    {
+        std::cerr << "No candidate can encode " << workload.width << "x"
+            << workload.height << " at " << workload.fps << " fps" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Selecting the fastest candidate that keeps up: "
+        << describe(*best) << std::endl;
+
+    apply_candidate(*best, params);
+    if (!save_preset(name, params))
+    {
+        std::cerr << "Failed to save the preset in " << get_presets_path() << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Saved '" << describe(*best) << "' as the preset '" << name
+        << "' in " << get_presets_path() << std::endl;
+    return EXIT_SUCCESS;
+}
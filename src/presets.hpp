@@ -0,0 +1,49 @@
+#ifndef PRESETS_HPP
+#define PRESETS_HPP
+
+#include <stdint.h>
+#include <string>
+#include <functional>
+
+#include "frame-writer.hpp"
+
+// The encoder settings saved under a name (see --preset and --autotune)
+// in $XDG_CONFIG_HOME/wf-recorder-x/presets. A preset holds the encoder,
+// its options, the HW method and device and the --to-yuv flag. The file
+// is made of sections that can also be written by hand:
+//
+//   [laptop]
+//   codec=libx264
+//   to_yuv=1
+//   option=preset=veryfast
+//
+std::string get_presets_path();
+
+/* Replace the encoder settings of 'params' by the preset 'name'. The
+ * problems are printed to 'err' */
+bool load_preset(const std::string &name, FrameWriterParams &params, std::ostream &err);
+
+/* Add or replace the preset 'name' with the encoder settings of 'params' */
+bool save_preset(const std::string &name, const FrameWriterParams &params);
+
+// The frames encoded by each candidate of --autotune.
+struct AutotuneWorkload
+{
+    InputFormat format;
+    int width, height;
+    double fps;        // the capture rate to sustain
+    int frames;
+
+    /* The pixels and the stride of the frame i */
+    std::function<const uint8_t*(int i, int &stride)> get_frame;
+};
+
+// Encode the workload through the FrameWriter with a list of candidate
+// encoders and presets, each one in a child process so that a failing
+// encoder (e.g. no HW device) does not stop the others. The fastest
+// candidate that keeps up with the capture rate is saved as the preset
+// 'name'. The settings of 'params' other than the encoder are kept.
+int do_autotune(const std::string &name, FrameWriterParams params,
+    const AutotuneWorkload &workload);
+
+#endif /* end of include guard: PRESETS_HPP */
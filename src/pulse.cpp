@@ -3,69 +3,261 @@
 #include <iostream>
 #include <vector>
 #include <cstring>
-#include <thread>
+#include <algorithm>
 
 PulseReader::PulseReader(PulseReaderParams _p)
     : params(_p)
 {
+    sample_spec.format = PA_SAMPLE_FLOAT32LE;
+    sample_spec.rate = params.sample_rate;
+    sample_spec.channels = params.channels;
+
+    buffer.resize(params.audio_frame_size);
+
+    std::cout << "Using PulseAudio device: " << (params.audio_source.empty() ? "default" : params.audio_source)
+        << " (" << params.sample_rate << " Hz, " << params.channels << " channels)"
+        << std::endl;
+
+    if (!connect())
+    {
+        std::cerr << "Recording won't have audio" << std::endl;
+        disconnect();
+    }
+}
+
+void PulseReader::context_state_cb(pa_context *, void *userdata)
+{
+    auto pr = (PulseReader*) userdata;
+    pa_threaded_mainloop_signal(pr->mainloop, 0);
+}
+
+void PulseReader::stream_state_cb(pa_stream *, void *userdata)
+{
+    auto pr = (PulseReader*) userdata;
+    pa_threaded_mainloop_signal(pr->mainloop, 0);
+}
+
+void PulseReader::stream_read_cb(pa_stream *s, size_t, void *userdata)
+{
+    auto pr = (PulseReader*) userdata;
+
+    const void *data;
+    size_t size;
+    while (pa_stream_peek(s, &data, &size) == 0 && size > 0)
+    {
+        /* A NULL data with a non-zero size is a hole in the stream */
+        if (!exit_main_loop)
+            pr->push_data(data, size, pr->get_capture_time());
+        pa_stream_drop(s);
+    }
+}
+
+/* The CLOCK_MONOTONIC time at which the next byte to read was captured */
+int64_t PulseReader::get_capture_time()
+{
+    int64_t now = AVClock::now_usec();
+    pa_usec_t latency;
+    int negative;
+    if (pa_stream_get_latency(stream, &latency, &negative) != 0)
+        return now;
+    return negative ? now + latency : now - latency;
+}
+
+/* Cut the data into chunks of audio_frame_size bytes for the encoder */
+void PulseReader::push_data(const void *data, size_t size, int64_t capture_usec)
+{
+    const char *in = (const char*) data;
+    size_t offset = 0;
+    while (size > 0)
+    {
+        if (buffer_fill == 0)
+            chunk_capture_usec = capture_usec + pa_bytes_to_usec(offset, &sample_spec);
+
+        /* Complete chunks are passed without copy */
+        if (buffer_fill == 0 && in && size >= buffer.size())
+        {
+            if (params.trace)
+                report_latency();
+            frame_writer->add_audio(params.audio_index, in, chunk_capture_usec);
+            in += buffer.size();
+            offset += buffer.size();
+            size -= buffer.size();
+            continue;
+        }
+
+        size_t n = std::min(size, buffer.size() - buffer_fill);
+        if (in)
+        {
+            std::memcpy(buffer.data() + buffer_fill, in, n);
+            in += n;
+        } else
+        {
+            std::memset(buffer.data() + buffer_fill, 0, n);
+        }
+        buffer_fill += n;
+        offset += n;
+        size -= n;
+
+        if (buffer_fill == buffer.size())
+        {
+            if (params.trace)
+                report_latency();
+            frame_writer->add_audio(params.audio_index, buffer.data(), chunk_capture_usec);
+            buffer_fill = 0;
+        }
+    }
+}
+
+void PulseReader::report_latency()
+{
+    pa_usec_t latency;
+    int negative;
+    if (pa_stream_get_latency(stream, &latency, &negative) == 0)
+    {
+        std::cerr << "TRACE: audio chunk read latency "
+            << (negative ? "-" : "") << latency << "us\n";
+    }
+}
+
+bool PulseReader::connect()
+{
+    mainloop = pa_threaded_mainloop_new();
+    if (!mainloop)
+    {
+        std::cerr << "Failed to create PulseAudio mainloop" << std::endl;
+        return false;
+    }
+
+    pa_threaded_mainloop_set_name(mainloop,
+        ("wf-pulse" + std::to_string(params.audio_index)).c_str());
+
+    context = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "wf-recorder3");
+    pa_context_set_state_callback(context, context_state_cb, this);
+
+    pa_threaded_mainloop_lock(mainloop);
+    if (pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 ||
+        pa_threaded_mainloop_start(mainloop) < 0)
+    {
+        std::cerr << "Failed to connect to PulseAudio: "
+            << pa_strerror(pa_context_errno(context)) << std::endl;
+        pa_threaded_mainloop_unlock(mainloop);
+        return false;
+    }
+
+    pa_context_state_t cstate;
+    while ((cstate = pa_context_get_state(context)) != PA_CONTEXT_READY)
+    {
+        if (!PA_CONTEXT_IS_GOOD(cstate))
+        {
+            std::cerr << "Failed to connect to PulseAudio: "
+                << pa_strerror(pa_context_errno(context)) << std::endl;
+            pa_threaded_mainloop_unlock(mainloop);
+            return false;
+        }
+        pa_threaded_mainloop_wait(mainloop);
+    }
 
     pa_channel_map map;
     std::memset(&map, 0, sizeof(map));
-    pa_channel_map_init_stereo(&map);
+    pa_channel_map_init_auto(&map, params.channels, PA_CHANNEL_MAP_DEFAULT);
+
+    stream = pa_stream_new(context, "wf-recorder3", &sample_spec, &map);
+    pa_stream_set_state_callback(stream, stream_state_cb, this);
+    pa_stream_set_read_callback(stream, stream_read_cb, this);
 
+    /* Let the server pick the sizes unless a latency is requested */
     pa_buffer_attr attr;
-    attr.maxlength = params.audio_frame_size * 4;
-    attr.fragsize  = params.audio_frame_size * 4;
+    attr.maxlength = (uint32_t) -1;
+    attr.tlength = (uint32_t) -1;
+    attr.prebuf = (uint32_t) -1;
+    attr.minreq = (uint32_t) -1;
+    attr.fragsize = (uint32_t) -1;
 
-    pa_sample_spec sample_spec =
+    /* The stream is started by start() */
+    int flags = PA_STREAM_START_CORKED |
+        PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+    if (params.latency_ms > 0)
     {
-        .format = PA_SAMPLE_FLOAT32LE,
-        .rate = 44100,
-        .channels = 2,
-    };
+        attr.fragsize = pa_usec_to_bytes(params.latency_ms * PA_USEC_PER_MSEC, &sample_spec);
+        flags |= PA_STREAM_ADJUST_LATENCY;
+    }
+
+    if (pa_stream_connect_record(stream,
+            params.audio_source.empty() ? NULL : params.audio_source.c_str(), &attr,
+            (pa_stream_flags_t) flags) < 0)
+    {
+        std::cerr << "Failed to connect PulseAudio stream: "
+            << pa_strerror(pa_context_errno(context)) << std::endl;
+        pa_threaded_mainloop_unlock(mainloop);
+        return false;
+    }
 
-    int perr;
-    std::cout << "Using PulseAudio device: " << (params.audio_source ?: "default") << std::endl;
-    pa = pa_simple_new(NULL, "wf-recorder3", PA_STREAM_RECORD, params.audio_source,
-        "wf-recorder3", &sample_spec, &map, &attr, &perr);
+    pa_stream_state_t sstate;
+    while ((sstate = pa_stream_get_state(stream)) != PA_STREAM_READY)
+    {
+        if (!PA_STREAM_IS_GOOD(sstate))
+        {
+            std::cerr << "Failed to connect PulseAudio stream: "
+                << pa_strerror(pa_context_errno(context)) << std::endl;
+            pa_threaded_mainloop_unlock(mainloop);
+            return false;
+        }
+        pa_threaded_mainloop_wait(mainloop);
+    }
 
-    if (!pa)
+    const pa_buffer_attr *a = pa_stream_get_buffer_attr(stream);
+    if (a)
     {
-        std::cerr << "Failed to connect to PulseAudio: " << pa_strerror(perr)
-            << "\nRecording won't have audio" << std::endl;
+        std::cout << "PulseAudio fragment size: " << a->fragsize << " bytes ("
+            << a->fragsize * 1000 / pa_frame_size(&sample_spec) / params.sample_rate
+            << " ms)" << std::endl;
     }
+
+    pa_threaded_mainloop_unlock(mainloop);
+    return true;
 }
 
-bool PulseReader::loop()
+void PulseReader::disconnect()
 {
-    static std::vector<char> buffer;
-    buffer.resize(params.audio_frame_size);
+    if (mainloop)
+        pa_threaded_mainloop_stop(mainloop);
 
-    int perr;
-    if (pa_simple_read(pa, buffer.data(), buffer.size(), &perr) < 0)
+    if (stream)
     {
-        std::cerr << "Failed to read from PulseAudio stream: "
-            << pa_strerror(perr) << std::endl;
-        return false;
+        pa_stream_disconnect(stream);
+        pa_stream_unref(stream);
+        stream = NULL;
+    }
+
+    if (context)
+    {
+        pa_context_disconnect(context);
+        pa_context_unref(context);
+        context = NULL;
     }
 
-    frame_writer->add_audio(buffer.data());
-    return !exit_main_loop;
+    if (mainloop)
+    {
+        pa_threaded_mainloop_free(mainloop);
+        mainloop = NULL;
+    }
 }
 
 void PulseReader::start()
 {
-    if (!pa)
+    if (!stream)
         return;
 
-    read_thread = std::thread([=] ()
-    {
-        while (loop());
-    });
+    /* From now, the data is delivered to the FrameWriter by the
+     * mainloop thread */
+    pa_threaded_mainloop_lock(mainloop);
+    pa_operation *op = pa_stream_cork(stream, 0, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+    pa_threaded_mainloop_unlock(mainloop);
 }
 
 PulseReader::~PulseReader()
 {
-    if (pa)
-        read_thread.join();
+    disconnect();
 }
@@ -1,24 +1,55 @@
 #ifndef PULSE_HPP
 #define PULSE_HPP
 
-#include <pulse/simple.h>
-#include <pulse/error.h>
-#include <thread>
+#include <pulse/pulseaudio.h>
+#include <vector>
+#include <string>
+#include <stdint.h>
 
 struct PulseReaderParams
 {
     size_t audio_frame_size;
-    /* Can be NULL */
-    char *audio_source;
+    /* Empty for the default source */
+    std::string audio_source;
+    /* The index of the source in FrameWriterParams::audio_inputs */
+    int audio_index;
+
+    /* Must match the audio encoder, see FrameWriter */
+    int sample_rate;
+    int channels;
+
+    /* Requested capture latency. 0 for the PulseAudio default */
+    int latency_ms;
+
+    bool trace;
 };
 
+/* Capture audio using the asynchronous PulseAudio API. The chunks
+ * are delivered to the FrameWriter from the mainloop thread, so each
+ * source is captured in its own thread. */
 class PulseReader
 {
     PulseReaderParams params;
-    pa_simple *pa;
+    pa_sample_spec sample_spec;
+
+    pa_threaded_mainloop *mainloop = NULL;
+    pa_context *context = NULL;
+    pa_stream *stream = NULL;
+
+    /* Incomplete chunk of audio_frame_size bytes */
+    std::vector<char> buffer;
+    size_t buffer_fill = 0;
+    int64_t chunk_capture_usec = 0;  /* capture time of its first byte */
+
+    bool connect();
+    void disconnect();
+    int64_t get_capture_time();
+    void push_data(const void *data, size_t size, int64_t capture_usec);
+    void report_latency();
 
-    bool loop();
-    std::thread read_thread;
+    static void context_state_cb(pa_context *c, void *userdata);
+    static void stream_state_cb(pa_stream *s, void *userdata);
+    static void stream_read_cb(pa_stream *s, size_t nbytes, void *userdata);
 
     public:
     PulseReader(PulseReaderParams params);
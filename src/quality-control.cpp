@@ -0,0 +1,72 @@
+#include "quality-control.hpp"
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+// Weight of the new sample in the exponential moving averages.
+static const double SMOOTHING = 0.1;
+
+// Minimum delay between two level changes. Lowering the level is
+// slower than raising it to avoid oscillations.
+static const int64_t RAISE_DELAY_USEC = 500000;
+static const int64_t LOWER_DELAY_USEC = 3000000;
+
+QualityController::QualityController(int _max_level)
+    : max_level(_max_level)
+{
+}
+
+bool QualityController::update(int64_t pts, int64_t encode_usec,
+    int backlog, int capacity)
+{
+    if (last_pts < 0)
+    {
+        last_pts = pts;
+        last_change = pts;
+        avg_encode = encode_usec;
+        return false;
+    }
+
+    int64_t interval = pts - last_pts;
+    last_pts = pts;
+    if (interval <= 0)
+        return false;
+
+    // The average interval is seeded with the first one measured, as
+    // the encode time is with the first sample. No load can be known
+    // before that.
+    if (avg_interval <= 0)
+        avg_interval = interval;
+    else
+        avg_interval += SMOOTHING * (interval - avg_interval);
+    avg_encode   += SMOOTHING * (encode_usec - avg_encode);
+    avg_backlog  += SMOOTHING * (double(backlog) / capacity - avg_backlog);
+
+    // The encoder is too slow if the ring is filling up or if processing
+    // a frame takes nearly as long as the interval between two frames.
+    double load = avg_encode / avg_interval;
+    bool overloaded = avg_backlog > 0.5 || load > 0.9;
+    bool relaxed = backlog <= 1 && avg_backlog < 0.1 && load < 0.6;
+
+    int new_level = current_level;
+    if (overloaded && pts - last_change >= RAISE_DELAY_USEC)
+        new_level = std::min(current_level + 1, max_level);
+    else if (relaxed && pts - last_change >= LOWER_DELAY_USEC)
+        new_level = std::max(current_level - 1, 0);
+
+    if (new_level == current_level)
+        return false;
+
+    std::stringstream s;
+    s << std::fixed << std::setprecision(1)
+      << "level " << current_level << " -> " << new_level
+      << " (backlog " << backlog << "/" << capacity
+      << ", avg " << avg_backlog * 100 << "%"
+      << ", encode " << avg_encode / 1000 << "ms"
+      << ", interval " << avg_interval / 1000 << "ms)";
+    last_reason = s.str();
+
+    current_level = new_level;
+    last_change = pts;
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef QUALITY_CONTROL_HPP
+#define QUALITY_CONTROL_HPP
+
+#include <stdint.h>
+#include <string>
+
+// A feedback controller that watches how much the encoder is lagging
+// behind the capture and selects a 'pressure level'. Level 0 is the
+// nominal quality. Higher levels are mapped by the FrameWriter to
+// cheaper encoder settings and then to frame decimation.
+class QualityController
+{
+    int max_level;
+    int current_level = 0;
+
+    int64_t last_pts = -1;
+    double avg_interval = 0;    // average time between frames (usec), 0 until seeded
+    double avg_encode = 0;      // average processing time per frame (usec)
+    double avg_backlog = 0;     // average ring occupancy (0..1)
+
+    int64_t last_change = -1;   // pts of the last level change
+    std::string last_reason;
+
+    public:
+    QualityController(int max_level);
+
+    /* Called once per input frame. Return true if the level changed */
+    bool update(int64_t pts_usec, int64_t encode_usec, int backlog, int capacity);
+
+    int level() const { return current_level; }
+    const std::string& reason() const { return last_reason; }
+};
+
+#endif /* end of include guard: QUALITY_CONTROL_HPP */
@@ -0,0 +1,422 @@
+#include "quality-monitor.hpp"
+#include "thread-placement.hpp"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C"
+{
+    #include <libavutil/pixdesc.h>
+}
+
+// Above those numbers, the decoding is late: the packets are dropped
+// and the references are not taken.
+#define QUALITY_MAX_PACKETS 64
+#define QUALITY_MAX_REFERENCES 16
+
+// The PSNR of identical planes
+#define QUALITY_MAX_PSNR 100.0
+
+// Sum of the squared differences of a row
+static uint64_t row_sse(const uint8_t *a, const uint8_t *b, int width)
+{
+    uint64_t sum = 0;
+    int x = 0;
+#ifdef __SSE2__
+    // 16 pixels per iteration. A 32 bit lane cannot overflow for rows
+    // shorter than 32768 pixels.
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + x));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + x));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*) lanes, acc);
+    sum = uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; x < width; x++)
+    {
+        int d = a[x] - b[x];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static uint64_t row_sse(const uint16_t *a, const uint16_t *b, int width)
+{
+    uint64_t sum = 0;
+    for (int x = 0; x < width; x++)
+    {
+        int64_t d = int(a[x]) - int(b[x]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+// The sums over a block of 8x8 samples needed by the SSIM
+struct BlockSums
+{
+    uint64_t a, b, aa, bb, ab;
+};
+
+static BlockSums block_sums(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride)
+{
+    BlockSums s = {0, 0, 0, 0, 0};
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sa = zero, sb = zero, aa = zero, bb = zero, ab = zero;
+    for (int y = 0; y < 8; y++)
+    {
+        __m128i va = _mm_loadl_epi64((const __m128i*) (a + y * a_stride));
+        __m128i vb = _mm_loadl_epi64((const __m128i*) (b + y * b_stride));
+        sa = _mm_add_epi64(sa, _mm_sad_epu8(va, zero));
+        sb = _mm_add_epi64(sb, _mm_sad_epu8(vb, zero));
+        __m128i wa = _mm_unpacklo_epi8(va, zero);
+        __m128i wb = _mm_unpacklo_epi8(vb, zero);
+        aa = _mm_add_epi32(aa, _mm_madd_epi16(wa, wa));
+        bb = _mm_add_epi32(bb, _mm_madd_epi16(wb, wb));
+        ab = _mm_add_epi32(ab, _mm_madd_epi16(wa, wb));
+    }
+    uint32_t lanes[4];
+    s.a = _mm_cvtsi128_si32(sa);
+    s.b = _mm_cvtsi128_si32(sb);
+    _mm_storeu_si128((__m128i*) lanes, aa);
+    s.aa = uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i*) lanes, bb);
+    s.bb = uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i*) lanes, ab);
+    s.ab = uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#else
+    for (int y = 0; y < 8; y++)
+    {
+        for (int x = 0; x < 8; x++)
+        {
+            uint64_t va = a[y * a_stride + x], vb = b[y * b_stride + x];
+            s.a += va;
+            s.b += vb;
+            s.aa += va * va;
+            s.bb += vb * vb;
+            s.ab += va * vb;
+        }
+    }
+#endif
+    return s;
+}
+
+static BlockSums block_sums(const uint16_t *a, int a_stride, const uint16_t *b, int b_stride)
+{
+    BlockSums s = {0, 0, 0, 0, 0};
+    for (int y = 0; y < 8; y++)
+    {
+        for (int x = 0; x < 8; x++)
+        {
+            uint64_t va = a[y * a_stride + x], vb = b[y * b_stride + x];
+            s.a += va;
+            s.b += vb;
+            s.aa += va * va;
+            s.bb += vb * vb;
+            s.ab += va * vb;
+        }
+    }
+    return s;
+}
+
+template <typename T>
+static uint64_t plane_sse(const AVFrame *a, const AVFrame *b, int plane, int width, int height)
+{
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++)
+    {
+        sum += row_sse((const T*) (a->data[plane] + y * a->linesize[plane]),
+            (const T*) (b->data[plane] + y * b->linesize[plane]), width);
+    }
+    return sum;
+}
+
+// The mean SSIM over non overlapping blocks of 8x8 samples. The borders
+// which do not fill a block are ignored.
+template <typename T>
+static double plane_ssim(const AVFrame *a, const AVFrame *b, int plane,
+    int width, int height, double max)
+{
+    const double n = 64;
+    const double c1 = (0.01 * max) * (0.01 * max);
+    const double c2 = (0.03 * max) * (0.03 * max);
+    int a_stride = a->linesize[plane] / sizeof(T);
+    int b_stride = b->linesize[plane] / sizeof(T);
+
+    double sum = 0;
+    int blocks = 0;
+    for (int y = 0; y + 8 <= height; y += 8)
+    {
+        for (int x = 0; x + 8 <= width; x += 8)
+        {
+            BlockSums s = block_sums((const T*) a->data[plane] + y * a_stride + x, a_stride,
+                (const T*) b->data[plane] + y * b_stride + x, b_stride);
+            double ma = s.a / n, mb = s.b / n;
+            double va = s.aa / n - ma * ma;
+            double vb = s.bb / n - mb * mb;
+            double cov = s.ab / n - ma * mb;
+            sum += ((2 * ma * mb + c1) * (2 * cov + c2)) /
+                ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            blocks++;
+        }
+    }
+    return blocks ? sum / blocks : 1.0;
+}
+
+QualityMonitor::QualityMonitor(const AVCodecParameters *par, AVRational time_base,
+    int _interval, bool _trace) :
+    interval(_interval), trace(_trace)
+{
+    AVCodec *codec = avcodec_find_decoder(par->codec_id);
+    if (codec)
+        decoder = avcodec_alloc_context3(codec);
+    if (!decoder || avcodec_parameters_to_context(decoder, par) < 0)
+    {
+        std::cerr << "No decoder for the quality monitor" << std::endl;
+        std::exit(-1);
+    }
+
+    // A single thread, to leave the cores to the encoder.
+    decoder->pkt_timebase = time_base;
+    decoder->thread_count = 1;
+    if (avcodec_open2(decoder, codec, NULL) < 0)
+    {
+        std::cerr << "Failed to open the decoder of the quality monitor" << std::endl;
+        std::exit(-1);
+    }
+
+    thread = std::thread([this] () { decode_loop(); });
+}
+
+QualityMonitor::~QualityMonitor()
+{
+    finish();
+    avcodec_free_context(&decoder);
+}
+
+void QualityMonitor::add_reference(const AVFrame *frame)
+{
+    if (frame_index++ % interval != 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (references.size() >= QUALITY_MAX_REFERENCES)
+        return;
+    AVFrame *clone = av_frame_clone(frame);
+    if (clone)
+        references[clone->pts] = clone;
+}
+
+void QualityMonitor::add_packet(const AVPacket *pkt)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (packets.size() >= QUALITY_MAX_PACKETS)
+        {
+            for (Packet &p : packets)
+                av_packet_free(&p.pkt);
+            dropped_packets += packets.size();
+            packets.clear();
+            resync = true;
+        }
+
+        bool flush = false;
+        if (resync)
+        {
+            if (!(pkt->flags & AV_PKT_FLAG_KEY))
+            {
+                dropped_packets++;
+                return;
+            }
+            resync = false;
+            flush = true;
+        }
+        packets.push_back(Packet{av_packet_clone(pkt), flush});
+    }
+    cond.notify_one();
+}
+
+void QualityMonitor::decode_loop()
+{
+    set_thread_name("wf-quality");
+
+    AVFrame *frame = av_frame_alloc();
+    while (true)
+    {
+        Packet p;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this] { return !packets.empty(); });
+            p = packets.front();
+            packets.pop_front();
+        }
+
+        if (p.flush)
+            avcodec_flush_buffers(decoder);
+
+        // A NULL packet drains the decoder.
+        avcodec_send_packet(decoder, p.pkt);
+        while (avcodec_receive_frame(decoder, frame) == 0)
+        {
+            int64_t pts = frame->best_effort_timestamp;
+            AVFrame *reference = NULL;
+            {
+                // The frames come out in the order of the pts, so the
+                // older references will never be matched.
+                std::lock_guard<std::mutex> lock(mutex);
+                while (!references.empty() && references.begin()->first < pts)
+                {
+                    av_frame_free(&references.begin()->second);
+                    references.erase(references.begin());
+                }
+                if (!references.empty() && references.begin()->first == pts)
+                {
+                    reference = references.begin()->second;
+                    references.erase(references.begin());
+                }
+            }
+
+            if (reference)
+            {
+                compare(frame, reference);
+                av_frame_free(&reference);
+            }
+            av_frame_unref(frame);
+        }
+
+        if (!p.pkt)
+            break;
+        av_packet_free(&p.pkt);
+    }
+    av_frame_free(&frame);
+}
+
+void QualityMonitor::compare(const AVFrame *decoded, const AVFrame *reference)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat) reference->format);
+    if (decoded->format != reference->format || decoded->width != reference->width ||
+        decoded->height != reference->height || !desc ||
+        (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+    {
+        mismatches++;
+        return;
+    }
+
+    // Only the components stored in their own plane are measured
+    // (e.g. the luma of NV12 but not its interleaved chroma).
+    double psnr[4];
+    double ssim = 0;
+    int planes = 0;
+    for (int c = 0; c < desc->nb_components && c < 4; c++)
+    {
+        const AVComponentDescriptor &comp = desc->comp[c];
+        int bytes = (comp.depth + 7) / 8;
+        if (comp.step != bytes || comp.offset != 0 || comp.shift != 0 || bytes > 2)
+            continue;
+
+        bool chroma = (c == 1 || c == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        int width = chroma ? AV_CEIL_RSHIFT(reference->width, desc->log2_chroma_w) :
+            reference->width;
+        int height = chroma ? AV_CEIL_RSHIFT(reference->height, desc->log2_chroma_h) :
+            reference->height;
+        double max = (1 << comp.depth) - 1;
+
+        uint64_t sse = bytes == 1 ?
+            plane_sse<uint8_t>(decoded, reference, comp.plane, width, height) :
+            plane_sse<uint16_t>(decoded, reference, comp.plane, width, height);
+        double mse = double(sse) / (double(width) * height);
+        psnr[planes] = mse > 0 ?
+            std::min(QUALITY_MAX_PSNR, 10 * log10(max * max / mse)) : QUALITY_MAX_PSNR;
+
+        if (planes == 0)
+        {
+            ssim = bytes == 1 ?
+                plane_ssim<uint8_t>(decoded, reference, comp.plane, width, height, max) :
+                plane_ssim<uint16_t>(decoded, reference, comp.plane, width, height, max);
+        }
+        planes++;
+    }
+
+    if (planes == 0)
+    {
+        mismatches++;
+        return;
+    }
+
+    for (int i = 0; i < planes; i++)
+    {
+        sum_psnr[i] += psnr[i];
+        min_psnr[i] = samples ? std::min(min_psnr[i], psnr[i]) : psnr[i];
+    }
+    sum_ssim += ssim;
+    min_ssim = samples ? std::min(min_ssim, ssim) : ssim;
+    nb_planes = planes;
+    samples++;
+
+    if (trace)
+    {
+        std::cerr << "TRACE: quality of frame " << reference->pts << ": PSNR";
+        for (int i = 0; i < planes; i++)
+            std::cerr << (i ? "/" : " ") << std::fixed << std::setprecision(2) << psnr[i];
+        std::cerr << " dB, SSIM " << std::setprecision(4) << ssim
+            << std::defaultfloat << "\n";
+    }
+}
+
+void QualityMonitor::finish()
+{
+    if (finished)
+        return;
+    finished = true;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        packets.push_back(Packet{NULL, false});
+    }
+    cond.notify_one();
+    thread.join();
+
+    for (auto &it : references)
+        av_frame_free(&it.second);
+    references.clear();
+}
+
+void QualityMonitor::print_stats(std::ostream &out)
+{
+    out << "STATS: quality: " << samples << " sampled frames";
+    if (samples > 0)
+    {
+        out << std::fixed << std::setprecision(2) << ", PSNR";
+        for (int i = 0; i < nb_planes; i++)
+            out << (i ? "/" : " ") << sum_psnr[i] / samples;
+        out << " dB (min";
+        for (int i = 0; i < nb_planes; i++)
+            out << (i ? "/" : " ") << min_psnr[i];
+        out << "), SSIM " << std::setprecision(4) << sum_ssim / samples
+            << " (min " << min_ssim << ")" << std::defaultfloat;
+    }
+    if (dropped_packets)
+        out << ", " << dropped_packets << " packets not decoded";
+    if (mismatches)
+        out << ", " << mismatches << " frames not comparable";
+    out << std::endl;
+
+    // The usual encodings of a screen are well above that.
+    if (samples > 0 && sum_psnr[0] / samples < 30)
+    {
+        out << "Warning: the quality of the video is low, check the encoder "
+            "options (-p) and the bitrate" << std::endl;
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef QUALITY_MONITOR_HPP
+#define QUALITY_MONITOR_HPP
+
+#include <stdint.h>
+#include <ostream>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+// Measures the quality of the encoded video while recording (see
+// --quality-monitor). Every packet of the main output is decoded in a
+// side thread, and one frame out of 'interval' given to the encoder is
+// kept as a reference. The PSNR of each plane and the SSIM of the first
+// one are computed between the decoded frame and its reference. The
+// encoding thread only takes references on the frames and the packets.
+//
+// When the side thread cannot keep up, the pending packets are dropped
+// and the decoding starts again at the next keyframe.
+class QualityMonitor
+{
+    int interval;
+    bool trace;
+    AVCodecContext *decoder = NULL;
+    int64_t frame_index = 0;
+
+    struct Packet
+    {
+        AVPacket *pkt;       // NULL to drain the decoder
+        bool flush;          // the previous packets were dropped
+    };
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Packet> packets;
+    std::map<int64_t, AVFrame*> references;   // by pts
+    bool resync = false;    // drop the packets until the next keyframe
+    bool finished = false;
+
+    // Results
+    int samples = 0;
+    int nb_planes = 0;
+    double sum_psnr[4] = {0, 0, 0, 0};
+    double min_psnr[4] = {0, 0, 0, 0};
+    double sum_ssim = 0;
+    double min_ssim = 0;
+    int64_t dropped_packets = 0;
+    int64_t mismatches = 0;     // references not comparable to the output
+
+    void decode_loop();
+    void compare(const AVFrame *decoded, const AVFrame *reference);
+
+    public:
+    /* 'par' and 'time_base' are those of the encoder output */
+    QualityMonitor(const AVCodecParameters *par, AVRational time_base,
+        int interval, bool trace);
+    ~QualityMonitor();
+
+    /* Called with each frame given to the encoder */
+    void add_reference(const AVFrame *frame);
+
+    /* Called with each packet produced by the encoder */
+    void add_packet(const AVPacket *pkt);
+
+    /* Decode the remaining packets and stop the side thread */
+    void finish();
+
+    void print_stats(std::ostream &out);
+};
+
+#endif /* end of include guard: QUALITY_MONITOR_HPP */
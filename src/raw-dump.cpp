@@ -0,0 +1,107 @@
+#include "raw-dump.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t align_size(size_t size)
+{
+    return (size + RAW_DUMP_ALIGN - 1) / RAW_DUMP_ALIGN * RAW_DUMP_ALIGN;
+}
+
+RawDumpWriter::RawDumpWriter(const std::string &_path)
+    : path(_path)
+{
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+
+    RawDumpHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RAW_DUMP_MAGIC, sizeof(header.magic));
+    header.align = RAW_DUMP_ALIGN;
+    fwrite(&header, sizeof(header), 1, file);
+    pad();
+}
+
+RawDumpWriter::~RawDumpWriter()
+{
+    if (fclose(file) != 0)
+        std::cerr << "Failed to write " << path << ": " << strerror(errno) << std::endl;
+}
+
+void RawDumpWriter::pad()
+{
+    static const char zeros[RAW_DUMP_ALIGN] = {};
+    long pos = ftell(file);
+    fwrite(zeros, align_size(pos) - pos, 1, file);
+}
+
+void RawDumpWriter::write(const RawFrameHeader &header, const void *pixels)
+{
+    fwrite(&header, sizeof(header), 1, file);
+    pad();
+    if (fwrite(pixels, header.size, 1, file) != 1)
+    {
+        std::cerr << "Failed to write " << path << ": " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+    pad();
+}
+
+RawDumpReader::RawDumpReader(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+
+    length = st.st_size;
+    void *map = length ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    auto header = (const RawDumpHeader*) map;
+    if (map == MAP_FAILED || length < sizeof(RawDumpHeader) ||
+        memcmp(header->magic, RAW_DUMP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->align != RAW_DUMP_ALIGN)
+    {
+        std::cerr << path << " is not a raw dump" << std::endl;
+        std::exit(-1);
+    }
+    data = (const uint8_t*) map;
+    madvise(map, length, MADV_SEQUENTIAL);
+
+    // Index the frames. A truncated last frame (e.g. the recorder was
+    // killed) is ignored.
+    size_t pos = align_size(sizeof(RawDumpHeader));
+    while (pos + align_size(sizeof(RawFrameHeader)) <= length)
+    {
+        auto frame = (const RawFrameHeader*) (data + pos);
+        size_t next = pos + align_size(sizeof(RawFrameHeader)) + align_size(frame->size);
+        if (next > length || frame->size < (uint64_t) frame->stride * frame->height ||
+            frame->damage_count > RAW_DUMP_MAX_DAMAGE)
+            break;
+        frames.push_back(frame);
+        pos = next;
+    }
+}
+
+RawDumpReader::~RawDumpReader()
+{
+    munmap((void*) data, length);
+}
+
+const uint8_t *RawDumpReader::pixels(size_t i) const
+{
+    return (const uint8_t*) frames[i] + align_size(sizeof(RawFrameHeader));
+}
@@ -0,0 +1,70 @@
+#ifndef RAW_DUMP_HPP
+#define RAW_DUMP_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "frame-writer.hpp"
+
+// A dump of the captured buffers (see --dump-raw and --replay).
+//
+// The file starts with a RawDumpHeader, then each frame is stored as a
+// RawFrameHeader followed by its pixels (stride * height bytes). The
+// headers and the pixels start on a RAW_DUMP_ALIGN boundary so that the
+// pixels can be used directly from a mapping of the file.
+
+#define RAW_DUMP_MAGIC "WFRAWv1"
+#define RAW_DUMP_ALIGN 4096
+#define RAW_DUMP_MAX_DAMAGE 32
+
+struct RawDumpHeader
+{
+    char magic[8];
+    uint32_t align;
+    uint32_t reserved;
+};
+
+struct RawFrameHeader
+{
+    uint32_t format;          // wl_shm_format
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t y_invert;
+    uint32_t damage_count;    // 0 when the damage is not tracked
+    int64_t presented_usec;   // CLOCK_MONOTONIC
+    uint64_t size;            // size of the pixels in bytes
+    FrameRect damage[RAW_DUMP_MAX_DAMAGE];
+};
+
+class RawDumpWriter
+{
+    FILE *file = NULL;
+    std::string path;
+    void pad();
+
+    public:
+    RawDumpWriter(const std::string &path);
+    ~RawDumpWriter();
+
+    void write(const RawFrameHeader &header, const void *pixels);
+};
+
+class RawDumpReader
+{
+    const uint8_t *data = NULL;
+    size_t length = 0;
+    std::vector<const RawFrameHeader*> frames;
+
+    public:
+    RawDumpReader(const std::string &path);
+    ~RawDumpReader();
+
+    size_t size() const { return frames.size(); }
+    const RawFrameHeader &header(size_t i) const { return *frames[i]; }
+    const uint8_t *pixels(size_t i) const;
+};
+
+#endif /* end of include guard: RAW_DUMP_HPP */
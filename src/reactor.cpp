@@ -0,0 +1,179 @@
+#include "reactor.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <wayland-client-core.h>
+
+#define REACTOR_MAX_EVENTS 16
+
+static void check(int ret, const char *what)
+{
+    if (ret < 0)
+    {
+        std::cerr << what << " failed: " << strerror(errno) << std::endl;
+        std::exit(-1);
+    }
+}
+
+Reactor::Reactor()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    check(epoll_fd, "epoll_create1");
+}
+
+Reactor::~Reactor()
+{
+    close(epoll_fd);
+}
+
+void Reactor::add(int fd, std::function<void()> handler)
+{
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev), "epoll_ctl");
+    handlers[fd] = handler;
+}
+
+void Reactor::remove(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    handlers.erase(fd);
+}
+
+void Reactor::add_display(wl_display *_display, std::function<void()> handler)
+{
+    display = _display;
+    display_handler = handler;
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wl_display_get_fd(display);
+    check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev), "epoll_ctl");
+}
+
+void Reactor::run_once(int timeout_ms)
+{
+    if (display)
+    {
+        // The events already queued must be dispatched before waiting.
+        while (wl_display_prepare_read(display) != 0)
+        {
+            wl_display_dispatch_pending(display);
+            display_handler();
+        }
+        wl_display_flush(display);
+
+        if (stopped)
+        {
+            wl_display_cancel_read(display);
+            return;
+        }
+    }
+
+    epoll_event events[REACTOR_MAX_EVENTS];
+    int count = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, timeout_ms);
+    if (count < 0 && errno != EINTR)
+        check(count, "epoll_wait");
+
+    if (display)
+    {
+        bool readable = false;
+        for (int i = 0; i < count; i++)
+            readable = readable || events[i].data.fd == wl_display_get_fd(display);
+
+        if (readable)
+        {
+            if (wl_display_read_events(display) < 0)
+            {
+                std::cerr << "Lost the connection to the compositor" << std::endl;
+                stop();
+                return;
+            }
+        } else
+        {
+            wl_display_cancel_read(display);
+        }
+
+        wl_display_dispatch_pending(display);
+        display_handler();
+    }
+
+    for (int i = 0; i < count && !stopped; i++)
+    {
+        auto it = handlers.find(events[i].data.fd);
+        if (it != handlers.end())
+            it->second();
+    }
+}
+
+void Reactor::run()
+{
+    while (!stopped)
+        run_once();
+}
+
+int Reactor::make_signalfd(std::initializer_list<int> signals)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int sig : signals)
+        sigaddset(&mask, sig);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    check(fd, "signalfd");
+    return fd;
+}
+
+int Reactor::make_eventfd()
+{
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    check(fd, "eventfd");
+    return fd;
+}
+
+void Reactor::notify(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        check(-1, "eventfd write");
+}
+
+void Reactor::drain(int fd)
+{
+    // A signalfd gives 128 bytes per signal, the others 8 bytes.
+    char buf[128 * 4];
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+        // Loop until EAGAIN
+    }
+}
+
+int Reactor::make_timerfd()
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    check(fd, "timerfd_create");
+    return fd;
+}
+
+void Reactor::arm_timer(int fd, int64_t usec)
+{
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = usec / 1000000;
+    spec.it_value.tv_nsec = usec % 1000000 * 1000;
+    // A zero it_value would disarm the timer.
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1;
+    check(timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL), "timerfd_settime");
+}
@@ -0,0 +1,58 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <initializer_list>
+#include <map>
+
+struct wl_display;
+
+// A single threaded event loop over epoll. The handlers are called when
+// their file descriptor is readable. The Wayland display is handled with
+// the wl_display_prepare_read() protocol so that the events can be read
+// together with the other sources without blocking in wl_display_dispatch().
+class Reactor
+{
+    int epoll_fd = -1;
+    std::map<int, std::function<void()>> handlers;
+    bool stopped = false;
+
+    wl_display *display = NULL;
+    std::function<void()> display_handler;
+
+    public:
+    Reactor();
+    ~Reactor();
+
+    /* Call 'handler' when 'fd' is readable */
+    void add(int fd, std::function<void()> handler);
+    void remove(int fd);
+
+    /* Dispatch the Wayland events, then call 'handler' */
+    void add_display(wl_display *display, std::function<void()> handler);
+
+    /* Wait for the next events (at most 'timeout_ms', -1 for no limit)
+     * and call their handlers */
+    void run_once(int timeout_ms = -1);
+    /* Loop until stop() is called by a handler */
+    void run();
+    void stop() { stopped = true; }
+
+    /* Block the signals in the calling thread (and the threads it will
+     * create) and return a signalfd receiving them */
+    static int make_signalfd(std::initializer_list<int> signals);
+    /* A nonblocking eventfd, notified with notify() */
+    static int make_eventfd();
+    static void notify(int fd);
+    /* Reset a signalfd, eventfd or timerfd after it became readable */
+    static void drain(int fd);
+
+    /* A CLOCK_MONOTONIC timerfd, armed with arm_timer() */
+    static int make_timerfd();
+    /* Expire at 'usec' (absolute CLOCK_MONOTONIC time) */
+    static void arm_timer(int fd, int64_t usec);
+};
+
+#endif /* end of include guard: REACTOR_HPP */
@@ -0,0 +1,84 @@
+#include "thread-placement.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+bool parse_cpu_list(const std::string &text, cpu_set_t &cpus)
+{
+    CPU_ZERO(&cpus);
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+    {
+        // Either a range 'FIRST-LAST' or a single CPU
+        int first = 0, last = 0, n = 0;
+        if (sscanf(item.c_str(), "%d-%d%n", &first, &last, &n) != 2 ||
+            n != (int) item.size())
+        {
+            n = 0;
+            if (sscanf(item.c_str(), "%d%n", &first, &n) != 1 || n != (int) item.size())
+                return false;
+            last = first;
+        }
+
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (int cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &cpus);
+    }
+    return CPU_COUNT(&cpus) > 0;
+}
+
+void set_thread_name(const std::string &name)
+{
+    // The name of the main thread is the name of the process, used by
+    // pkill, killall, pidof, ...
+    if (syscall(SYS_gettid) == getpid())
+        return;
+
+    // The kernel truncates the names to 15 characters
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+
+void apply_thread_placement(const ThreadPlacement &placement, const std::string &name)
+{
+    set_thread_name(name);
+
+    int err;
+    if (placement.pinned)
+    {
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement.cpus);
+        if (err != 0)
+            std::cerr << "Failed to pin the " << name << " thread: " << strerror(err) << std::endl;
+    }
+
+    // The threads inherit the scheduler of their creator, which may be
+    // the real-time capture thread.
+    int policy;
+    sched_param current;
+    if (placement.rt_priority == 0 &&
+        pthread_getschedparam(pthread_self(), &policy, &current) == 0 &&
+        policy != SCHED_OTHER)
+    {
+        memset(&current, 0, sizeof(current));
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &current);
+    }
+
+    if (placement.rt_priority > 0)
+    {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = placement.rt_priority;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0)
+        {
+            std::cerr << "Failed to set the real-time priority of the " << name
+                << " thread: " << strerror(err) << " (see RLIMIT_RTPRIO)" << std::endl;
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef THREAD_PLACEMENT_HPP
+#define THREAD_PLACEMENT_HPP
+
+#include <sched.h>
+#include <string>
+
+// Where and how a thread of the recorder runs (see --capture-cpus,
+// --encoder-cpus and --capture-priority). The threads created by a
+// thread inherit its CPU set, so pinning the writer thread before the
+// encoder is opened also pins the threads of the encoder, of the filter
+// graph and of the audio capture.
+struct ThreadPlacement
+{
+    bool pinned = false;
+    cpu_set_t cpus;
+    int rt_priority = 0;   // SCHED_FIFO priority, 0 for the default scheduler
+};
+
+/* Parse a list of CPUs such as "0-3,8" */
+bool parse_cpu_list(const std::string &text, cpu_set_t &cpus);
+
+/* Name the calling thread (at most 15 characters), for top, perf, gdb, ...
+ * The main thread keeps the name of the process. */
+void set_thread_name(const std::string &name);
+
+/* Name the calling thread and apply the placement. A failure (e.g. no
+ * permission for the real-time scheduler) is only a warning. */
+void apply_thread_placement(const ThreadPlacement &placement, const std::string &name);
+
+#endif /* end of include guard: THREAD_PLACEMENT_HPP */
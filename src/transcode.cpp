@@ -0,0 +1,277 @@
+#include "transcode.hpp"
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <algorithm>
+
+void set_lossless_params(FrameWriterParams &params)
+{
+    params.codec = "ffv1";
+    params.codec_options.clear();
+    params.codec_options["level"] = "3";     // needed for the slices
+    params.codec_options["coder"] = "0";     // golomb-rice
+    params.codec_options["context"] = "0";
+    params.codec_options["g"] = "1";
+    params.codec_options["slices"] = "16";
+    params.codec_options["slicecrc"] = "0";
+    params.codec_options["threads"] = "auto";
+    params.encoder_threads = -1;
+    params.encoder_thread_type = 0;
+
+    // Everything else is done by the transcode.
+    params.video_filter.clear();
+    params.to_yuv = false;
+    params.hw_method.clear();
+    params.hw_device.clear();
+    params.renditions.clear();
+    params.tiles = 1;
+    params.adaptive_quality = false;
+    params.roi_strength = 0;
+
+    params.audio_codec = "pcm_f32le";
+}
+
+// An audio stream of the input, decoded and cut into the chunks
+// expected by FrameWriter::add_audio()
+struct AudioDecoder
+{
+    int index;                  // in params.audio_inputs
+    AVStream *stream;
+    AVCodecContext *ctx = NULL;
+    SwrContext *swr = NULL;
+    std::vector<float> converted;
+    std::vector<float> chunk;
+    int fill = 0;               // samples per channel in the chunk
+    int64_t chunk_usec = 0;     // pts of the first sample of the chunk
+};
+
+static AVCodecContext *open_decoder(AVStream *stream)
+{
+    AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!codec)
+    {
+        std::cerr << "No decoder for stream " << stream->index << std::endl;
+        std::exit(-1);
+    }
+
+    AVCodecContext *ctx = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(ctx, stream->codecpar);
+    ctx->pkt_timebase = stream->time_base;
+    ctx->thread_count = 0; // one thread per core
+
+    if (avcodec_open2(ctx, codec, NULL) < 0)
+    {
+        std::cerr << "Failed to open the decoder of stream " << stream->index << std::endl;
+        std::exit(-1);
+    }
+    return ctx;
+}
+
+static void decode_packet(AVCodecContext *ctx, AVPacket *pkt, AVFrame *frame,
+    const std::function<void(AVFrame*)> &consume)
+{
+    if (avcodec_send_packet(ctx, pkt) < 0)
+        return;
+    while (avcodec_receive_frame(ctx, frame) == 0)
+    {
+        consume(frame);
+        av_frame_unref(frame);
+    }
+}
+
+static int64_t frame_usec(AVFrame *frame, AVStream *stream, int64_t origin)
+{
+    int64_t pts = frame->best_effort_timestamp;
+    if (pts == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    return av_rescale_q(pts, stream->time_base, AV_TIME_BASE_Q) - origin;
+}
+
+// The FrameWriter expects packed BGR0 pixels without padding.
+static const uint8_t *get_bgr0_pixels(AVFrame *frame, int width, int height,
+    SwsContext *&sws, std::vector<uint8_t> &pixels)
+{
+    int stride = 4 * width;
+    if (frame->format == AV_PIX_FMT_BGR0 && frame->linesize[0] == stride &&
+        frame->width == width && frame->height == height)
+        return frame->data[0];
+
+    sws = sws_getCachedContext(sws, frame->width, frame->height,
+        (AVPixelFormat) frame->format, width, height, AV_PIX_FMT_BGR0,
+        SWS_POINT, NULL, NULL, NULL);
+    pixels.resize(stride * height);
+    uint8_t *dst[1] = { pixels.data() };
+    int dst_stride[1] = { stride };
+    sws_scale(sws, frame->data, frame->linesize, 0, frame->height, dst, dst_stride);
+    return pixels.data();
+}
+
+static void init_audio_decoder(AudioDecoder &a, FrameWriter &writer)
+{
+    AVCodecContext *ctx = a.ctx;
+    int channels = writer.get_audio_channels();
+    uint64_t in_layout = ctx->channel_layout ?
+        ctx->channel_layout : av_get_default_channel_layout(ctx->channels);
+
+    a.swr = swr_alloc_set_opts(NULL,
+        av_get_default_channel_layout(channels), AV_SAMPLE_FMT_FLT,
+        writer.get_audio_sample_rate(),
+        in_layout, ctx->sample_fmt, ctx->sample_rate, 0, NULL);
+    if (!a.swr || swr_init(a.swr) < 0)
+    {
+        std::cerr << "Failed to initialize swr" << std::endl;
+        std::exit(-1);
+    }
+    a.chunk.resize(writer.get_audio_buffer_size() / sizeof(float));
+}
+
+static void add_audio_frame(AudioDecoder &a, FrameWriter &writer,
+    AVFrame *frame, int64_t usec)
+{
+    int rate = writer.get_audio_sample_rate();
+    int channels = writer.get_audio_channels();
+    int chunk_samples = a.chunk.size() / channels;
+
+    // The first converted sample was delayed by the resampler.
+    if (a.fill == 0 && usec != AV_NOPTS_VALUE)
+        a.chunk_usec = usec - av_rescale(swr_get_delay(a.swr, rate), AV_TIME_BASE, rate);
+
+    int capacity = swr_get_out_samples(a.swr, frame->nb_samples);
+    a.converted.resize(capacity * channels);
+    uint8_t *out = (uint8_t*) a.converted.data();
+    int count = swr_convert(a.swr, &out, capacity,
+        (const uint8_t**) frame->extended_data, frame->nb_samples);
+
+    for (int i = 0; i < count;)
+    {
+        int n = std::min(count - i, chunk_samples - a.fill);
+        memcpy(&a.chunk[a.fill * channels], &a.converted[i * channels],
+            n * channels * sizeof(float));
+        a.fill += n;
+        i += n;
+        if (a.fill == chunk_samples)
+        {
+            writer.add_audio(a.index, a.chunk.data(), a.chunk_usec);
+            a.chunk_usec += av_rescale(chunk_samples, AV_TIME_BASE, rate);
+            a.fill = 0;
+        }
+    }
+}
+
+int do_transcode(const std::string &input, FrameWriterParams params)
+{
+    FrameWriter::initialize_ffmpeg();
+
+    // The frames are read as fast as the encoders take them.
+    params.offline = true;
+
+    AVFormatContext *inCtx = NULL;
+    if (avformat_open_input(&inCtx, input.c_str(), NULL, NULL) < 0 ||
+        avformat_find_stream_info(inCtx, NULL) < 0)
+    {
+        std::cerr << "Failed to open " << input << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int video_index = av_find_best_stream(inCtx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (video_index < 0)
+    {
+        std::cerr << "No video stream in " << input << std::endl;
+        return EXIT_FAILURE;
+    }
+    AVStream *vstream = inCtx->streams[video_index];
+    AVCodecContext *vctx = open_decoder(vstream);
+
+    // All the audio streams of the input are kept (mixed unless
+    // --separate-audio is given).
+    std::vector<AudioDecoder> audio;
+    params.audio_inputs.clear();
+    for (unsigned i = 0; i < inCtx->nb_streams; i++)
+    {
+        AVStream *stream = inCtx->streams[i];
+        if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+            continue;
+
+        AudioDecoder a;
+        a.index = audio.size();
+        a.stream = stream;
+        a.ctx = open_decoder(stream);
+        audio.push_back(a);
+
+        AVDictionaryEntry *title = av_dict_get(stream->metadata, "title", NULL, 0);
+        FrameWriterAudioInput in;
+        in.name = title ? title->value : "";
+        in.gain = 1.0f;
+        params.audio_inputs.push_back(in);
+    }
+    params.enable_audio = !audio.empty();
+
+    params.format = INPUT_FORMAT_BGR0;
+    params.width = vctx->width;
+    params.height = vctx->height;
+
+    int64_t origin = inCtx->start_time == AV_NOPTS_VALUE ? 0 : inCtx->start_time;
+    int64_t frames = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        FrameWriter writer(params);
+        writer.set_clock_origin(0);
+        for (auto &a : audio)
+            init_audio_decoder(a, writer);
+
+        SwsContext *sws = NULL;
+        std::vector<uint8_t> pixels;
+        auto on_video = [&] (AVFrame *frame) {
+            int64_t usec = frame_usec(frame, vstream, origin);
+            if (usec == AV_NOPTS_VALUE)
+                return;
+            writer.add_frame(get_bgr0_pixels(frame, params.width, params.height, sws, pixels),
+                usec, false);
+            frames++;
+        };
+
+        AVPacket *pkt = av_packet_alloc();
+        AVFrame *frame = av_frame_alloc();
+        while (!exit_main_loop && av_read_frame(inCtx, pkt) >= 0)
+        {
+            if (pkt->stream_index == video_index)
+                decode_packet(vctx, pkt, frame, on_video);
+
+            for (auto &a : audio)
+            {
+                if (pkt->stream_index != a.stream->index)
+                    continue;
+                decode_packet(a.ctx, pkt, frame, [&] (AVFrame *f) {
+                    add_audio_frame(a, writer, f, frame_usec(f, a.stream, origin));
+                });
+            }
+            av_packet_unref(pkt);
+        }
+
+        // Drain the decoders.
+        decode_packet(vctx, NULL, frame, on_video);
+        for (auto &a : audio)
+        {
+            decode_packet(a.ctx, NULL, frame, [&] (AVFrame *f) {
+                add_audio_frame(a, writer, f, frame_usec(f, a.stream, origin));
+            });
+            swr_free(&a.swr);
+            avcodec_free_context(&a.ctx);
+        }
+
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        sws_freeContext(sws);
+    }
+
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::cout << "Transcoded " << frames << " frames in " << seconds << "s ("
+        << (seconds > 0 ? frames / seconds : 0) << " fps)" << std::endl;
+
+    avcodec_free_context(&vctx);
+    avformat_close_input(&inCtx);
+    return EXIT_SUCCESS;
+}
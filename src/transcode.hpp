@@ -0,0 +1,17 @@
+#ifndef TRANSCODE_HPP
+#define TRANSCODE_HPP
+
+#include "frame-writer.hpp"
+
+// The codec settings of the lossless intermediate capture (--lossless).
+// FFV1 with golomb coding and no context model is cheap enough to keep
+// up with the capture, and the slices are encoded in parallel.
+void set_lossless_params(FrameWriterParams &params);
+
+// Decode a recording (typically a lossless capture) and encode it again
+// with the FrameWriter pipeline (filters, renditions, ...) as fast as
+// possible. The audio and video settings are taken from 'params' while
+// the size and format of the frames come from the input.
+int do_transcode(const std::string &input, FrameWriterParams params);
+
+#endif /* end of include guard: TRANSCODE_HPP */